@@ -0,0 +1,31 @@
+// The sdisc_static library: everything in SDISC that is not a template,
+// and CPU, compiled once. Whatever links it is built with
+// SDISC_HEADER_ONLY defined to 0, and the same SDISC_PROFILE,
+// SDISC_TRACE, SDISC_TIMING and SDISC_WATCH as here.
+#define SDISC_LIBRARY
+
+#include "SDISC.hpp"
+#include "SDISCAsm.hpp"
+#include "SDISCAsync.hpp"
+#include "SDISCBanks.hpp"
+#include "SDISCConstexpr.hpp"
+#include "SDISCDebug.hpp"
+#include "SDISCDevices.hpp"
+#include "SDISCImage.hpp"
+#include "SDISCJIT.hpp"
+#include "SDISCMetrics.hpp"
+#include "SDISCOptimize.hpp"
+#include "SDISCPool.hpp"
+#include "SDISCProfile.hpp"
+#include "SDISCReplay.hpp"
+#include "SDISCRunner.hpp"
+#include "SDISCSnapshot.hpp"
+#include "SDISCSweep.hpp"
+#include "SDISCSystem.hpp"
+#include "SDISCTiming.hpp"
+#include "SDISCTrace.hpp"
+
+namespace SDISC
+{
+  template class BasicCPU<Features::default_features>;
+}
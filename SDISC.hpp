@@ -2,7 +2,13 @@
 #define SDISC_HPP
 
 #include <cstdint>
+#include <cstdlib>
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace SDISC // Define Types
 {
@@ -41,337 +47,2065 @@ namespace SDISC // OP-Codes
       ADD = 0xC, // Add
       SUB = 0xD, // Subtract
       DIV = 0xE, // Multiply
-      MUL = 0xF  // Divide
+      MUL = 0xF, // Divide
+
+      // Superinstructions (Dispatch::Block only, never encoded)
+      SET = 0x10 // SHB and SLB of the same register
+    };
+
+    // Jumps and STP end a basic block
+    constexpr bool ends_block(BYTE code) { return code <= JIL; }
+
+    // Ticks
+    constexpr COUNT tick_count[0x10] =
+    {
+      // Program Control
+      0,
+      // Jumps and Conditions
+      4, 6, 6,
+      // Load Store Set
+      12, 8, 4, 4,
+      // Bitwise Operators
+      4, 4, 4, 4,
+      // Math Operators
+      8, 8, 16, 32
+    };
+
+    // The largest of tick_count
+    constexpr COUNT max_ticks = 32;
+
+    // Mnemonics
+    constexpr const char* name[0x10] =
+    {
+      "STP",
+      "JAL", "JIE", "JIL",
+      "STR", "LOD", "SHB", "SLB",
+      "AND", "NND", "IOR", "XOR",
+      "ADD", "SUB", "DIV", "MUL"
+    };
+
+    // DIV by zero gives all ones, as on RISC-V, rather than being
+    // undefined on the host. Every engine divides with this.
+    constexpr WORD divide(WORD b, WORD c)
+    { return c == 0 ? WORD(0xffff) : WORD(b / c); }
+
+    // WORDs promote to int, so 0xffff * 0xffff would overflow it.
+    // Every engine multiplies with this.
+    constexpr WORD multiply(WORD b, WORD c)
+    { return WORD(unsigned(b) * c); }
+  }
+}
+
+namespace SDISC // Instructions
+{
+  struct Instruction
+  {
+  public: // Constructor
+    // Instruction() is STP. Left default initialized, as in the arrays of
+    // Program, it is not written at all. Everything else is constexpr.
+    Instruction() = default;
+
+    constexpr Instruction(const BYTE& op)
+      : data{WORD((op & 0xf) << 12)} {}
+
+    constexpr Instruction(const BYTE& op, const BYTE& ra,
+                          const BYTE& rb, const BYTE& rc)
+      : data{WORD((op & 0xf) << 12 |
+                  (ra & 0xf) << 8  |
+                  (rb & 0xf) << 4  |
+                  (rc & 0xf) << 0)} {}
+
+    constexpr Instruction(const BYTE& op, const BYTE& ra, const BYTE& b)
+      : data{WORD((op & 0xf) << 12 |
+                  (ra & 0xf) << 8  |
+                  (b & 0xff) << 0)} {}
+
+    constexpr BYTE code() const { return (data >> 12) & 0xf; }
+    constexpr BYTE rega() const { return (data >> 8)  & 0xf; }
+    constexpr BYTE regb() const { return (data >> 4)  & 0xf; }
+    constexpr BYTE regc() const { return (data >> 0)  & 0xf; }
+    constexpr BYTE byte() const { return (data >> 0)  & 0xff; }
+
+    // The encoded instruction, as stored in program images and traces
+    constexpr WORD word() const { return data; }
+
+    static constexpr Instruction fromWord(const WORD& in)
+    {
+      Instruction out{};
+      out.data = in;
+      return out;
+    }
+
+  private:
+    WORD data;
+  };
+}
+
+namespace SDISC // Constants
+{
+  const std::size_t mem_size = 0x10000;
+  const std::size_t pro_size = 0x10000;
+  const std::size_t reg_size = 0x10;
+
+  const std::size_t page_shift = 8;
+  const std::size_t page_size = std::size_t(1) << page_shift;
+  const std::size_t page_count = mem_size / page_size;
+
+  const WORD init_mem = 0xffff;
+  const WORD init_reg = 0x0000;
+  constexpr Instruction init_pro = Instruction();
+
+  const COUNT no_limit = ~COUNT(0);
+}
+
+// Dispatch engine used by CPU::run() when none is given. Define
+// SDISC_DISPATCH to one of these before including to override it.
+#define SDISC_DISPATCH_SWITCH   0
+#define SDISC_DISPATCH_TABLE    1
+#define SDISC_DISPATCH_THREADED 2
+#define SDISC_DISPATCH_BLOCK    3
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define SDISC_HAS_COMPUTED_GOTO 1
+#else
+  #define SDISC_HAS_COMPUTED_GOTO 0
+#endif
+
+#ifndef SDISC_DISPATCH
+  #if SDISC_HAS_COMPUTED_GOTO
+    #define SDISC_DISPATCH SDISC_DISPATCH_THREADED
+  #else
+    #define SDISC_DISPATCH SDISC_DISPATCH_SWITCH
+  #endif
+#endif
+
+// Define SDISC_PROFILE to 1 before including to build CPU with
+// Features::Profile. It costs nothing at 0.
+#ifndef SDISC_PROFILE
+  #define SDISC_PROFILE 0
+#endif
+
+// Define SDISC_TRACE to 1 before including to build CPU with
+// Features::Trace, for a Tracer from SDISCTrace.hpp.
+#ifndef SDISC_TRACE
+  #define SDISC_TRACE 0
+#endif
+
+// Define SDISC_TIMING to 1 before including to build CPU with
+// Features::Timing, for a Timing model from SDISCTiming.hpp.
+#ifndef SDISC_TIMING
+  #define SDISC_TIMING 0
+#endif
+
+// Define SDISC_WATCH to 1 before including to build CPU with
+// Features::Watch, for watchpoints from SDISCDebug.hpp.
+#ifndef SDISC_WATCH
+  #define SDISC_WATCH 0
+#endif
+
+// Define SDISC_HEADER_ONLY to 0 to link with the sdisc_static library
+// instead, which compiles everything that is not a template, and CPU,
+// once. It must be built with the same SDISC_PROFILE, SDISC_TRACE,
+// SDISC_TIMING and SDISC_WATCH.
+#ifndef SDISC_HEADER_ONLY
+  #define SDISC_HEADER_ONLY 1
+#endif
+
+// Definitions are inline in every file with SDISC_HEADER_ONLY, and only
+// in SDISC.cpp, which defines SDISC_LIBRARY, without it.
+#if SDISC_HEADER_ONLY
+  #define SDISC_INLINE inline
+  #define SDISC_DEFINITIONS 1
+#elif defined(SDISC_LIBRARY)
+  #define SDISC_INLINE
+  #define SDISC_DEFINITIONS 1
+#else
+  #define SDISC_INLINE
+  #define SDISC_DEFINITIONS 0
+#endif
+
+namespace SDISC // Features
+{
+  // What a BasicCPU is built with, as a mask. The code of a feature
+  // that is left out is not compiled at all.
+  namespace Features
+  {
+    enum : unsigned
+    {
+      None    = 0,
+      Ticks   = 1 << 0, // Count tick and keep to tick budgets
+      Profile = 1 << 1, // Fill in profile as the interpreters run
+      Trace   = 1 << 2, // Hand every instruction run to a Tracer
+      Devices = 1 << 3, // Send LOD of device pages to the bus
+      Timing  = 1 << 4, // Ask a Timing model what each instruction costs
+      Watch   = 1 << 5  // Stop after LOD and STR of watched words
+    };
+
+    // What CPU is built with
+    constexpr unsigned default_features = Ticks | Devices
+      | (SDISC_PROFILE ? Profile : None) | (SDISC_TRACE ? Trace : None)
+      | (SDISC_TIMING ? Timing : None) | (SDISC_WATCH ? Watch : None);
+  }
+}
+
+namespace SDISC // Run Control
+{
+  enum class Dispatch
+  {
+    Switch   = SDISC_DISPATCH_SWITCH,  // switch jump table
+    Table    = SDISC_DISPATCH_TABLE,   // member function pointer table
+    Threaded = SDISC_DISPATCH_THREADED, // computed goto, Switch without it
+    Block    = SDISC_DISPATCH_BLOCK     // basic blocks of superinstructions
+  };
+
+  const Dispatch default_dispatch = Dispatch(SDISC_DISPATCH);
+
+  // Reason CPU::run() returned
+  enum class Status
+  {
+    Halted,           // Reached STP, PC is left on the STP
+    TickLimit,        // Next instruction would exceed the tick budget
+    InstructionLimit, // Instruction budget was used up
+    Watchpoint,       // Ran a LOD or STR of a watched word, PC is after it
+    Breakpoint,       // Reached a Debugger breakpoint, PC is left on it
+    Stalled           // LOD of a device that was not ready, PC is left on it
+  };
+
+  struct RunResult
+  {
+    Status status;
+    COUNT instructions; // Instructions executed by this call
+    COUNT ticks;        // Ticks added by this call
+  };
+}
+
+namespace SDISC // Traps
+{
+  // Why a CPU trapped, the first word of its trap frame
+  namespace Fault
+  {
+    enum : WORD
+    {
+      None         = 0,
+      DivideByZero = 1  // DIV with reg[regc] == 0
+    };
+  }
+
+  // Where a CPU sends faults. While enabled, an instruction that faults
+  // runs and costs its ticks but writes no register. Its cause and its
+  // address are stored at frame and frame + 1 of mem, and PC moves to
+  // handler, which can LOD them and JAL back past the fault. While not
+  // enabled, DIV by zero gives 0xffff as OP::divide() does.
+  struct Trap
+  {
+    bool enabled = false;
+    WORD handler = 0;
+    WORD frame = 0xfffe;
+  };
+}
+
+namespace SDISC // Decoded Instructions
+{
+  // An Instruction with its fields unpacked ahead of time, so executing it
+  // needs no shifts or masks. CPU keeps one for every word of program.
+  struct Decoded
+  {
+  public: // Constructor
+    // Not written when default initialized. All zero bytes is STP.
+    Decoded() = default;
+    Decoded(const Instruction& in);
+
+  public: // Variables
+    WORD imm;   // byte, already shifted for SHB
+    BYTE code;
+    BYTE rega;
+    BYTE regb;
+    BYTE regc;
+    WORD ticks; // OP::tick_count[code]
+  };
+
+  // The straight-line run of program from one PC up to, but not including,
+  // the next jump or STP. Dispatch::Block executes the whole body at once
+  // and adds its ticks in one go. CPU keeps one for every word of program.
+  struct Block
+  {
+    std::uint32_t ticks;  // Ticks of the body
+    std::uint32_t length; // Instructions in the body
+    BYTE op;              // Superinstruction starting at this PC, or code
+  };
+}
+
+namespace SDISC // Timing Models
+{
+  // What a BasicCPU with Features::Ticks and Features::Timing charges for
+  // each instruction, in place of OP::tick_count. SDISCTiming.hpp has the
+  // flat model and a pipelined one.
+  class Timing
+  {
+  public:
+    virtual ~Timing() = default;
+
+    // Ticks data at pc takes if it runs next, from reg as it is before.
+    // If they are within budget the CPU runs it and the model moves past
+    // it, otherwise the CPU stops there and may ask again later.
+    virtual COUNT step(WORD pc, const Decoded& data, const WORD* reg, COUNT budget) = 0;
+
+    // The most step() ever says one instruction costs
+    virtual COUNT maxCost() const { return OP::max_ticks; }
+
+    // The CPU was reset
+    virtual void reset() {}
+  };
+}
+
+namespace SDISC // Program Images
+{
+  // Program words together with their decoded form and basic blocks.
+  // Once a CPU has it, it is shared and never changed in place, so any
+  // number of CPUs can run one image.
+  //
+  // STP is all zero bytes in code, decoded and blocks alike, so images
+  // made by make() and load() start from zeroed memory and only write
+  // the words they are given. The rest is never touched, and stays as
+  // zero pages from the OS until something reads it.
+  class Program
+  {
+  public: // Types
+    // Marks memory that is already all zero bytes
+    struct Zeroed {};
+
+  public: // Constructor
+    Program() { clear(); }
+
+    template<class ArrayType>
+    explicit Program(const ArrayType& in_program)
+    { clear(); assign(in_program.begin(), in_program.end()); }
+
+    // Only for memory that is already all zero bytes
+    explicit Program(Zeroed) {}
+
+    template<class Iterator>
+    Program(Zeroed, Iterator begin, Iterator end) { assign(begin, end); }
+
+    /* Shared Images */
+    // Build an image in zeroed memory from Instructions
+    template<class ArrayType>
+    static std::shared_ptr<const Program> make(const ArrayType& in_program);
+
+    // Build an image in zeroed memory from encoded words
+    static std::shared_ptr<const Program> load(const WORD* words, std::size_t count);
+
+    // All STP, shared by every CPU without a program of its own
+    static const std::shared_ptr<const Program>& blank();
+
+  public: // Program Memory
+    void write(WORD address, const Instruction& in);
+
+    // Decodes address as STP, or as code[address] again, leaving code as
+    // it is. Every engine stops there as at a real STP, for breakpoints.
+    void stopAt(WORD address, bool stop);
+
+  private: // Basic Blocks
+    void clear();
+
+    // Rebuilds every block running into address
+    void rebuildBlocks(WORD address);
+
+    // Writes [begin, end) from address 0 over an all STP program
+    template<class Iterator>
+    void assign(Iterator begin, Iterator end);
+
+    void buildBlock(std::size_t address);
+
+  public: // Variables
+    Instruction code[pro_size];
+    Decoded decoded[pro_size];
+    Block blocks[pro_size];
+
+    std::uint32_t length = 0; // Words up to the last one that is not init_pro
+    std::uint32_t edits = 0;  // Bumped by write() and stopAt()
+  };
+
+  // Hands out zeroed memory. Allocations the size of a Program come
+  // straight from the OS, so calloc() does not have to clear them and
+  // their pages are not touched until used.
+  template<class T>
+  struct ZeroAllocator
+  {
+    using value_type = T;
+
+    ZeroAllocator() = default;
+
+    template<class U>
+    ZeroAllocator(const ZeroAllocator<U>&) {}
+
+    T* allocate(std::size_t count)
+    {
+      void* out = std::calloc(count, sizeof(T));
+      if(out == nullptr) throw std::bad_alloc();
+      return static_cast<T*>(out);
+    }
+
+    void deallocate(T* in, std::size_t) { std::free(in); }
+
+    template<class U>
+    bool operator==(const ZeroAllocator<U>&) const { return true; }
+
+    template<class U>
+    bool operator!=(const ZeroAllocator<U>&) const { return false; }
+  };
+}
+
+namespace SDISC // Devices
+{
+  namespace BUS
+  {
+    // Device writes held by a Bus before they are handed over
+    const std::size_t batch_writes = 0x100;
+  }
+
+  struct DeviceWrite
+  {
+    WORD offset; // From the first word the device is mapped at
+    WORD value;
+  };
+
+  // Something on the other end of a range of mem. Reads happen as the
+  // guest makes them. Writes are handed over in batches, in the order
+  // they were made, and always before the next read of any device.
+  class Device
+  {
+  public:
+    virtual ~Device() = default;
+
+    virtual WORD read(WORD offset) = 0;
+    virtual void write(const DeviceWrite* in, std::size_t count) = 0;
+
+    // Whether a read of offset can be answered now. A LOD the device is
+    // not ready for is not made, and stops run() with Status::Stalled.
+    virtual bool ready(WORD offset) { (void)offset; return true; }
+  };
+
+  // Stands between a Bus and its devices on every read, giving what the
+  // guest reads instead. A Recorder logs them, and a Replayer gives the
+  // guest what was logged.
+  class BusTap
+  {
+  public:
+    virtual ~BusTap() = default;
+
+    // address is where the guest read, offset what device would be asked
+    virtual WORD read(WORD address, Device& device, WORD offset) = 0;
+
+    // Whether read() can be answered now, as Device::ready()
+    virtual bool ready(WORD address, Device& device, WORD offset)
+    { (void)address; return device.ready(offset); }
+  };
+
+  // Which pages of mem belong to which device, and the writes made to
+  // them that have not been handed over yet. A Memory attached to a bus
+  // sends LOD and STR of those pages here, and nothing else.
+  class Bus
+  {
+  public: // Constructor
+    Bus() { writes.reserve(BUS::batch_writes); targets.reserve(BUS::batch_writes); }
+
+    Bus(const Bus&) = delete;
+    Bus& operator=(const Bus&) = delete;
+
+  public: // Devices
+    // Maps pages [first, first + count) to device, for memories
+    // attached to this bus from now on
+    void map(std::size_t first, std::size_t count, Device& device);
+
+    Device* device(std::size_t page) const { return pages[page].device; }
+
+    // Sends every read through in_tap, or straight to devices with nullptr
+    void setTap(BusTap* in_tap) { tap = in_tap; }
+    BusTap* tapped() const { return tap; }
+
+  public: // Accesses
+    WORD load(WORD address);
+
+    // Whether the device at address is ready for a load() of it
+    bool ready(WORD address);
+
+    void store(WORD address, WORD value)
+    {
+      const Mapping& page = pages[address >> page_shift];
+      targets.push_back(page.device);
+      writes.push_back(DeviceWrite{WORD(address - page.base), value});
+      if(writes.size() >= BUS::batch_writes && !flushing) flush();
+    }
+
+    // Hand every buffered write to its device
+    void flush();
+
+  private: // Variables
+    struct Mapping
+    {
+      Device* device; // nullptr for RAM
+      WORD base;      // First address of the device
     };
 
-    // Ticks
-    const COUNT tick_count[0x10] =
+    Mapping pages[page_count] = {};
+    BusTap* tap = nullptr;
+
+    // Buffered writes, and the device each one is for
+    std::vector<DeviceWrite> writes;
+    std::vector<Device*> targets;
+
+    // The batch being handed over, while devices may add to writes
+    std::vector<DeviceWrite> batch;
+    std::vector<Device*> batch_targets;
+    bool flushing = false;
+  };
+}
+
+namespace SDISC // Memory Images
+{
+  struct Page
+  {
+    WORD word[page_size];
+  };
+
+  // Contents of mem to start CPUs from, as shared pages. Pages that are
+  // the same in several images are only stored once.
+  class MemoryImage
+  {
+  public: // Constructor
+    MemoryImage();
+
+    template<class ArrayType>
+    explicit MemoryImage(const ArrayType& in_mem);
+
+    // All init_mem, shared by every CPU without an image of its own
+    static const std::shared_ptr<const MemoryImage>& blank();
+    static const std::shared_ptr<const Page>& blankPage();
+
+  public: // Variables
+    std::shared_ptr<const Page> pages[page_count];
+  };
+
+  // A CPU's mem. Reads go through a page table into the image the CPU
+  // started from, and a page is copied into the CPU's own storage the
+  // first time it is written. Starting or resetting a CPU only refills
+  // the page table, and storage is only touched for pages the guest
+  // actually writes. Those are also marked in a bitmap, so a reset() to
+  // the image mem already has, as restoring the same snapshot again
+  // does, only puts back the entries of the pages that were written.
+  //
+  // Pages a device is mapped to are marked in a bitmap and left null in
+  // both page tables. Reads only test the pointer they already load, and
+  // writes reach the bus from the path that would otherwise copy a page.
+  class Memory
+  {
+  public: // Types
+    // Both page tables, kept together so native code can index them
+    struct Table
+    {
+      const WORD* read[page_count]; // Where each page is read from
+      WORD* write[page_count];      // Own copy of each page, or nullptr
+    };
+
+    // What mem[address] gives on a non-const Memory, so that reading
+    // through it does not copy the page
+    class Reference
+    {
+    public:
+      Reference(Memory& in_memory, WORD in_address)
+        : memory(in_memory), address{in_address} {}
+
+      operator WORD() const { return memory.load(address); }
+
+      Reference& operator=(WORD value)
+      { memory.store(address, value); return *this; }
+
+      Reference& operator=(const Reference& in)
+      { return *this = WORD(in); }
+
+    private:
+      Memory& memory;
+      WORD address;
+    };
+
+  public: // Constructor
+    Memory() { reset(MemoryImage::blank()); }
+
+    Memory(const Memory& in) { *this = in; }
+    Memory& operator=(const Memory& in);
+
+  public: // Memory Control
+    void reset(const std::shared_ptr<const MemoryImage>& in_image);
+    const std::shared_ptr<const MemoryImage>& image() const { return base; }
+
+    WORD load(WORD address) const
+    {
+      const WORD* page = table.read[address >> page_shift];
+      if(page == nullptr) return bus->load(address);
+      return page[address & (page_size - 1)];
+    }
+
+    // Whether a load() of address can be answered now
+    bool ready(WORD address) const
+    { return table.read[address >> page_shift] != nullptr || bus->ready(address); }
+
+    // load(), unless address is on a device that is not ready for it
+    bool tryLoad(WORD address, WORD& out) const
+    {
+      const WORD* page = table.read[address >> page_shift];
+      if(page != nullptr) { out = page[address & (page_size - 1)]; return true; }
+      if(!bus->ready(address)) return false;
+      out = bus->load(address);
+      return true;
+    }
+
+    // load() for a CPU built without Features::Devices, which never has
+    // a bus attached
+    WORD loadRAM(WORD address) const
+    { return table.read[address >> page_shift][address & (page_size - 1)]; }
+
+    void store(WORD address, WORD value)
+    {
+      WORD* page = table.write[address >> page_shift];
+      if(page == nullptr)
+      {
+        if(device(address >> page_shift)) { bus->store(address, value); return; }
+        page = own(address >> page_shift);
+      }
+
+      page[address & (page_size - 1)] = value;
+    }
+
+    WORD operator[](WORD address) const { return load(address); }
+    Reference operator[](WORD address) { return Reference(*this, address); }
+
+    /* Pages */
+    // Copies a page out of the image, returning where it can be written
+    WORD* own(std::size_t page);
+    bool owns(std::size_t page) const { return table.write[page] != nullptr; }
+
+    // Pages written since the last reset() or freeze()
+    std::size_t dirty() const;
+
+    // Makes the current contents the new image, copying only the dirty
+    // pages, which then stop being dirty
+    const std::shared_ptr<const MemoryImage>& freeze();
+
+    /* Devices */
+    // Sends every page with a device on bus there until detach()
+    void attach(Bus& in_bus);
+    void detach();
+
+    Bus* attached() const { return bus; }
+
+    bool device(std::size_t page) const
+    { return (devices[page / 64] >> (page % 64)) & 1; }
+
+    // Hand buffered device writes over now
+    void flush() { if(bus != nullptr) bus->flush(); }
+
+  public: // Variables
+    Table table;
+
+  private:
+    // Nulls the page table entries of device pages
+    void mapDevices();
+
+    std::shared_ptr<const MemoryImage> base;
+    Page storage[page_count];
+
+    Bus* bus = nullptr;
+    std::uint64_t devices[page_count / 64] = {};
+    std::uint64_t written[page_count / 64] = {}; // Pages that are owned
+  };
+}
+
+namespace SDISC // Profiling
+{
+  // Execution counts gathered by a CPU with Features::Profile. Everything
+  // is recorded just before an instruction runs, so a branch is taken
+  // if its condition holds then. Ticks are the flat tick_count ones. A
+  // JAL back to where the innermost open call links is a return, not a
+  // call, so it is kept off calls.
+  struct Profile
+  {
+    Profile() : pc_count(pro_size), taken(pro_size) {}
+
+    void clear()
+    {
+      std::fill(op_count, op_count + 0x10, 0);
+      std::fill(op_ticks, op_ticks + 0x10, 0);
+      std::fill(pc_count.begin(), pc_count.end(), 0);
+      std::fill(taken.begin(), taken.end(), 0);
+      calls.clear();
+      stack.clear();
+    }
+
+    void record(WORD pc, const Decoded& data, const WORD* reg);
+
+    // Key of calls, the JAL at site jumping to target
+    static std::uint32_t edge(WORD site, WORD target)
+    { return std::uint32_t(site) << 16 | target; }
+
+    COUNT op_count[0x10] = {};
+    COUNT op_ticks[0x10] = {};
+    std::vector<COUNT> pc_count; // Executions of each PC
+    std::vector<COUNT> taken;    // Times the JIE/JIL at each PC jumped
+    std::unordered_map<std::uint32_t, COUNT> calls; // By edge()
+    std::vector<WORD> stack; // Where each open call links back to
+  };
+}
+
+namespace SDISC // Snapshots
+{
+  // Everything needed to put a CPU back where it was. The images are
+  // shared, so snapshots are cheap to keep and to copy.
+  struct Snapshot
+  {
+    WORD PC;
+    WORD reg[reg_size];
+    COUNT tick;
+    Trap trap;
+
+    std::shared_ptr<const Program> program;
+    std::shared_ptr<const MemoryImage> mem;
+  };
+}
+
+namespace SDISC // CPU
+{
+  class Tracer;
+
+  // Stands in for the state of a feature a CPU is built without
+  struct NoFeature {};
+
+  // What a Tracer needs from before an instruction ran
+  struct TraceState
+  {
+    Tracer* tracer = nullptr; // Not owned, nothing is traced without one
+    WORD pc = 0;
+    WORD addr = 0;
+    COUNT tick = 0;
+  };
+
+  // The Timing model of a CPU, and what it said the next instruction costs
+  struct TimingState
+  {
+    Timing* model = nullptr; // Not owned, OP::tick_count without one
+    COUNT cost = 0;
+  };
+
+  // What a watched word stops, as a mask
+  namespace Access
+  {
+    enum : BYTE
+    {
+      None  = 0,
+      Read  = 1 << 0, // LOD
+      Write = 1 << 1, // STR
+      Both  = Read | Write
+    };
+  }
+
+  // The words a CPU with Features::Watch stops at. A bitmap of pages is
+  // tested first, so only accesses to a page with a watched word test
+  // the bitmap of words. The access that hits is kept until run() starts
+  // again.
+  struct WatchState
+  {
+    // What stops at address from now on, Access::None for nothing
+    void set(WORD address, BYTE access);
+    bool any() const { return count != 0; }
+
+    // access is Read or Write
+    bool hits(WORD address, BYTE access) const
+    {
+      const std::size_t side = access >> 1, page = address >> page_shift;
+      return ((pages[side][page / 64] >> (page % 64)) & 1) &&
+             ((words[side][address / 64] >> (address % 64)) & 1);
+    }
+
+    std::uint64_t pages[2][page_count / 64] = {}; // Read, then Write
+    std::uint64_t words[2][mem_size / 64] = {};
+    std::size_t count = 0; // Words with something watched
+
+    // The last hit
+    bool hit = false;
+    BYTE access = Access::None;
+    WORD pc = 0;
+    WORD address = 0;
+  };
+
+  // A CPU built with the Features in the mask F. Engines, snapshots and
+  // the rest of SDISC use CPU, which is built with default_features.
+  template<unsigned F>
+  class BasicCPU
+  {
+  public: // Features
+    static constexpr unsigned features = F;
+
+    static constexpr bool has(unsigned feature)
+    { return (F & feature) == feature; }
+
+  public: // CPU Control
+    BasicCPU(){ reset(); }
+
+    void reset()
+    {
+      tick = 0;
+      faults = 0;
+      if constexpr(has(Features::Profile)) profile.clear();
+      if constexpr(has(Features::Timing)) { if(timing.model) timing.model->reset(); }
+      loadProgram(Program::blank());
+      mem.reset(MemoryImage::blank());
+      for(WORD& i : reg) i = init_reg;
+    }
+
+    /* Program Memory */
+    // Builds a new image from in_program, or shares an existing one
+    template<class ArrayType>
+    void loadProgram(const ArrayType in_program)
+    { loadProgram(Program::make(in_program)); }
+
+    void loadProgram(std::shared_ptr<const Program> in_image)
+    {
+      image = std::move(in_image);
+      program = image->code;
+      decoded = image->decoded;
+      blocks = image->blocks;
+      ++revision;
+    }
+
+    const std::shared_ptr<const Program>& programImage() const
+    { return image; }
+
+    // Copies the image first if any other CPU is sharing it
+    void writeProgram(WORD address, const Instruction& in)
+    {
+      std::shared_ptr<Program> own = std::const_pointer_cast<Program>(image);
+      if(image.use_count() != 1) own = std::make_shared<Program>(*image);
+
+      own->write(address, in);
+      loadProgram(std::shared_ptr<const Program>(std::move(own)));
+    }
+
+    /* Data Memory */
+    void loadMemory(const std::shared_ptr<const MemoryImage>& in_image)
+    { mem.reset(in_image); }
+
+  public: // Snapshots
+    BasicCPU(const Snapshot& in) : BasicCPU() { restore(in); }
+
+    // Captures the whole CPU, copying only the pages of mem written
+    // since the last snapshot. Both the snapshot and the CPU keep sharing
+    // everything else, and the CPU copies pages again as it writes them.
+    Snapshot snapshot();
+    void restore(const Snapshot& in);
+
+    // A new CPU starting from a snapshot of this one
+    std::unique_ptr<BasicCPU> fork()
+    { return std::unique_ptr<BasicCPU>(new BasicCPU(snapshot())); }
+
+  public: // Instructions
+    /* Execute Instruction */
+    // A LOD of a device that is not ready leaves PC on it and takes no
+    // ticks
+    COUNT CYCLE()
+    {
+      const Decoded& data = decoded[PC];
+      if(blocked(data)) return 0;
+      costOf(PC, data, no_limit);
+      beforeStep(PC, data);
+      ++PC; const COUNT ticks = RUN(data);
+      afterStep(data);
+      return ticks;
+    }
+
+    // With a Timing model, charges what costOf() last said
+    COUNT RUN(const Decoded&);
+
+    /* Execute until STP or a budget runs out */
+    // Without Features::Ticks tick stays 0 and max_ticks is ignored
+    RunResult run(COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit,
+                  Dispatch engine = default_dispatch);
+
+    // Runs data as if it were the instruction at PC, as run() with one
+    // instruction would, whatever decoded holds there
+    RunResult step(const Decoded& data, COUNT max_ticks = no_limit);
+
+    /* Program Control */
+    COUNT STP(const Decoded&); // 0 Ticks
+
+    /* Jumps/Conditions */
+    COUNT JAL(const Decoded&); // 4 Ticks
+    COUNT JIE(const Decoded&); // 6 Ticks
+    COUNT JIL(const Decoded&); // 6 Ticks
+
+    /* Load/Store/Set */
+    COUNT STR(const Decoded&); // 12 Ticks
+    COUNT LOD(const Decoded&); // 8 Ticks
+    COUNT SHB(const Decoded&); // 4 Ticks
+    COUNT SLB(const Decoded&); // 4 Ticks
+
+    /* Bitwise Operators */
+    COUNT AND(const Decoded&); // 4 Ticks
+    COUNT NND(const Decoded&); // 4 Ticks
+    COUNT IOR(const Decoded&); // 4 Ticks
+    COUNT XOR(const Decoded&); // 4 Ticks
+
+    /* Mathmatical Operators */
+    COUNT ADD(const Decoded&); // 8 Ticks
+    COUNT SUB(const Decoded&); // 8 Ticks
+    COUNT MUL(const Decoded&); // 16 Ticks
+    COUNT DIV(const Decoded&); // 32 Ticks
+
+    /* Traps */
+    // Traps the instruction at pc as cause, with trap enabled
+    void fault(WORD cause, WORD pc);
+
+    /* Clock Function */
+    COUNT addTicks(const Decoded& data)
+    {
+      const COUNT ticks = timed() ? timingCost() : data.ticks;
+      if constexpr(has(Features::Ticks)) tick += ticks;
+      return ticks;
+    }
+
+    /* Timing */
+    // Ticks data at pc takes if it runs next. Interpreters ask before
+    // running it, and run it if it is within budget.
+    COUNT costOf(WORD pc, const Decoded& data, COUNT budget)
+    {
+      if constexpr(has(Features::Timing))
+      {
+        if(timing.model != nullptr)
+        { return timing.cost = timing.model->step(pc, data, reg, budget); }
+      }
+
+      (void)pc; (void)budget;
+      return data.ticks;
+    }
+
+    // Whether a Timing model is charging ticks
+    bool timed() const
+    {
+      if constexpr(has(Features::Timing)) return timing.model != nullptr;
+      else return false;
+    }
+
+    // The most one instruction can cost, so a run() with at least this
+    // many ticks always gets past the next one unless it stops there
+    COUNT maxCost() const
+    {
+      if constexpr(has(Features::Timing))
+      { if(timing.model != nullptr) return timing.model->maxCost(); }
+
+      return OP::max_ticks;
+    }
+
+    /* Watchpoints */
+    // Makes a LOD or STR of address as access says stop run() after it,
+    // or nothing with Access::None. False without Features::Watch.
+    bool watchWord(WORD address, BYTE access)
+    {
+      if constexpr(has(Features::Watch)) { watch.set(address, access); return true; }
+      (void)address; (void)access;
+      return false;
+    }
+
+    bool watching() const
+    {
+      if constexpr(has(Features::Watch)) return watch.any();
+      else return false;
+    }
+
+    // The access that stopped the last run(), nullptr if none did
+    const WatchState* watchHit() const
+    {
+      if constexpr(has(Features::Watch)) return watch.hit ? &watch : nullptr;
+      else return nullptr;
+    }
+
+    /* Profiling and Tracing */
+    // Called by every interpreter around running data at pc
+    void beforeStep(WORD pc, const Decoded& data)
+    {
+      if constexpr(has(Features::Profile)) profile.record(pc, data, reg);
+
+      if constexpr(has(Features::Trace))
+      {
+        trace.pc = pc;
+        trace.addr = reg[data.regb];
+        trace.tick = tick;
+      }
+
+      (void)pc; (void)data;
+    }
+
+    void afterStep(const Decoded& data)
+    {
+      if constexpr(has(Features::Trace))
+      { if(trace.tracer != nullptr) traceStep(data); }
+
+      (void)data;
+    }
+
+  private: // Tracing
+    void traceStep(const Decoded& data); // In SDISCTrace.hpp
+
+  private: // Timing
+    COUNT timingCost() const
+    {
+      if constexpr(has(Features::Timing)) return timing.cost;
+      else return 0;
+    }
+
+  private: // Watchpoints
+    // Called by LOD and STR at pc, before they use address
+    void watched(WORD pc, WORD address, BYTE access)
+    {
+      if constexpr(has(Features::Watch))
+      {
+        if(watch.hits(address, access))
+        {
+          watch.hit = true;
+          watch.access = access;
+          watch.pc = pc;
+          watch.address = address;
+        }
+      }
+
+      (void)pc; (void)address; (void)access;
+    }
+
+    // Engines return Status::Watchpoint once this is set
+    bool stopped() const
     {
-      // Program Control
-      0,
-      // Jumps and Conditions
-      4, 6, 6,
-      // Load Store Set
-      12, 8, 4, 4,
-      // Bitwise Operators
-      4, 4, 4, 4,
-      // Math Operators
-      8, 8, 16, 32
-    };
-  }
+      if constexpr(has(Features::Watch)) return watch.hit;
+      else return false;
+    }
+
+  private: // Memory
+    WORD load(WORD address) const
+    {
+      if constexpr(has(Features::Devices)) return mem.load(address);
+      else return mem.loadRAM(address);
+    }
+
+    // Whether data is a LOD of a device not ready for it. Engines ask
+    // before charging, recording or running it, and return
+    // Status::Stalled with PC left on it.
+    bool blocked(const Decoded& data) const
+    {
+      if constexpr(has(Features::Devices))
+      { return data.code == OP::LOD && !mem.ready(reg[data.regb]); }
+
+      (void)data;
+      return false;
+    }
+
+  public: // Handlers
+    // Plain function pointer to a handler, nullptr for STP
+    using Handler = COUNT (*)(BasicCPU&, const Decoded&);
+    static Handler handler(BYTE code) { return handlers[code & 0xf]; }
+
+  private: // Dispatch Engines
+    template<COUNT (BasicCPU::*Op)(const Decoded&)>
+    static COUNT call(BasicCPU& cpu, const Decoded& data)
+    { return (cpu.*Op)(data); }
+
+    static const Handler handlers[0x10];
+
+    RunResult runSwitch(COUNT max_ticks, COUNT max_instructions);
+    RunResult runTable(COUNT max_ticks, COUNT max_instructions);
+    RunResult runThreaded(COUNT max_ticks, COUNT max_instructions);
+    RunResult runBlocks(COUNT max_ticks, COUNT max_instructions);
+
+  private: // Basic Blocks
+    std::uint32_t runBody(std::uint32_t address, std::uint32_t length);
+
+  private: // Program Image
+    std::shared_ptr<const Program> image;
+
+    bool stall = false; // runBody() stopped at a blocked() LOD
+
+  public: // Variables
+    WORD PC = 0;
+    const Instruction* program; // The arrays of image
+    const Decoded* decoded;
+    const Block* blocks;
+    WORD reg[reg_size];
+    Memory mem;
+
+    COUNT tick = 0;
+    COUNT faults = 0;   // Sent to trap.handler
+    COUNT revision = 0; // Bumped whenever program changes
+    Trap trap;          // Kept by reset()
+
+    std::conditional_t<(F & Features::Profile) != 0, Profile, NoFeature> profile;
+    std::conditional_t<(F & Features::Trace) != 0, TraceState, NoFeature> trace;
+    std::conditional_t<(F & Features::Timing) != 0, TimingState, NoFeature> timing;
+    std::conditional_t<(F & Features::Watch) != 0, WatchState, NoFeature> watch;
+  };
+
+  using CPU = BasicCPU<Features::default_features>;
+
+#if !SDISC_HEADER_ONLY
+  extern template class BasicCPU<Features::default_features>; // In SDISC.cpp
+#endif
 }
 
-namespace SDISC // Instructions
+// Everything that is not a template. Compiled inline in every file that
+// includes this, or only in SDISC.cpp without SDISC_HEADER_ONLY.
+#if SDISC_DEFINITIONS
+namespace SDISC
 {
-  struct Instruction
+  /* Decoded Instructions */
+  SDISC_INLINE Decoded::Decoded(const Instruction& in)
+    : imm{WORD(in.code() == OP::SHB ? in.byte() << 8 : in.byte())},
+      code{in.code()}, rega{in.rega()}, regb{in.regb()}, regc{in.regc()},
+      ticks{WORD(OP::tick_count[in.code()])} {}
+
+  /* Program Images */
+  SDISC_INLINE std::shared_ptr<const Program> Program::load(const WORD* words, std::size_t count)
   {
-  public: // Constructor
-    Instruction()
-      : data{0} {}
+    struct Words
+    {
+      const WORD* at;
+      Instruction operator*() const { return Instruction::fromWord(*at); }
+      Words& operator++() { ++at; return *this; }
+      bool operator!=(const Words& in) const { return at != in.at; }
+    };
+
+    return std::allocate_shared<const Program>(ZeroAllocator<Program>(), Zeroed(),
+                                               Words{words}, Words{words + count});
+  }
+
+  SDISC_INLINE const std::shared_ptr<const Program>& Program::blank()
+  {
+    static const std::shared_ptr<const Program> image =
+      std::allocate_shared<const Program>(ZeroAllocator<Program>(), Zeroed());
+    return image;
+  }
+
+  SDISC_INLINE void Program::clear()
+  {
+    std::fill(code, code + pro_size, init_pro);
+    std::fill(decoded, decoded + pro_size, Decoded(init_pro));
+    std::fill(blocks, blocks + pro_size, Block{0, 0, OP::STP});
+    length = 0;
+  }
+
+  SDISC_INLINE void Program::write(WORD address, const Instruction& in)
+  {
+    code[address] = in;
+    decoded[address] = in;
+    ++edits;
+
+    if(in.word() != init_pro.word()) length = std::max(length, std::uint32_t(address + 1));
+    else if(std::uint32_t(address) + 1 == length)
+    { while(length > 0 && code[length - 1].word() == init_pro.word()) --length; }
+
+    rebuildBlocks(address);
+  }
 
-    Instruction(const Instruction& in)
-      : data{in.data} {}
+  SDISC_INLINE void Program::stopAt(WORD address, bool stop)
+  {
+    decoded[address] = stop ? init_pro : code[address];
+    ++edits;
+    rebuildBlocks(address);
+  }
 
-    Instruction(const BYTE& op)
+  /* Basic Blocks */
+  SDISC_INLINE void Program::rebuildBlocks(WORD address)
+  {
+    // Blocks before address run into it up to the previous jump or STP
+    buildBlock(address);
+    for(std::size_t i = address; i > 0; --i)
     {
-      data =  0x0000;
-      data |= (op & 0xf) << 12;
+      buildBlock(i - 1);
+      if(OP::ends_block(decoded[i - 1].code)) break;
     }
+  }
+
+  // Extends the block at address + 1 backwards by one instruction, so the
+  // blocks must be built from the end of program towards the start.
+  SDISC_INLINE void Program::buildBlock(std::size_t address)
+  {
+    const Decoded& data = decoded[address];
+    Block& block = blocks[address];
+
+    block.op = data.code;
+    block.ticks = 0;
+    block.length = 0;
 
-    Instruction(const BYTE& op, const BYTE& ra,
-                const BYTE& rb, const BYTE& rc)
+    if(OP::ends_block(data.code)) return;
+
+    block.ticks = data.ticks;
+    block.length = 1;
+
+    if(address + 1 == pro_size) return;
+
+    const Decoded& next = decoded[address + 1];
+    block.ticks += blocks[address + 1].ticks;
+    block.length += blocks[address + 1].length;
+
+    // SHB+SLB in either order loads a whole 16 bit constant
+    if(data.rega == next.rega &&
+       ((data.code == OP::SHB && next.code == OP::SLB) ||
+        (data.code == OP::SLB && next.code == OP::SHB)))
+    { block.op = OP::SET; }
+  }
+
+  /* Memory Images */
+  SDISC_INLINE MemoryImage::MemoryImage()
+  { for(std::shared_ptr<const Page>& i : pages) i = blankPage(); }
+
+  SDISC_INLINE const std::shared_ptr<const MemoryImage>& MemoryImage::blank()
+  {
+    static const std::shared_ptr<const MemoryImage> image =
+      std::make_shared<const MemoryImage>();
+    return image;
+  }
+
+  SDISC_INLINE const std::shared_ptr<const Page>& MemoryImage::blankPage()
+  {
+    static const std::shared_ptr<const Page> page = []
+    {
+      std::shared_ptr<Page> init = std::make_shared<Page>();
+      for(WORD& i : init->word) i = init_mem;
+      return std::shared_ptr<const Page>(init);
+    }();
+    return page;
+  }
+
+  /* Memory */
+  SDISC_INLINE Memory& Memory::operator=(const Memory& in)
+  {
+    if(this == &in) return *this;
+    base = in.base;
+    bus = in.bus;
+    std::copy(in.devices, in.devices + page_count / 64, devices);
+    std::copy(in.written, in.written + page_count / 64, written);
+
+    for(std::size_t i = 0; i < page_count; ++i)
     {
-        data =  0x0000;
-        data |= (op & 0xf) << 12;
-        data |= (ra & 0xf) << 8;
-        data |= (rb & 0xf) << 4;
-        data |= (rc & 0xf) << 0;
+      table.read[i] = in.table.read[i];
+      table.write[i] = nullptr;
+
+      if(in.owns(i))
+      {
+        storage[i] = in.storage[i];
+        table.read[i] = table.write[i] = storage[i].word;
+      }
     }
 
-    Instruction(const BYTE& op, const BYTE& ra, const BYTE& b)
+    return *this;
+  }
+
+  SDISC_INLINE void Memory::reset(const std::shared_ptr<const MemoryImage>& in_image)
+  {
+    // Every other page still reads from base, and device pages are
+    // still null in both tables
+    if(in_image == base)
     {
-      data =  0x0000;
-      data |= (op & 0xf) << 12;
-      data |= (ra & 0xf) << 8;
-      data |= (b & 0xff) << 0;
+      for(std::size_t i = 0; i < page_count / 64; ++i)
+      {
+        std::uint64_t bits = written[i];
+        for(std::size_t page = i * 64; bits != 0; ++page, bits >>= 1)
+        {
+          if(bits & 1)
+          {
+            table.read[page] = base->pages[page]->word;
+            table.write[page] = nullptr;
+          }
+        }
+
+        written[i] = 0;
+      }
+
+      return;
     }
 
-    BYTE code() const { return (data >> 12) & 0xf; }
-    BYTE rega() const { return (data >> 8)  & 0xf; }
-    BYTE regb() const { return (data >> 4)  & 0xf; }
-    BYTE regc() const { return (data >> 0)  & 0xf; }
-    BYTE byte() const { return (data >> 0)  & 0xff; }
+    base = in_image;
+    std::fill(written, written + page_count / 64, 0);
 
-  private:
-    WORD data;
-  };
-}
+    // Plain fills of the tables, which compilers turn into vector stores,
+    // for the blank image every reset() starts from
+    std::fill(table.write, table.write + page_count, nullptr);
+    if(base == MemoryImage::blank())
+    { std::fill(table.read, table.read + page_count, MemoryImage::blankPage()->word); }
+    else
+    { for(std::size_t i = 0; i < page_count; ++i) table.read[i] = base->pages[i]->word; }
 
-namespace SDISC // Constants
-{
-  const std::size_t mem_size = 0x10000;
-  const std::size_t pro_size = 0x10000;
-  const std::size_t reg_size = 0x10;
+    if(bus != nullptr) mapDevices();
+  }
 
-  const WORD init_mem = 0xffff;
-  const WORD init_reg = 0x0000;
-  const Instruction init_pro = Instruction();
-}
+  SDISC_INLINE std::size_t Memory::dirty() const
+  {
+    std::size_t count = 0;
+    for(std::size_t i = 0; i < page_count; ++i) count += owns(i);
+    return count;
+  }
 
-namespace SDISC
-{
-  class CPU
+  SDISC_INLINE const std::shared_ptr<const MemoryImage>& Memory::freeze()
   {
-  public: // CPU Control
-    CPU(){ reset(); }
+    if(dirty() == 0) return base;
 
-    void reset()
+    std::shared_ptr<MemoryImage> frozen = std::make_shared<MemoryImage>(*base);
+    for(std::size_t i = 0; i < page_count; ++i)
     {
-      tick = 0;
-      for(Instruction& i : program) i = init_pro;
-      for(WORD& i : mem) i = init_mem;
-      for(WORD& i : reg) i = init_reg;
+      if(owns(i)) frozen->pages[i] = std::make_shared<const Page>(storage[i]);
     }
 
-    template<class ArrayType>
-    void loadProgram(const ArrayType in_program)
+    reset(std::move(frozen));
+    return base;
+  }
+
+  SDISC_INLINE void Memory::attach(Bus& in_bus)
+  {
+    detach();
+    bus = &in_bus;
+
+    for(std::size_t i = 0; i < page_count; ++i)
     {
-      for(Instruction& a : program) a = Instruction();
-      std::copy(in_program.begin(), in_program.end(), program);
+      if(bus->device(i) != nullptr) devices[i / 64] |= std::uint64_t(1) << (i % 64);
     }
 
-  public: // Instructions
-    /* Execute Instruction */
-    COUNT CYCLE() { return RUN(program[PC++]); }
-    COUNT RUN(const Instruction&);
+    mapDevices();
+  }
 
-    /* Program Control */
-    COUNT STP(const Instruction&); // 0 Ticks
+  SDISC_INLINE void Memory::detach()
+  {
+    flush();
 
-    /* Jumps/Conditions */
-    COUNT JAL(const Instruction&); // 4 Ticks
-    COUNT JIE(const Instruction&); // 6 Ticks
-    COUNT JIL(const Instruction&); // 6 Ticks
+    for(std::size_t i = 0; i < page_count; ++i)
+    {
+      if(device(i)) table.read[i] = base->pages[i]->word;
+    }
 
-    /* Load/Store/Set */
-    COUNT STR(const Instruction&); // 12 Ticks
-    COUNT LOD(const Instruction&); // 8 Ticks
-    COUNT SHB(const Instruction&); // 4 Ticks
-    COUNT SLB(const Instruction&); // 4 Ticks
+    std::fill(devices, devices + page_count / 64, 0);
+    bus = nullptr;
+  }
 
-    /* Bitwise Operators */
-    COUNT AND(const Instruction&); // 4 Ticks
-    COUNT NND(const Instruction&); // 4 Ticks
-    COUNT IOR(const Instruction&); // 4 Ticks
-    COUNT XOR(const Instruction&); // 4 Ticks
+  // A page written before its device was attached is dropped, like any
+  // other write to the device's range
+  SDISC_INLINE void Memory::mapDevices()
+  {
+    for(std::size_t i = 0; i < page_count; ++i)
+    {
+      if(device(i))
+      {
+        table.read[i] = table.write[i] = nullptr;
+        written[i / 64] &= ~(std::uint64_t(1) << (i % 64));
+      }
+    }
+  }
 
-    /* Mathmatical Operators */
-    COUNT ADD(const Instruction&); // 8 Ticks
-    COUNT SUB(const Instruction&); // 8 Ticks
-    COUNT MUL(const Instruction&); // 16 Ticks
-    COUNT DIV(const Instruction&); // 32 Ticks
+  SDISC_INLINE WORD* Memory::own(std::size_t page)
+  {
+    std::copy(table.read[page], table.read[page] + page_size, storage[page].word);
+    table.read[page] = table.write[page] = storage[page].word;
+    written[page / 64] |= std::uint64_t(1) << (page % 64);
+    return storage[page].word;
+  }
 
-    /* Clock Function */
-    COUNT addTicks(const Instruction& data)
+  /* Profiling */
+  SDISC_INLINE void Profile::record(WORD pc, const Decoded& data, const WORD* reg)
+  {
+    ++op_count[data.code];
+    op_ticks[data.code] += data.ticks;
+    ++pc_count[pc];
+
+    switch(data.code)
     {
-      tick += OP::tick_count[data.code()];
-      return  OP::tick_count[data.code()];
+      case OP::JAL:
+        if(!stack.empty() && stack.back() == reg[data.regb]) { stack.pop_back(); break; }
+        if(stack.size() < pro_size) stack.push_back(WORD(pc + 2));
+        ++calls[edge(pc, reg[data.regb])];
+        break;
+
+      case OP::JIE: taken[pc] += reg[data.rega] == reg[data.regb]; break;
+      case OP::JIL: taken[pc] += reg[data.rega] < reg[data.regb]; break;
     }
+  }
 
-  public: // Variables
-    WORD PC = 0;
-    Instruction program[pro_size];
-    WORD reg[reg_size];
-    WORD mem[mem_size];
+  /* Watchpoints */
+  SDISC_INLINE void WatchState::set(WORD address, BYTE in_access)
+  {
+    const std::size_t page = address >> page_shift;
+    const std::uint64_t bit = std::uint64_t(1) << (address % 64);
+    const bool was = ((words[0][address / 64] | words[1][address / 64]) & bit) != 0;
 
-    COUNT tick = 0;
-  };
+    for(std::size_t side = 0; side < 2; ++side)
+    {
+      std::uint64_t* word = &words[side][address / 64];
+      *word = (in_access >> side) & 1 ? *word | bit : *word & ~bit;
+
+      // A page is watched while any of its words are
+      const std::uint64_t* first = &words[side][page * page_size / 64];
+      const bool watched = std::any_of(first, first + page_size / 64, [](std::uint64_t i){ return i != 0; });
+      const std::uint64_t page_bit = std::uint64_t(1) << (page % 64);
+      pages[side][page / 64] = watched ? pages[side][page / 64] | page_bit : pages[side][page / 64] & ~page_bit;
+    }
+
+    count += std::size_t(in_access != Access::None) - std::size_t(was);
+  }
+
+  /* Devices */
+  SDISC_INLINE void Bus::map(std::size_t first, std::size_t count, Device& device)
+  {
+    for(std::size_t i = first; i < first + count && i < page_count; ++i)
+    { pages[i] = Mapping{&device, WORD(first << page_shift)}; }
+  }
+
+  SDISC_INLINE WORD Bus::load(WORD address)
+  {
+    flush();
+
+    const Mapping& page = pages[address >> page_shift];
+    const WORD offset = WORD(address - page.base);
+    if(tap != nullptr) return tap->read(address, *page.device, offset);
+    return page.device->read(offset);
+  }
+
+  // Writes before it may be what the device is waiting for
+  SDISC_INLINE bool Bus::ready(WORD address)
+  {
+    flush();
+
+    const Mapping& page = pages[address >> page_shift];
+    const WORD offset = WORD(address - page.base);
+    if(tap != nullptr) return tap->ready(address, *page.device, offset);
+    return page.device->ready(offset);
+  }
+
+  // Devices may write to mem, and so to the bus, while taking a batch.
+  // Those writes go in the next batch rather than being handed over
+  // in the middle of this one.
+  SDISC_INLINE void Bus::flush()
+  {
+    if(flushing) return;
+    flushing = true;
+
+    while(!writes.empty())
+    {
+      batch.swap(writes);
+      batch_targets.swap(targets);
+
+      for(std::size_t begin = 0, end; begin < batch.size(); begin = end)
+      {
+        Device* const device = batch_targets[begin];
+        for(end = begin + 1; end < batch.size() && batch_targets[end] == device;) ++end;
+        device->write(&batch[begin], end - begin);
+      }
+
+      batch.clear();
+      batch_targets.clear();
+    }
+
+    flushing = false;
+  }
 }
+#endif
 
 namespace SDISC
 {
   /* Execute Instruction */
-  COUNT CPU::RUN(const Instruction& data)
-  {
-    // Program Control
-    if(data.code() == OP::STP)
-    { return STP(data); }
-
-    // Jump/Condition
-    else if(data.code() == OP::JAL)
-    { return JAL(data); }
-    else if(data.code() == OP::JIE)
-    { return JIE(data); }
-    else if(data.code() == OP::JIL)
-    { return JIL(data); }
-
-    // Store/Load/Set
-    else if(data.code() == OP::STR)
-    { return STR(data); }
-    else if(data.code() == OP::LOD)
-    { return LOD(data); }
-    else if(data.code() == OP::SHB)
-    { return SHB(data); }
-    else if(data.code() == OP::SLB)
-    { return SLB(data); }
-
-    // Bitwise
-    else if(data.code() == OP::AND)
-    { return AND(data); }
-    else if(data.code() == OP::NND)
-    { return NND(data); }
-    else if(data.code() == OP::IOR)
-    { return IOR(data); }
-    else if(data.code() == OP::XOR)
-    { return XOR(data); }
-
-    // Math
-    else if(data.code() == OP::ADD)
-    { return ADD(data); }
-    else if(data.code() == OP::SUB)
-    { return SUB(data); }
-    else if(data.code() == OP::MUL)
-    { return MUL(data); }
-    else if(data.code() == OP::DIV)
-    { return DIV(data); }
+  template<unsigned F>
+  COUNT BasicCPU<F>::RUN(const Decoded& data)
+  {
+    switch(data.code)
+    {
+      // Program Control
+      case OP::STP: return STP(data);
+
+      // Jump/Condition
+      case OP::JAL: return JAL(data);
+      case OP::JIE: return JIE(data);
+      case OP::JIL: return JIL(data);
+
+      // Store/Load/Set
+      case OP::STR: return STR(data);
+      case OP::LOD: return LOD(data);
+      case OP::SHB: return SHB(data);
+      case OP::SLB: return SLB(data);
+
+      // Bitwise
+      case OP::AND: return AND(data);
+      case OP::NND: return NND(data);
+      case OP::IOR: return IOR(data);
+      case OP::XOR: return XOR(data);
+
+      // Math
+      case OP::ADD: return ADD(data);
+      case OP::SUB: return SUB(data);
+      case OP::MUL: return MUL(data);
+      case OP::DIV: return DIV(data);
+    }
 
     return 0;
   }
 
+  /* Program Images */
+  template<class ArrayType>
+  std::shared_ptr<const Program> Program::make(const ArrayType& in_program)
+  {
+    return std::allocate_shared<const Program>(ZeroAllocator<Program>(), Zeroed(),
+                                               in_program.begin(), in_program.end());
+  }
+
+  template<class Iterator>
+  void Program::assign(Iterator begin, Iterator end)
+  {
+    std::size_t count = 0;
+    for(; begin != end && count < pro_size; ++begin, ++count)
+    {
+      code[count] = *begin;
+      decoded[count] = code[count];
+      if(code[count].word() != init_pro.word()) length = std::uint32_t(count + 1);
+    }
+
+    // Blocks past the end are already STP
+    for(std::size_t i = count; i-- > 0;) buildBlock(i);
+  }
+
+  /* Memory Images */
+  template<class ArrayType>
+  MemoryImage::MemoryImage(const ArrayType& in_mem)
+    : MemoryImage()
+  {
+    std::size_t address = 0;
+    std::shared_ptr<Page> page;
+
+    for(auto i = in_mem.begin(); i != in_mem.end() && address < mem_size; ++i, ++address)
+    {
+      if(address % page_size == 0)
+      {
+        page = std::make_shared<Page>(*blankPage());
+        pages[address >> page_shift] = page;
+      }
+
+      page->word[address % page_size] = WORD(*i);
+    }
+  }
+
+  /* Snapshots */
+  template<unsigned F>
+  Snapshot BasicCPU<F>::snapshot()
+  {
+    Snapshot out;
+    out.PC = PC;
+    std::copy(reg, reg + reg_size, out.reg);
+    out.tick = tick;
+    out.trap = trap;
+    out.program = image;
+    out.mem = mem.freeze();
+    return out;
+  }
+
+  template<unsigned F>
+  void BasicCPU<F>::restore(const Snapshot& in)
+  {
+    PC = in.PC;
+    std::copy(in.reg, in.reg + reg_size, reg);
+    tick = in.tick;
+    trap = in.trap;
+    if(in.program != image) loadProgram(in.program);
+    mem.reset(in.mem);
+  }
+
+  /* Handlers */
+  template<unsigned F>
+  const typename BasicCPU<F>::Handler BasicCPU<F>::handlers[0x10] =
+  {
+    nullptr, // Every engine halts on STP before running it
+    &call<&BasicCPU::JAL>, &call<&BasicCPU::JIE>, &call<&BasicCPU::JIL>,
+    &call<&BasicCPU::STR>, &call<&BasicCPU::LOD>, &call<&BasicCPU::SHB>, &call<&BasicCPU::SLB>,
+    &call<&BasicCPU::AND>, &call<&BasicCPU::NND>, &call<&BasicCPU::IOR>, &call<&BasicCPU::XOR>,
+    &call<&BasicCPU::ADD>, &call<&BasicCPU::SUB>, &call<&BasicCPU::DIV>, &call<&BasicCPU::MUL>
+  };
+
+  /* Run Loop */
+  // Every engine checks the instruction budget, then halts on STP before
+  // it executes (executing it would only leave PC where it is and add no
+  // ticks), then checks the tick budget, so all of them stop in the same
+  // place with the same tick count.
+  // Device writes still buffered when it returns are handed over then.
+  template<unsigned F>
+  RunResult BasicCPU<F>::run(COUNT max_ticks, COUNT max_instructions,
+                             Dispatch engine)
+  {
+    RunResult result;
+    if constexpr(has(Features::Watch)) watch.hit = false;
+
+    switch(engine)
+    {
+      case Dispatch::Table:    result = runTable(max_ticks, max_instructions); break;
+      case Dispatch::Threaded: result = runThreaded(max_ticks, max_instructions); break;
+      case Dispatch::Block:    result = runBlocks(max_ticks, max_instructions); break;
+      default:                 result = runSwitch(max_ticks, max_instructions); break;
+    }
+
+    mem.flush();
+    return result;
+  }
+
+  template<unsigned F>
+  RunResult BasicCPU<F>::step(const Decoded& data, COUNT max_ticks)
+  {
+    RunResult result{Status::InstructionLimit, 0, 0};
+    if constexpr(has(Features::Watch)) watch.hit = false;
+
+    if(data.code == OP::STP)
+    { result.status = Status::Halted; return result; }
+
+    if(blocked(data))
+    { result.status = Status::Stalled; mem.flush(); return result; }
+
+    const COUNT ticks = has(Features::Ticks) ? costOf(PC, data, max_ticks) : 0;
+    if(has(Features::Ticks) && max_ticks < ticks)
+    { result.status = Status::TickLimit; return result; }
+
+    beforeStep(PC, data);
+    ++PC; RUN(data);
+    afterStep(data);
+    if constexpr(has(Features::Ticks)) result.ticks = ticks;
+    result.instructions = 1;
+    if(stopped()) result.status = Status::Watchpoint;
+
+    mem.flush();
+    return result;
+  }
+
+  template<unsigned F>
+  RunResult BasicCPU<F>::runSwitch(COUNT max_ticks, COUNT max_instructions)
+  {
+    RunResult result{Status::InstructionLimit, 0, 0};
+
+    while(result.instructions < max_instructions)
+    {
+      const Decoded& data = decoded[PC];
+
+      if(data.code == OP::STP)
+      { result.status = Status::Halted; return result; }
+
+      if(blocked(data))
+      { result.status = Status::Stalled; return result; }
+
+      const COUNT ticks = has(Features::Ticks) ? costOf(PC, data, max_ticks - result.ticks) : 0;
+      if(has(Features::Ticks) && max_ticks - result.ticks < ticks)
+      { result.status = Status::TickLimit; return result; }
+
+      beforeStep(PC, data);
+      ++PC; RUN(data);
+      afterStep(data);
+      if constexpr(has(Features::Ticks)) result.ticks += ticks;
+      ++result.instructions;
+
+      if(stopped()) { result.status = Status::Watchpoint; return result; }
+    }
+
+    return result;
+  }
+
+  template<unsigned F>
+  RunResult BasicCPU<F>::runTable(COUNT max_ticks, COUNT max_instructions)
+  {
+    RunResult result{Status::InstructionLimit, 0, 0};
+
+    while(result.instructions < max_instructions)
+    {
+      const Decoded& data = decoded[PC];
+
+      if(data.code == OP::STP)
+      { result.status = Status::Halted; return result; }
+
+      if(blocked(data))
+      { result.status = Status::Stalled; return result; }
+
+      const COUNT ticks = has(Features::Ticks) ? costOf(PC, data, max_ticks - result.ticks) : 0;
+      if(has(Features::Ticks) && max_ticks - result.ticks < ticks)
+      { result.status = Status::TickLimit; return result; }
+
+      beforeStep(PC, data);
+      ++PC; handlers[data.code](*this, data);
+      afterStep(data);
+      if constexpr(has(Features::Ticks)) result.ticks += ticks;
+      ++result.instructions;
+
+      if(stopped()) { result.status = Status::Watchpoint; return result; }
+    }
+
+    return result;
+  }
+
+  // Each opcode gets its own copy of the dispatch jump, so the host branch
+  // predictor can learn which opcode tends to follow which.
+  template<unsigned F>
+  RunResult BasicCPU<F>::runThreaded(COUNT max_ticks, COUNT max_instructions)
+  {
+#if SDISC_HAS_COMPUTED_GOTO
+    static void* const labels[0x10] =
+    {
+      &&do_STP,
+      &&do_JAL, &&do_JIE, &&do_JIL,
+      &&do_STR, &&do_LOD, &&do_SHB, &&do_SLB,
+      &&do_AND, &&do_NND, &&do_IOR, &&do_XOR,
+      &&do_ADD, &&do_SUB, &&do_DIV, &&do_MUL
+    };
+
+    RunResult result{Status::InstructionLimit, 0, 0};
+    const Decoded* data;
+    COUNT ticks;
+
+    #define SDISC_NEXT()                                              \
+      if(result.instructions >= max_instructions) { return result; }  \
+      data = &decoded[PC];                                            \
+      goto *labels[data->code]
+
+    #define SDISC_EXEC(op)                                            \
+      do_##op:                                                        \
+      if(OP::op == OP::LOD && blocked(*data))                         \
+      { result.status = Status::Stalled; return result; }             \
+      ticks = timed() ? costOf(PC, *data, max_ticks - result.ticks)   \
+                      : OP::tick_count[OP::op];                       \
+      if(has(Features::Ticks) && max_ticks - result.ticks < ticks)    \
+      { result.status = Status::TickLimit; return result; }           \
+      beforeStep(PC, *data);                                          \
+      ++PC; op(*data);                                                \
+      afterStep(*data);                                               \
+      if(has(Features::Ticks)) { result.ticks += ticks; }             \
+      ++result.instructions;                                          \
+      if(stopped())                                                   \
+      { result.status = Status::Watchpoint; return result; }          \
+      SDISC_NEXT()
+
+    SDISC_NEXT();
+
+    do_STP:
+      result.status = Status::Halted;
+      return result;
+
+    SDISC_EXEC(JAL); SDISC_EXEC(JIE); SDISC_EXEC(JIL);
+    SDISC_EXEC(STR); SDISC_EXEC(LOD); SDISC_EXEC(SHB); SDISC_EXEC(SLB);
+    SDISC_EXEC(AND); SDISC_EXEC(NND); SDISC_EXEC(IOR); SDISC_EXEC(XOR);
+    SDISC_EXEC(ADD); SDISC_EXEC(SUB); SDISC_EXEC(DIV); SDISC_EXEC(MUL);
+
+    #undef SDISC_EXEC
+    #undef SDISC_NEXT
+#else
+    return runSwitch(max_ticks, max_instructions);
+#endif
+  }
+
+  // Runs whole block bodies while they fit in both budgets, and single
+  // steps the jump or STP that ends them, or the body itself when it
+  // would not fit.
+  template<unsigned F>
+  RunResult BasicCPU<F>::runBlocks(COUNT max_ticks, COUNT max_instructions)
+  {
+    RunResult result{Status::InstructionLimit, 0, 0};
+
+    while(result.instructions < max_instructions)
+    {
+      const Block& block = blocks[PC];
+
+      // Bodies do not keep tick up to date for a trace, and are charged
+      // only flat ticks
+      if(!has(Features::Trace) && !timed() && block.length != 0 &&
+         block.length <= max_instructions - result.instructions &&
+         (!has(Features::Ticks) || block.ticks <= max_ticks - result.ticks))
+      {
+        const WORD start = PC;
+        std::uint32_t length = runBody(start, block.length);
+        COUNT ticks = block.ticks;
+
+        // A trap, a watchpoint or a stalled LOD ends the body early, and
+        // has already moved PC. A stalled LOD did not run.
+        if(length == block.length) PC += block.length;
+        else
+        {
+          if(!stall) ++length;
+          ticks = 0;
+          for(std::uint32_t i = start; i < start + length; ++i) ticks += decoded[i].ticks;
+        }
+
+        if constexpr(has(Features::Ticks))
+        {
+          tick += ticks;
+          result.ticks += ticks;
+        }
+        result.instructions += length;
+
+        if(stall) { stall = false; result.status = Status::Stalled; return result; }
+        if(stopped()) { result.status = Status::Watchpoint; return result; }
+        continue;
+      }
+
+      const Decoded& data = decoded[PC];
+
+      if(data.code == OP::STP)
+      { result.status = Status::Halted; return result; }
+
+      if(blocked(data))
+      { result.status = Status::Stalled; return result; }
+
+      const COUNT ticks = has(Features::Ticks) ? costOf(PC, data, max_ticks - result.ticks) : 0;
+      if(has(Features::Ticks) && max_ticks - result.ticks < ticks)
+      { result.status = Status::TickLimit; return result; }
+
+      beforeStep(PC, data);
+      ++PC; RUN(data);
+      afterStep(data);
+      if constexpr(has(Features::Ticks)) result.ticks += ticks;
+      ++result.instructions;
+
+      if(stopped()) { result.status = Status::Watchpoint; return result; }
+    }
+
+    return result;
+  }
+
+  // Executes a block body without touching PC or tick, which the caller
+  // advances once for the whole body. Returns length, or when a DIV
+  // traps, a LOD or STR hits a watchpoint or a LOD stalls the number of
+  // instructions before it.
+  template<unsigned F>
+  std::uint32_t BasicCPU<F>::runBody(std::uint32_t address, std::uint32_t length)
+  {
+    const std::uint32_t start = address;
+    const std::uint32_t end = address + length;
+
+    while(address < end)
+    {
+      // A LOD is recorded once it is known to run
+      const Decoded& data = decoded[address];
+      if(data.code != OP::LOD) beforeStep(WORD(address), data);
+
+      switch(blocks[address].op)
+      {
+        // Superinstructions
+        case OP::SET:
+          beforeStep(WORD(address + 1), decoded[address + 1]);
+          reg[data.rega] = data.imm | decoded[address + 1].imm;
+          address += 2; continue;
+
+        // Store/Load/Set
+        case OP::STR:
+          watched(WORD(address), reg[data.regb], Access::Write);
+          mem.store(reg[data.regb], reg[data.rega]);
+          if(stopped()) { PC = WORD(address + 1); return address - start; }
+          break;
+
+        case OP::LOD:
+          if(blocked(data)) { stall = true; PC = WORD(address); return address - start; }
+          beforeStep(WORD(address), data);
+          watched(WORD(address), reg[data.regb], Access::Read);
+          reg[data.rega] = load(reg[data.regb]);
+          if(stopped()) { PC = WORD(address + 1); return address - start; }
+          break;
+
+        case OP::SHB: reg[data.rega] = (reg[data.rega] & 0x00ff) | data.imm; break;
+        case OP::SLB: reg[data.rega] = (reg[data.rega] & 0xff00) | data.imm; break;
+
+        // Bitwise
+        case OP::AND: reg[data.rega] = reg[data.regb] & reg[data.regc]; break;
+        case OP::NND: reg[data.rega] = ~(reg[data.regb] & reg[data.regc]); break;
+        case OP::IOR: reg[data.rega] = reg[data.regb] | reg[data.regc]; break;
+        case OP::XOR: reg[data.rega] = reg[data.regb] ^ reg[data.regc]; break;
+
+        // Math
+        case OP::ADD: reg[data.rega] = reg[data.regb] + reg[data.regc]; break;
+        case OP::SUB: reg[data.rega] = reg[data.regb] - reg[data.regc]; break;
+        case OP::MUL: reg[data.rega] = OP::multiply(reg[data.regb], reg[data.regc]); break;
+        case OP::DIV:
+          if(reg[data.regc] == 0 && trap.enabled)
+          {
+            fault(Fault::DivideByZero, WORD(address));
+            return address - start;
+          }
+          reg[data.rega] = OP::divide(reg[data.regb], reg[data.regc]); break;
+      }
+
+      ++address;
+    }
+
+    return length;
+  }
+
+  /* Traps */
+  template<unsigned F>
+  void BasicCPU<F>::fault(WORD cause, WORD pc)
+  {
+    mem.store(trap.frame, cause);
+    mem.store(WORD(trap.frame + 1), pc);
+    PC = trap.handler;
+    ++faults;
+  }
+
   /* Program Control */
   // Stops Program [No Inputs]
-  COUNT CPU::STP(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::STP(const Decoded& data)
   { --PC; return addTicks(data); }
 
   /* Jumps/Conditions */
   // Stores current PC in rega then jumps to address in regb
-  COUNT CPU::JAL(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::JAL(const Decoded& data)
   {
     const WORD old_PC = ++PC;
-    PC = reg[data.regb()];
-    reg[data.rega()] = old_PC;
+    PC = reg[data.regb];
+    reg[data.rega] = old_PC;
 
     return addTicks(data);
   }
 
   // If rega and regb are equal, jump to address in regc
-  COUNT CPU::JIE(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::JIE(const Decoded& data)
   {
-    if(reg[data.rega()] == reg[data.regb()])
-    { PC = reg[data.regc()]; }
+    if(reg[data.rega] == reg[data.regb])
+    { PC = reg[data.regc]; }
 
     return addTicks(data);
   }
 
   // If rega is less than regb, jump to address in regc
-  COUNT CPU::JIL(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::JIL(const Decoded& data)
   {
-    if(reg[data.rega()] < reg[data.regb()])
-    { PC = reg[data.regc()]; }
+    if(reg[data.rega] < reg[data.regb])
+    { PC = reg[data.regc]; }
 
     return addTicks(data);
   }
 
   /* Load/Store/Set */
   // Set mem address in regb to rega
-  COUNT CPU::STR(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::STR(const Decoded& data)
   {
-    mem[reg[data.regb()]] = reg[data.rega()];
+    watched(WORD(PC - 1), reg[data.regb], Access::Write);
+    mem.store(reg[data.regb], reg[data.rega]);
 
     return addTicks(data);
   }
 
   // Set rega to mem address in regb
-  COUNT CPU::LOD(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::LOD(const Decoded& data)
   {
-    reg[data.rega()] = mem[reg[data.regb()]];
+    watched(WORD(PC - 1), reg[data.regb], Access::Read);
+    reg[data.rega] = load(reg[data.regb]);
 
     return addTicks(data);
   }
 
   // Set MS-8 bits to byte
-  COUNT CPU::SHB(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::SHB(const Decoded& data)
   {
-    reg[data.rega()] &= 0x00ff;
-    reg[data.rega()] |= data.byte() << 8;
+    reg[data.rega] &= 0x00ff;
+    reg[data.rega] |= data.imm;
 
     return addTicks(data);
   }
 
   // Set LS-8 bits to byte
-  COUNT CPU::SLB(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::SLB(const Decoded& data)
   {
-    reg[data.rega()] &= 0xff00;
-    reg[data.rega()] |= data.byte();
+    reg[data.rega] &= 0xff00;
+    reg[data.rega] |= data.imm;
 
     return addTicks(data);
   }
 
   /* Bitwise Operators */
   // And regb and regc and store it in rega
-  COUNT CPU::AND(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::AND(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] & reg[data.regc()];
+    reg[data.rega] = reg[data.regb] & reg[data.regc];
 
     return addTicks(data);
   }
 
   // Not And regb and regc and store it in rega
-  COUNT CPU::NND(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::NND(const Decoded& data)
   {
-    reg[data.rega()] = ~(reg[data.regb()] & reg[data.regc()]);
+    reg[data.rega] = ~(reg[data.regb] & reg[data.regc]);
 
     return addTicks(data);
   }
 
   // Inclusive Or regb and regc and store it in rega
-  COUNT CPU::IOR(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::IOR(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] | reg[data.regc()];
+    reg[data.rega] = reg[data.regb] | reg[data.regc];
 
     return addTicks(data);
   }
 
   // Exclusive Or regb and regc and store it in rega
-  COUNT CPU::XOR(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::XOR(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] ^ reg[data.regc()];
+    reg[data.rega] = reg[data.regb] ^ reg[data.regc];
 
     return addTicks(data);
   }
 
   /* Mathmatical Operators */
   // Add regb and regc and store it in rega
-  COUNT CPU::ADD(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::ADD(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] + reg[data.regc()];
+    reg[data.rega] = reg[data.regb] + reg[data.regc];
 
     return addTicks(data);
   }
 
   // Subtract regb by regc and store it in rega
-  COUNT CPU::SUB(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::SUB(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] - reg[data.regc()];
+    reg[data.rega] = reg[data.regb] - reg[data.regc];
 
     return addTicks(data);
   }
 
   // Multiply regb and regc and store it in rega
-  COUNT CPU::MUL(const Instruction& data)
+  template<unsigned F>
+  COUNT BasicCPU<F>::MUL(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] * reg[data.regc()];
+    reg[data.rega] = OP::multiply(reg[data.regb], reg[data.regc]);
 
     return addTicks(data);
   }
 
-  // Divide regb by regc and store it in rega
-  COUNT CPU::DIV(const Instruction& data)
+  // Divide regb by regc and store it in rega, 0xffff if regc is 0
+  // or a trap if trap is enabled
+  template<unsigned F>
+  COUNT BasicCPU<F>::DIV(const Decoded& data)
   {
-    reg[data.rega()] = reg[data.regb()] / reg[data.regc()];
+    if(reg[data.regc] == 0 && trap.enabled)
+    { fault(Fault::DivideByZero, WORD(PC - 1)); return addTicks(data); }
+
+    reg[data.rega] = OP::divide(reg[data.regb], reg[data.regc]);
 
     return addTicks(data);
   }
 }
 
+#if SDISC_TRACE
+  #include "SDISCTrace.hpp"
+#endif
+
 #endif
@@ -0,0 +1,370 @@
+#ifndef SDISCASM_HPP
+#define SDISCASM_HPP
+
+#include "SDISC.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SDISC // Assembler
+{
+  // One instruction or directive per line, ; starts a comment:
+  //
+  //   loop:   ADD r1, r2, r3     ; AND NND IOR XOR SUB MUL DIV JIE JIL too
+  //           JAL r14, r13       ; LOD and STR also take two registers
+  //           SHB r4, 0x12       ; SLB too, the byte may be any value
+  //           SET r3, loop       ; SHB then SLB of a 16 bit value
+  //           STP
+  //           .org 0x100         ; carry on assembling at an address
+  //           .word 0x1234, loop ; raw program words
+  //           .data 0x8000, 1, 2 ; words of the initial mem
+  //
+  // Values are decimal, 0x hex, 0b binary or a label, optionally plus or
+  // minus a number. Mnemonics and registers ignore case.
+  struct Assembly
+  {
+    std::vector<Instruction> program; // From 0 to the last word written
+    std::vector<WORD> mem;            // mem_size words, or empty without .data
+
+    std::size_t line = 0; // Line of the first error
+    std::string error;    // Empty if it assembled
+
+    bool ok() const { return error.empty(); }
+  };
+
+  Assembly assemble(const std::string& source);
+
+  // Text for one instruction in the syntax assemble() reads,
+  // such as "ADD r1, r2, r3" or "SHB r4, 0x12"
+  std::string disassemble(const Instruction& in);
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  namespace ASM
+  {
+    struct Line
+    {
+      std::size_t number;
+      std::string label;
+      std::string op; // Upper case mnemonic or directive, may be empty
+      std::vector<std::string> args;
+    };
+
+    SDISC_INLINE std::string trim(const std::string& in)
+    {
+      std::size_t begin = 0, end = in.size();
+      while(begin < end && std::isspace(BYTE(in[begin]))) ++begin;
+      while(end > begin && std::isspace(BYTE(in[end - 1]))) --end;
+      return in.substr(begin, end - begin);
+    }
+
+    SDISC_INLINE std::string upper(std::string in)
+    {
+      for(char& i : in) i = char(std::toupper(BYTE(i)));
+      return in;
+    }
+
+    SDISC_INLINE bool isName(const std::string& in)
+    {
+      if(in.empty() || !(std::isalpha(BYTE(in[0])) || in[0] == '_')) return false;
+      for(char i : in) if(!(std::isalnum(BYTE(i)) || i == '_')) return false;
+      return true;
+    }
+
+    SDISC_INLINE Line split(const std::string& text, std::size_t number)
+    {
+      Line out{number, "", "", {}};
+      std::string rest = trim(text.substr(0, text.find(';')));
+
+      const std::size_t colon = rest.find(':');
+      if(colon != std::string::npos)
+      {
+        out.label = trim(rest.substr(0, colon));
+        rest = trim(rest.substr(colon + 1));
+      }
+
+      std::size_t space = 0;
+      while(space < rest.size() && !std::isspace(BYTE(rest[space]))) ++space;
+      out.op = upper(rest.substr(0, space));
+
+      rest = trim(rest.substr(space));
+      while(!rest.empty())
+      {
+        const std::size_t comma = rest.find(',');
+        out.args.push_back(trim(rest.substr(0, comma)));
+        rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+      }
+
+      return out;
+    }
+
+    SDISC_INLINE bool number(const std::string& in, long& out)
+    {
+      if(in.empty() || !std::isdigit(BYTE(in[0]))) return false;
+
+      int base = 10;
+      std::size_t at = 0;
+      if(in.size() > 2 && in[0] == '0' && (in[1] == 'x' || in[1] == 'X')) { base = 16; at = 2; }
+      if(in.size() > 2 && in[0] == '0' && (in[1] == 'b' || in[1] == 'B')) { base = 2; at = 2; }
+
+      out = 0;
+      for(; at < in.size(); ++at)
+      {
+        const int digit = std::isdigit(BYTE(in[at])) ? in[at] - '0'
+                        : std::isxdigit(BYTE(in[at])) ? std::toupper(BYTE(in[at])) - 'A' + 10
+                        : base;
+        if(digit >= base) return false;
+
+        out = out * base + digit;
+        if(out > 0xffff) return false;
+      }
+
+      return true;
+    }
+
+    SDISC_INLINE int registerIndex(const std::string& in)
+    {
+      long index;
+      if(in.size() < 2 || (in[0] != 'r' && in[0] != 'R')) return -1;
+      if(!number(in.substr(1), index) || index >= long(reg_size)) return -1;
+      return int(index);
+    }
+
+    class Assembler
+    {
+    public:
+      explicit Assembler(Assembly& in_out) : out(in_out) {}
+
+      void run(const std::string& source)
+      {
+        std::size_t begin = 0, number = 1;
+        while(begin <= source.size())
+        {
+          std::size_t end = source.find('\n', begin);
+          if(end == std::string::npos) end = source.size();
+          lines.push_back(split(source.substr(begin, end - begin), number++));
+          begin = end + 1;
+        }
+
+        // Labels first, so they can be used before they are defined
+        for(const Line& i : lines) if(!pass(i, false)) return;
+
+        address = 0;
+        for(const Line& i : lines) if(!pass(i, true)) return;
+      }
+
+    private:
+      bool fail(const Line& line, const std::string& message)
+      {
+        out.line = line.number;
+        out.error = message;
+        return false;
+      }
+
+      bool count(const Line& line, std::size_t args)
+      {
+        if(line.args.size() == args) return true;
+        return fail(line, line.op + " takes " + std::to_string(args) + " operands");
+      }
+
+      bool value(const Line& line, const std::string& in, long& result)
+      {
+        if(number(in, result)) return true;
+
+        std::size_t sign = in.find_first_of("+-");
+        const std::string name = trim(in.substr(0, sign));
+        long offset = 0;
+
+        if(sign != std::string::npos && !number(trim(in.substr(sign + 1)), offset))
+        { return fail(line, "bad value '" + in + "'"); }
+
+        const auto label = labels.find(name);
+        if(label == labels.end()) return fail(line, "unknown label '" + name + "'");
+
+        result = in[sign == std::string::npos ? 0 : sign] == '-'
+               ? label->second - offset : label->second + offset;
+        result &= 0xffff;
+        return true;
+      }
+
+      // Whether words more fit in the program from address
+      bool room(const Line& line, std::size_t words)
+      {
+        if(address + words <= pro_size) return true;
+        return fail(line, "program is past 0xffff");
+      }
+
+      bool registers(const Line& line, int (&regs)[3], std::size_t used)
+      {
+        for(std::size_t i = 0; i < used; ++i)
+        {
+          regs[i] = registerIndex(line.args[i]);
+          if(regs[i] < 0) return fail(line, "bad register '" + line.args[i] + "'");
+        }
+
+        return true;
+      }
+
+      void emit(const Instruction& in)
+      {
+        if(out.program.size() <= address) out.program.resize(address + 1, init_pro);
+        out.program[address++] = in;
+      }
+
+      bool pass(const Line& line, bool write)
+      {
+        if(!line.label.empty())
+        {
+          if(!isName(line.label)) return fail(line, "bad label '" + line.label + "'");
+          if(!write && !labels.insert({line.label, long(address)}).second)
+          { return fail(line, "label '" + line.label + "' defined twice"); }
+        }
+
+        if(line.op.empty()) return true;
+
+        // Directives
+        if(line.op == ".ORG")
+        {
+          long at;
+          if(!count(line, 1)) return false;
+          if(!number(line.args[0], at)) return fail(line, ".ORG needs a number");
+          address = std::size_t(at);
+          return true;
+        }
+
+        if(line.op == ".WORD")
+        {
+          if(line.args.empty()) return fail(line, ".WORD needs a value");
+          if(!room(line, line.args.size())) return false;
+          for(const std::string& i : line.args)
+          {
+            long word = 0;
+            if(write && !value(line, i, word)) return false;
+            if(write) emit(Instruction::fromWord(WORD(word)));
+            else ++address;
+          }
+          return true;
+        }
+
+        if(line.op == ".DATA")
+        {
+          if(line.args.size() < 2) return fail(line, ".DATA needs an address and values");
+          if(!write) return true;
+
+          long at;
+          if(!value(line, line.args[0], at)) return false;
+          if(out.mem.empty()) out.mem.assign(mem_size, init_mem);
+
+          for(std::size_t i = 1; i < line.args.size(); ++i)
+          {
+            long word;
+            if(!value(line, line.args[i], word)) return false;
+            out.mem[std::size_t(at++) & 0xffff] = WORD(word);
+          }
+          return true;
+        }
+
+        // Instructions
+        if(line.op == "SET")
+        {
+          int regs[3];
+          long word = 0;
+          if(!count(line, 2) || !registers(line, regs, 1) || !room(line, 2)) return false;
+          if(write && !value(line, line.args[1], word)) return false;
+
+          if(write)
+          {
+            emit(Instruction(OP::SHB, BYTE(regs[0]), BYTE(word >> 8)));
+            emit(Instruction(OP::SLB, BYTE(regs[0]), BYTE(word)));
+          }
+          else address += 2;
+          return true;
+        }
+
+        int code = -1;
+        for(int i = 0; i < 0x10; ++i) if(line.op == OP::name[i]) code = i;
+        if(code < 0) return fail(line, "unknown instruction '" + line.op + "'");
+        if(!room(line, 1)) return false;
+
+        if(!write) { ++address; return true; }
+
+        int regs[3] = {0, 0, 0};
+        switch(code)
+        {
+          case OP::STP:
+            if(!count(line, 0)) return false;
+            emit(Instruction(OP::STP));
+            return true;
+
+          case OP::JAL: case OP::STR: case OP::LOD:
+            if(!count(line, 2) || !registers(line, regs, 2)) return false;
+            emit(Instruction(BYTE(code), BYTE(regs[0]), BYTE(regs[1]), 0));
+            return true;
+
+          case OP::SHB: case OP::SLB:
+          {
+            long byte;
+            if(!count(line, 2) || !registers(line, regs, 1)) return false;
+            if(!value(line, line.args[1], byte)) return false;
+            if(byte > 0xff) return fail(line, line.op + " takes a byte");
+            emit(Instruction(BYTE(code), BYTE(regs[0]), BYTE(byte)));
+            return true;
+          }
+
+          default:
+            if(!count(line, 3) || !registers(line, regs, 3)) return false;
+            emit(Instruction(BYTE(code), BYTE(regs[0]), BYTE(regs[1]), BYTE(regs[2])));
+            return true;
+        }
+      }
+
+    private:
+      Assembly& out;
+      std::vector<Line> lines;
+      std::map<std::string, long> labels;
+      std::size_t address = 0;
+    };
+  }
+
+  SDISC_INLINE Assembly assemble(const std::string& source)
+  {
+    Assembly out;
+    ASM::Assembler(out).run(source);
+    return out;
+  }
+
+  SDISC_INLINE std::string disassemble(const Instruction& in)
+  {
+    char text[32];
+    const char* name = OP::name[in.code()];
+
+    switch(in.code())
+    {
+      case OP::STP:
+        return name;
+
+      case OP::JAL: case OP::STR: case OP::LOD:
+        std::snprintf(text, sizeof(text), "%s r%d, r%d", name, in.rega(), in.regb());
+        break;
+
+      case OP::SHB: case OP::SLB:
+        std::snprintf(text, sizeof(text), "%s r%d, 0x%02x", name, in.rega(), in.byte());
+        break;
+
+      default:
+        std::snprintf(text, sizeof(text), "%s r%d, r%d, r%d",
+                      name, in.rega(), in.regb(), in.regc());
+        break;
+    }
+
+    return text;
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,552 @@
+#ifndef SDISCASYNC_HPP
+#define SDISCASYNC_HPP
+
+// C++20 coroutines for running many CPUs on one host thread, inside an
+// event loop. The loop calls Scheduler::poll() whenever it has time, and
+// each CPU runs a slice, so no CPU holds the thread for long. Empty
+// without coroutines. Everything here is inline whatever
+// SDISC_HEADER_ONLY is, since sdisc_static is built as C++17 and has
+// none of it.
+
+#include "SDISC.hpp"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+  #define SDISC_HAS_COROUTINES 1
+#else
+  #define SDISC_HAS_COROUTINES 0
+#endif
+
+#if SDISC_HAS_COROUTINES
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace SDISC // Async Constants
+{
+  namespace ASYNC
+  {
+    // Ticks a CPU runs for before the next thing queued gets a turn. A
+    // slice is never less than the CPU's CPU::maxCost().
+    const COUNT slice_ticks = 0x4000;
+  }
+}
+
+namespace SDISC // Tasks
+{
+  class Scheduler;
+
+  // A coroutine for a Scheduler to run, which starts once spawn() hands
+  // it over. Tasks co_await what a Scheduler and its devices give, not
+  // each other.
+  class Task
+  {
+  public: // Coroutine
+    struct promise_type
+    {
+      Task get_return_object()
+      { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+
+      void return_void() {}
+      void unhandled_exception() { error = std::current_exception(); }
+
+      std::exception_ptr error;
+    };
+
+  public: // Constructor
+    Task(Task&& in) noexcept : handle(std::exchange(in.handle, nullptr)) {}
+    ~Task() { if(handle) handle.destroy(); }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task& operator=(Task&&) = delete;
+
+  private:
+    friend class Scheduler;
+    explicit Task(std::coroutine_handle<promise_type> in) : handle(in) {}
+
+    std::coroutine_handle<promise_type> handle;
+  };
+}
+
+namespace SDISC // Async Devices
+{
+  class RunFor;
+
+  // A Device a guest can wait on. One that reads with nothing to give
+  // calls starve(), and the CPU is left out of the Scheduler's turns
+  // from the end of that slice until wake(), rather than going on asking.
+  // One that is not ready() for a read also calls starve(), and the CPU
+  // waits on the LOD, which is made again once it is woken.
+  class AsyncDevice : public Device
+  {
+  public:
+    AsyncDevice() = default;
+    ~AsyncDevice() override;
+
+    AsyncDevice(const AsyncDevice&) = delete;
+    AsyncDevice& operator=(const AsyncDevice&) = delete;
+
+  protected:
+    void starve() { hungry = true; }
+
+    // Gives every CPU waiting on this a turn again
+    void wake();
+
+  private:
+    friend class RunFor;
+
+    bool hungry = false;          // Read with nothing to give this slice,
+                                  // or not ready
+    std::vector<RunFor*> parked;  // Waiting for wake()
+  };
+}
+
+namespace SDISC // Scheduler
+{
+  // What co_await Scheduler::runFor() waits on. It runs the CPU in slices,
+  // one each poll(), and gives the result of the whole run.
+  class RunFor
+  {
+  public: // Awaitable
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> in);
+    RunResult await_resume() const noexcept { return total; }
+
+  public: // Constructor
+    ~RunFor();
+
+    RunFor(const RunFor&) = delete;
+    RunFor& operator=(const RunFor&) = delete;
+
+  private:
+    friend class Scheduler;
+    friend class AsyncDevice;
+
+    enum class Turn { Running, Waiting, Done };
+
+    RunFor(Scheduler& in_scheduler, CPU& in_cpu, COUNT in_max_ticks, Dispatch in_engine)
+      : scheduler(in_scheduler), cpu(in_cpu), max_ticks{in_max_ticks}, engine{in_engine} {}
+
+    // Runs one slice of the CPU
+    Turn step();
+
+    Scheduler& scheduler;
+    CPU& cpu;
+    const COUNT max_ticks;
+    const Dispatch engine;
+
+    RunResult total{Status::TickLimit, 0, 0};
+    std::coroutine_handle<> waiter;
+
+    // The AsyncDevices on the CPU's bus, found on the first slice
+    std::vector<AsyncDevice*> devices;
+    bool found = false;
+    AsyncDevice* waiting = nullptr;
+  };
+
+  // Takes turns running CPUs and resuming the coroutines that wait for
+  // them, all on the thread calling poll(). A CPU waiting on an empty
+  // AsyncDevice takes no turns until it is woken, so thousands of them
+  // can sit waiting for input at no cost.
+  //
+  //   Task serve(Scheduler& scheduler, CPU& cpu, Channel& channel)
+  //   {
+  //     channel.send(request);
+  //     RunResult result = co_await scheduler.runFor(cpu, 0x100000);
+  //     WORD reply = co_await channel.next();
+  //   }
+  //
+  // Nothing here is thread safe, and devices must be woken from the
+  // thread calling poll().
+  class Scheduler
+  {
+  public: // Constructor
+    explicit Scheduler(COUNT slice_ticks = ASYNC::slice_ticks)
+      : slice{slice_ticks} {}
+
+    // Destroys every task that has not finished
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+  public: // Tasks
+    // Starts task on the next poll()
+    void spawn(Task task);
+
+    // Runs cpu as CPU::run() would until STP or max_ticks, a slice at a
+    // time, with the total once it is done. A stalled LOD waits for its
+    // device rather than ending the run.
+    RunFor runFor(CPU& cpu, COUNT max_ticks = no_limit, Dispatch engine = default_dispatch)
+    { return RunFor(*this, cpu, max_ticks, engine); }
+
+    // Lets everything else queued have a turn first
+    struct Yield
+    {
+      Scheduler& scheduler;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> in) { scheduler.resumeLater(in); }
+      void await_resume() const noexcept {}
+    };
+
+    Yield yield() { return Yield{*this}; }
+
+  public: // Running
+    // Gives everything queued when it is called one turn: a slice for
+    // each CPU and a resume for each coroutine. An exception out of a
+    // task comes out of here. Returns how many turns there were.
+    std::size_t poll();
+
+    // poll() until nothing is queued. Tasks waiting on devices are left.
+    void run() { while(!idle()) poll(); }
+
+    bool idle() const { return queue.empty(); }
+
+    // Tasks spawned that have not finished
+    std::size_t tasks() const { return owned.size(); }
+
+  public: // Variables
+    const COUNT slice;
+
+  private:
+    friend class RunFor;
+    friend class AsyncDevice;
+    friend class Channel;
+
+    // A slice of job if there is one, otherwise a resume of handle
+    struct Turn
+    {
+      RunFor* job;
+      std::coroutine_handle<> handle;
+    };
+
+    void runLater(RunFor& job) { queue.push_back(Turn{&job, nullptr}); }
+    void resumeLater(std::coroutine_handle<> in) { queue.push_back(Turn{nullptr, in}); }
+
+    // Destroys in once it is a task that has finished
+    void resume(std::coroutine_handle<> in);
+
+    std::deque<Turn> queue;
+    std::unordered_set<void*> owned; // Frames of unfinished tasks
+  };
+}
+
+namespace SDISC // Channels
+{
+  // Words between a guest and the host's tasks, laid out as Queue is.
+  // Writes to offset 0 are sent to the host, reads of offset 0 take the
+  // next word the host sent, and wait for one if there is none: the LOD
+  // stalls, and is made again once the host sends something. Offset 1
+  // reads how many words are waiting for the guest and offset 2 how many
+  // are waiting for the host. Reading 1 with nothing waiting leaves the
+  // guest off the Scheduler from the end of that slice until the host
+  // sends something.
+  class Channel : public AsyncDevice
+  {
+  public: // Constructor
+    explicit Channel(Scheduler& in_scheduler) : scheduler(in_scheduler) {}
+    ~Channel() override;
+
+  public: // Device
+    WORD read(WORD offset) override;
+    void write(const DeviceWrite* in, std::size_t count) override;
+    bool ready(WORD offset) override;
+
+  public: // Host Side
+    void send(WORD value);
+
+    // False if the guest has sent nothing more
+    bool receive(WORD& value);
+
+    // What co_await next() waits on, the next word the guest sends
+    class Next
+    {
+    public:
+      bool await_ready();
+      void await_suspend(std::coroutine_handle<> in);
+      WORD await_resume() const noexcept { return value; }
+
+      ~Next();
+
+      Next(const Next&) = delete;
+      Next& operator=(const Next&) = delete;
+
+    private:
+      friend class Channel;
+      explicit Next(Channel& in_channel) : channel(in_channel) {}
+
+      Channel& channel;
+      std::coroutine_handle<> waiter;
+      WORD value = init_mem;
+    };
+
+    Next next() { return Next(*this); }
+
+  private:
+    static WORD size(std::size_t in) { return WORD(std::min<std::size_t>(in, 0xffff)); }
+
+    // Hands words the guest sent to coroutines waiting for them, in order
+    void deliver();
+
+    Scheduler& scheduler;
+    std::deque<WORD> to_guest;
+    std::deque<WORD> to_host;
+    std::deque<Next*> receivers;
+  };
+}
+
+namespace SDISC
+{
+  /* Async Devices */
+  inline AsyncDevice::~AsyncDevice()
+  {
+    for(RunFor* i : parked) i->waiting = nullptr;
+  }
+
+  inline void AsyncDevice::wake()
+  {
+    hungry = false;
+
+    for(RunFor* i : parked)
+    {
+      i->waiting = nullptr;
+      i->scheduler.runLater(*i);
+    }
+
+    parked.clear();
+  }
+
+  /* Run For */
+  inline void RunFor::await_suspend(std::coroutine_handle<> in)
+  {
+    waiter = in;
+    scheduler.runLater(*this);
+  }
+
+  inline RunFor::~RunFor()
+  {
+    if(waiting != nullptr)
+    {
+      std::vector<RunFor*>& parked = waiting->parked;
+      parked.erase(std::remove(parked.begin(), parked.end(), this), parked.end());
+    }
+  }
+
+  // Slices always fit the next instruction, so one that adds no ticks is
+  // out of max_ticks, unless it stalled
+  inline RunFor::Turn RunFor::step()
+  {
+    if(!found)
+    {
+      if(const Bus* bus = cpu.mem.attached())
+      {
+        for(std::size_t i = 0; i < page_count; ++i)
+        {
+          AsyncDevice* device = dynamic_cast<AsyncDevice*>(bus->device(i));
+          if(device != nullptr && std::find(devices.begin(), devices.end(), device) == devices.end())
+          { devices.push_back(device); }
+        }
+      }
+
+      found = true;
+    }
+
+    for(AsyncDevice* i : devices) i->hungry = false;
+
+    const COUNT slice = std::max(scheduler.slice, cpu.maxCost());
+    const COUNT budget = std::min(slice, max_ticks - total.ticks);
+    const RunResult result = cpu.run(budget, no_limit, engine);
+
+    total.ticks += result.ticks;
+    total.instructions += result.instructions;
+
+    // PC is left on the LOD, which runs again once its device wakes the
+    // CPU, or next turn if the device is not an AsyncDevice
+    if(result.status == Status::Stalled)
+    {
+      for(AsyncDevice* i : devices)
+      {
+        if(i->hungry)
+        {
+          waiting = i;
+          i->parked.push_back(this);
+          return Turn::Waiting;
+        }
+      }
+
+      return Turn::Running;
+    }
+
+    total.status = result.status;
+    if(result.status != Status::TickLimit || budget < slice || result.ticks == 0)
+    { return Turn::Done; }
+
+    for(AsyncDevice* i : devices)
+    {
+      if(i->hungry)
+      {
+        waiting = i;
+        i->parked.push_back(this);
+        return Turn::Waiting;
+      }
+    }
+
+    return Turn::Running;
+  }
+
+  /* Scheduler */
+  inline Scheduler::~Scheduler()
+  {
+    queue.clear();
+
+    for(void* i : owned) std::coroutine_handle<>::from_address(i).destroy();
+  }
+
+  inline void Scheduler::spawn(Task task)
+  {
+    std::coroutine_handle<> handle = std::exchange(task.handle, nullptr);
+    owned.insert(handle.address());
+    resumeLater(handle);
+  }
+
+  inline std::size_t Scheduler::poll()
+  {
+    const std::size_t turns = queue.size();
+
+    for(std::size_t i = 0; i < turns; ++i)
+    {
+      const Turn turn = queue.front();
+      queue.pop_front();
+
+      if(turn.job == nullptr) { resume(turn.handle); continue; }
+
+      switch(turn.job->step())
+      {
+        case RunFor::Turn::Running: queue.push_back(turn); break;
+        case RunFor::Turn::Waiting: break;
+        case RunFor::Turn::Done: resume(turn.job->waiter); break;
+      }
+    }
+
+    return turns;
+  }
+
+  inline void Scheduler::resume(std::coroutine_handle<> in)
+  {
+    in.resume();
+    if(!in.done() || owned.erase(in.address()) == 0) return;
+
+    using Handle = std::coroutine_handle<Task::promise_type>;
+    const std::exception_ptr error = Handle::from_address(in.address()).promise().error;
+    in.destroy();
+
+    if(error) std::rethrow_exception(error);
+  }
+
+  /* Channels */
+  inline Channel::~Channel()
+  {
+    for(Next* i : receivers) i->waiter = nullptr;
+  }
+
+  inline WORD Channel::read(WORD offset)
+  {
+    switch(offset)
+    {
+      // Only when ready(), unless a BusTap reads for the guest
+      case 0:
+        if(to_guest.empty()) { starve(); return init_mem; }
+        else
+        {
+          const WORD out = to_guest.front();
+          to_guest.pop_front();
+          return out;
+        }
+
+      case 1:
+        if(to_guest.empty()) starve();
+        return size(to_guest.size());
+
+      case 2: return size(to_host.size());
+    }
+
+    return 0;
+  }
+
+  inline bool Channel::ready(WORD offset)
+  {
+    if(offset != 0 || !to_guest.empty()) return true;
+
+    starve();
+    return false;
+  }
+
+  inline void Channel::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    { if(in[i].offset == 0) to_host.push_back(in[i].value); }
+
+    deliver();
+  }
+
+  inline void Channel::send(WORD value)
+  {
+    to_guest.push_back(value);
+    wake();
+  }
+
+  inline bool Channel::receive(WORD& value)
+  {
+    if(to_host.empty()) return false;
+    value = to_host.front();
+    to_host.pop_front();
+    return true;
+  }
+
+  inline void Channel::deliver()
+  {
+    while(!receivers.empty() && !to_host.empty())
+    {
+      Next* next = receivers.front();
+      receivers.pop_front();
+
+      next->value = to_host.front();
+      to_host.pop_front();
+
+      scheduler.resumeLater(std::exchange(next->waiter, nullptr));
+    }
+  }
+
+  inline bool Channel::Next::await_ready()
+  {
+    return channel.receivers.empty() && channel.receive(value);
+  }
+
+  inline void Channel::Next::await_suspend(std::coroutine_handle<> in)
+  {
+    waiter = in;
+    channel.receivers.push_back(this);
+  }
+
+  inline Channel::Next::~Next()
+  {
+    if(waiter)
+    {
+      std::deque<Next*>& receivers = channel.receivers;
+      receivers.erase(std::remove(receivers.begin(), receivers.end(), this), receivers.end());
+    }
+  }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,366 @@
+#ifndef SDISCBANKS_HPP
+#define SDISCBANKS_HPP
+
+#include "SDISC.hpp"
+#include "SDISCImage.hpp"
+
+#include <vector>
+
+namespace SDISC // Bank Format
+{
+  namespace BANK
+  {
+    const BYTE magic[4] = {'S', 'D', 'B', 'K'};
+    const WORD version = 1;
+
+    const std::size_t header_bytes = 16;
+
+    // Program banks kept decoded while another is in
+    const std::size_t resident_programs = 8;
+  }
+
+  // Where the banks of a BankFile go. Program banks replace program from
+  // program_first up, and mem banks replace the mem_pages pages of mem
+  // from page mem_first, the window.
+  struct BankLayout
+  {
+    WORD program_first = 0x8000;
+    WORD program_banks = 0;
+
+    WORD mem_first = 0x80;
+    WORD mem_pages = 0;
+    WORD mem_banks = 0;
+
+    std::size_t programWords() const { return pro_size - program_first; }
+    std::size_t memWords() const { return std::size_t(mem_pages) * page_size; }
+  };
+
+  // Banks as little endian bytes, laid out so mem banks can be used in
+  // place:
+  //
+  //   magic[4], version, program_first, program_banks,
+  //   mem_first, mem_pages, mem_banks
+  //   programWords() words for each program bank
+  //   zeros up to a multiple of page_bytes, then memWords() words for
+  //   each mem bank
+  //
+  // Every field is a 16 bit word.
+  struct BankFile
+  {
+    BankLayout layout;
+
+    std::shared_ptr<const BYTE> data;
+    std::size_t mem_offset = 0; // Of the first mem bank in data
+    bool direct = false;        // Pages can point into data
+
+    // Program bank bank over the words of common below program_first
+    std::shared_ptr<const Program> program(const Program& common, std::size_t bank) const;
+
+    // Page index of mem bank bank, counting from the start of the window
+    std::shared_ptr<const Page> page(std::size_t bank, std::size_t index) const;
+  };
+
+  // Program bank i is programs[i] from program_first up and mem bank i
+  // is mems[i] from the start of the window, padded with init_pro and
+  // init_mem. The bank counts of layout are taken from programs and
+  // mems. Empty if a bank does not fit, the window does not fit in mem
+  // or there are more than 0xffff banks of either kind.
+  std::vector<BYTE> saveBanks(const BankLayout& layout,
+                              const std::vector<std::vector<Instruction>>& programs,
+                              const std::vector<std::vector<WORD>>& mems);
+  bool writeBanks(const char* path, const BankLayout& layout,
+                  const std::vector<std::vector<Instruction>>& programs,
+                  const std::vector<std::vector<WORD>>& mems);
+
+  // Returns false, leaving out alone, if data is not valid banks. Only
+  // the header is read, banks are read as they are switched in.
+  bool loadBanks(const std::shared_ptr<const BYTE>& data, std::size_t size, BankFile& out);
+
+  // loadBanks() of mapFile(), so only the banks that are switched in are
+  // ever paged in
+  bool mapBanks(const char* path, BankFile& out);
+}
+
+namespace SDISC // Bank Switching
+{
+  // Switches the banks of a BankFile into a CPU, for programs and data
+  // that do not fit in 64K words. Offset 0 holds a bank number, which is
+  // written and read back. Reading offset 1 switches program to that
+  // bank and reading offset 2 switches mem, each giving the bank that was
+  // in before, or init_mem and switching nothing if there is no such
+  // bank. Offsets 3 and 4 read the program and mem banks that are in, 5
+  // and 6 how many there are.
+  //
+  // Switches happen on reads, so every engine sees them right after the
+  // LOD that made them. Code that switches program banks has to be below
+  // program_first, and reach the banked code only by jumping to it.
+  // Program banks are built over the CPU's program as it was when Banks
+  // was made, and the last few are kept decoded, with their blocks kept
+  // translated by the JIT, so switching back to one is only a pointer
+  // swap. The window must not cover a device page. Writes to it stay
+  // with the bank they were made to while others are in, but are never
+  // written back to the file.
+  //
+  // Which banks are in is not part of a Snapshot, and a Replayer gives
+  // back the reads of switches without making them.
+  class Banks : public Device
+  {
+  public: // Constructor
+    // Switches cpu to bank 0 of each kind there is
+    Banks(CPU& in_cpu, BankFile in_file);
+
+  public: // Device
+    WORD read(WORD offset) override;
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+  public: // Host Side
+    // False, switching nothing, if there is no such bank
+    bool switchProgram(std::size_t bank);
+    bool switchMem(std::size_t bank);
+
+    std::size_t programBank() const { return program; }
+    std::size_t memBank() const { return mem; }
+
+    const BankFile& file() const { return banks; }
+
+  private:
+    struct Resident
+    {
+      std::size_t bank;
+      COUNT used; // When last switched to
+      std::shared_ptr<const Program> image;
+    };
+
+    CPU& cpu;
+    const BankFile banks;
+
+    std::shared_ptr<const Program> common; // Has the words below program_first
+    std::vector<Resident> resident;
+    COUNT switches = 0;
+
+    // Window pages of each mem bank as they were when it was last
+    // switched out, empty if it never was
+    std::vector<std::vector<std::shared_ptr<const Page>>> saved;
+
+    WORD selected = 0;
+    std::size_t program = 0;
+    std::size_t mem = 0;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Bank Files */
+  SDISC_INLINE std::shared_ptr<const Program> BankFile::program(const Program& common, std::size_t bank) const
+  {
+    const std::size_t first = layout.program_first;
+    const BYTE* in = data.get() + BANK::header_bytes + 2 * bank * layout.programWords();
+
+    std::vector<WORD> words(pro_size);
+    for(std::size_t i = 0; i < first; ++i) words[i] = common.code[i].word();
+    for(std::size_t i = first; i < pro_size; ++i) words[i] = IMAGE::get(in + 2 * (i - first));
+
+    std::size_t length = pro_size;
+    while(length > first && words[length - 1] == init_pro.word()) --length;
+    return Program::load(words.data(), length);
+  }
+
+  SDISC_INLINE std::shared_ptr<const Page> BankFile::page(std::size_t bank, std::size_t index) const
+  {
+    const BYTE* in = data.get() + mem_offset + (bank * layout.mem_pages + index) * IMAGE::page_bytes;
+    if(direct) return std::shared_ptr<const Page>(data, reinterpret_cast<const Page*>(in));
+
+    std::shared_ptr<Page> copy = std::make_shared<Page>();
+    for(std::size_t w = 0; w < page_size; ++w) copy->word[w] = IMAGE::get(in + 2 * w);
+    return copy;
+  }
+
+  SDISC_INLINE std::vector<BYTE> saveBanks(const BankLayout& in_layout,
+                                           const std::vector<std::vector<Instruction>>& programs,
+                                           const std::vector<std::vector<WORD>>& mems)
+  {
+    BankLayout layout = in_layout;
+    if(programs.size() > 0xffff || mems.size() > 0xffff) return {};
+    if(std::size_t(layout.mem_first) + layout.mem_pages > page_count) return {};
+    if(!mems.empty() && layout.mem_pages == 0) return {};
+    layout.program_banks = WORD(programs.size());
+    layout.mem_banks = WORD(mems.size());
+
+    for(const std::vector<Instruction>& i : programs) if(i.size() > layout.programWords()) return {};
+    for(const std::vector<WORD>& i : mems) if(i.size() > layout.memWords()) return {};
+
+    std::vector<BYTE> out(BANK::magic, BANK::magic + 4);
+    IMAGE::put(out, BANK::version);
+    IMAGE::put(out, layout.program_first);
+    IMAGE::put(out, layout.program_banks);
+    IMAGE::put(out, layout.mem_first);
+    IMAGE::put(out, layout.mem_pages);
+    IMAGE::put(out, layout.mem_banks);
+
+    for(const std::vector<Instruction>& bank : programs)
+    {
+      for(const Instruction& i : bank) IMAGE::put(out, i.word());
+      for(std::size_t i = bank.size(); i < layout.programWords(); ++i) IMAGE::put(out, init_pro.word());
+    }
+
+    out.resize((out.size() + IMAGE::page_bytes - 1) / IMAGE::page_bytes * IMAGE::page_bytes, 0);
+    for(const std::vector<WORD>& bank : mems)
+    {
+      for(WORD i : bank) IMAGE::put(out, i);
+      for(std::size_t i = bank.size(); i < layout.memWords(); ++i) IMAGE::put(out, init_mem);
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE bool writeBanks(const char* path, const BankLayout& layout,
+                               const std::vector<std::vector<Instruction>>& programs,
+                               const std::vector<std::vector<WORD>>& mems)
+  {
+    const std::vector<BYTE> bytes = saveBanks(layout, programs, mems);
+    if(bytes.empty()) return false;
+
+    std::FILE* file = std::fopen(path, "wb");
+    if(file == nullptr) return false;
+
+    const bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return std::fclose(file) == 0 && written;
+  }
+
+  SDISC_INLINE bool loadBanks(const std::shared_ptr<const BYTE>& data, std::size_t size, BankFile& out)
+  {
+    const BYTE* in = data.get();
+    if(size < BANK::header_bytes || std::memcmp(in, BANK::magic, 4) != 0) return false;
+    if(IMAGE::get(in + 4) != BANK::version) return false;
+
+    BankFile file;
+    file.layout.program_first = IMAGE::get(in + 6);
+    file.layout.program_banks = IMAGE::get(in + 8);
+    file.layout.mem_first = IMAGE::get(in + 10);
+    file.layout.mem_pages = IMAGE::get(in + 12);
+    file.layout.mem_banks = IMAGE::get(in + 14);
+
+    const BankLayout& layout = file.layout;
+    if(std::size_t(layout.mem_first) + layout.mem_pages > page_count) return false;
+    if(layout.mem_banks != 0 && layout.mem_pages == 0) return false;
+
+    const std::size_t programs = BANK::header_bytes + 2 * layout.program_banks * layout.programWords();
+    file.mem_offset = (programs + IMAGE::page_bytes - 1) / IMAGE::page_bytes * IMAGE::page_bytes;
+    if(size < file.mem_offset + std::size_t(layout.mem_banks) * layout.mem_pages * IMAGE::page_bytes)
+    { return false; }
+
+    // Words can be used where they are if they are already in host order
+    file.direct = SDISC_LITTLE_ENDIAN &&
+      reinterpret_cast<std::uintptr_t>(in) % alignof(WORD) == 0;
+    file.data = data;
+
+    out = std::move(file);
+    return true;
+  }
+
+  SDISC_INLINE bool mapBanks(const char* path, BankFile& out)
+  {
+    std::shared_ptr<const BYTE> data;
+    std::size_t size;
+    return mapFile(path, data, size) && loadBanks(data, size, out);
+  }
+
+  /* Banks */
+  SDISC_INLINE Banks::Banks(CPU& in_cpu, BankFile in_file)
+    : cpu(in_cpu), banks(std::move(in_file)), common{in_cpu.programImage()},
+      saved(banks.layout.mem_banks)
+  {
+    // Nothing is saved for the window or program as they are now
+    program = banks.layout.program_banks;
+    mem = banks.layout.mem_banks;
+    if(!switchProgram(0)) program = 0;
+    if(!switchMem(0)) mem = 0;
+  }
+
+  SDISC_INLINE WORD Banks::read(WORD offset)
+  {
+    switch(offset)
+    {
+      case 0: return selected;
+
+      case 1:
+      {
+        const WORD previous = WORD(program);
+        return switchProgram(selected) ? previous : init_mem;
+      }
+
+      case 2:
+      {
+        const WORD previous = WORD(mem);
+        return switchMem(selected) ? previous : init_mem;
+      }
+
+      case 3: return WORD(program);
+      case 4: return WORD(mem);
+      case 5: return banks.layout.program_banks;
+      case 6: return banks.layout.mem_banks;
+    }
+
+    return 0;
+  }
+
+  SDISC_INLINE void Banks::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    { if(in[i].offset == 0) selected = in[i].value; }
+  }
+
+  SDISC_INLINE bool Banks::switchProgram(std::size_t bank)
+  {
+    if(bank >= banks.layout.program_banks) return false;
+    if(bank == program) return true;
+
+    Resident* slot = nullptr;
+    for(Resident& i : resident) if(i.bank == bank) slot = &i;
+
+    // Otherwise the one switched to longest ago makes room
+    if(slot == nullptr)
+    {
+      if(resident.size() < BANK::resident_programs) slot = &resident.emplace_back();
+      else
+      {
+        slot = &resident[0];
+        for(Resident& i : resident) if(i.used < slot->used) slot = &i;
+      }
+
+      slot->bank = bank;
+      slot->image = banks.program(*common, bank);
+    }
+
+    slot->used = ++switches;
+    cpu.loadProgram(slot->image);
+    program = bank;
+    return true;
+  }
+
+  SDISC_INLINE bool Banks::switchMem(std::size_t bank)
+  {
+    if(bank >= banks.layout.mem_banks) return false;
+    if(bank == mem) return true;
+
+    const std::size_t first = banks.layout.mem_first;
+    const std::size_t pages = banks.layout.mem_pages;
+
+    // Pages written so far become shared, so the window can be kept as
+    // pointers to them
+    const std::shared_ptr<const MemoryImage> frozen = cpu.mem.freeze();
+    if(mem < saved.size()) saved[mem].assign(frozen->pages + first, frozen->pages + first + pages);
+
+    std::shared_ptr<MemoryImage> next = std::make_shared<MemoryImage>(*frozen);
+    for(std::size_t i = 0; i < pages; ++i)
+    { next->pages[first + i] = saved[bank].empty() ? banks.page(bank, i) : saved[bank][i]; }
+
+    cpu.mem.reset(std::move(next));
+    mem = bank;
+    return true;
+  }
+}
+#endif
+
+#endif
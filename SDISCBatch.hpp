@@ -0,0 +1,388 @@
+#ifndef SDISCBATCH_HPP
+#define SDISCBATCH_HPP
+
+#include "SDISC.hpp"
+
+#include <array>
+
+namespace SDISC // Batch Constants
+{
+  namespace BATCH
+  {
+    // Steps in a row where at most 1 / divergence_ratio of the running
+    // lanes, or only one, share a PC before the batch gives up on
+    // lockstep and runs the remaining lanes one at a time.
+    const std::size_t divergence_ratio = 4;
+    const std::size_t divergence_steps = 64;
+  }
+}
+
+namespace SDISC
+{
+  // N independent CPUs running one program image in lockstep, which can
+  // also be shared with other batches and CPUs. Registers
+  // are laid out by register then lane, so every instruction is a loop
+  // over lanes that the compiler turns into vector code for the target
+  // (SSE/AVX2/AVX-512/NEON). Each step runs the lanes sitting at the
+  // lowest PC and masks out the rest, so lanes that branched apart meet
+  // up again when they reach the same code.
+  template<std::size_t N>
+  class CPUBatch
+  {
+  public: // Types
+    using Results = std::array<RunResult, N>;
+
+  public: // CPU Control
+    CPUBatch(){ reset(); }
+
+    void reset()
+    {
+      loadProgram(Program::blank());
+      for(WORD (&r)[N] : reg) for(WORD& i : r) i = init_reg;
+      for(WORD (&m)[mem_size] : mem) for(WORD& i : m) i = init_mem;
+      for(WORD& i : PC) i = 0;
+      for(COUNT& i : tick) i = 0;
+      for(std::uint64_t (&w)[page_count / 64] : written) for(std::uint64_t& i : w) i = 0;
+    }
+
+    /* Program Memory */
+    // Builds a new image from in_program, or shares an existing one
+    template<class ArrayType>
+    void loadProgram(const ArrayType in_program)
+    { loadProgram(Program::make(in_program)); }
+
+    void loadProgram(std::shared_ptr<const Program> in_image)
+    {
+      image = std::move(in_image);
+      program = image->code;
+      decoded = image->decoded;
+    }
+
+    const std::shared_ptr<const Program>& programImage() const
+    { return image; }
+
+    /* Lane State */
+    // Copy PC, reg, mem and tick between a lane and a single CPU. Lanes
+    // have no bus or watchpoints, so a CPU's devices and watchpoints are
+    // not carried over.
+    void loadLane(std::size_t lane, const CPU& cpu);
+    void storeLane(std::size_t lane, CPU& cpu) const;
+
+  public: // Execution
+    /* Execute every lane until STP or its budget runs out */
+    Results run(COUNT max_ticks = no_limit,
+                COUNT max_instructions = no_limit);
+
+  private: // Execution
+    // Runs data at pc on every lane whose mask is 0xffff
+    void step(const Decoded& data, WORD pc, const WORD (&mask)[N]);
+
+    // Runs one lane on its own, once lockstep has stopped paying off
+    void runLane(std::size_t lane, COUNT max_ticks,
+                 COUNT max_instructions, RunResult& result);
+
+    // Traps the instruction at pc on lane as cause, as CPU::fault()
+    void fault(std::size_t lane, WORD cause, WORD pc);
+
+    // Marks the page of address in lane's mem as written
+    void wrote(std::size_t lane, WORD address)
+    { written[lane][address >> page_shift >> 6] |= std::uint64_t(1) << ((address >> page_shift) & 63); }
+
+    static WORD blend(WORD mask, WORD in, WORD old)
+    { return WORD((in & mask) | (old & ~mask)); }
+
+  private: // Program Image
+    std::shared_ptr<const Program> image;
+
+  public: // Variables
+    WORD PC[N];
+    const Instruction* program; // The arrays of image
+    const Decoded* decoded;
+    WORD reg[reg_size][N];
+    WORD mem[N][mem_size];
+
+    COUNT tick[N];
+    Trap trap; // For every lane, not copied by loadLane()
+
+    // Pages of each lane's mem written by STR or a trap since reset(), as
+    // bitmaps, which only reset() and the caller clear
+    std::uint64_t written[N][page_count / 64];
+  };
+}
+
+namespace SDISC
+{
+  /* Lane State */
+  template<std::size_t N>
+  void CPUBatch<N>::loadLane(std::size_t lane, const CPU& cpu)
+  {
+    PC[lane] = cpu.PC;
+    for(std::size_t r = 0; r < reg_size; ++r) reg[r][lane] = cpu.reg[r];
+    for(std::size_t i = 0; i < mem_size; ++i) mem[lane][i] = cpu.mem.load(WORD(i));
+    tick[lane] = cpu.tick;
+  }
+
+  template<std::size_t N>
+  void CPUBatch<N>::storeLane(std::size_t lane, CPU& cpu) const
+  {
+    cpu.PC = PC[lane];
+    for(std::size_t r = 0; r < reg_size; ++r) cpu.reg[r] = reg[r][lane];
+
+    // Only words that differ are stored, so untouched pages stay shared
+    for(std::size_t i = 0; i < mem_size; ++i)
+    {
+      if(cpu.mem.load(WORD(i)) != mem[lane][i]) cpu.mem.store(WORD(i), mem[lane][i]);
+    }
+
+    cpu.tick = tick[lane];
+  }
+
+  /* Run Loop */
+  // A lane stops for the same reasons and in the same place as a CPU
+  // with no devices or watchpoints running the same program with
+  // CPU::run(). STR and LOD only ever reach the lane's mem.
+  template<std::size_t N>
+  typename CPUBatch<N>::Results
+  CPUBatch<N>::run(COUNT max_ticks, COUNT max_instructions)
+  {
+    Results result;
+    bool running[N];
+    std::size_t sparse = 0;
+
+    for(std::size_t l = 0; l < N; ++l)
+    {
+      result[l] = RunResult{Status::InstructionLimit, 0, 0};
+      running[l] = true;
+    }
+
+    for(;;)
+    {
+      std::size_t live = 0;
+      WORD pc = 0xffff;
+
+      for(std::size_t l = 0; l < N; ++l)
+      {
+        if(!running[l]) continue;
+        if(live == 0 || PC[l] < pc) pc = PC[l];
+        ++live;
+      }
+
+      if(live == 0) return result;
+
+      // Lanes at pc that can afford the instruction take part in it
+      const Decoded& data = decoded[pc];
+      WORD mask[N];
+      std::size_t active = 0;
+
+      for(std::size_t l = 0; l < N; ++l)
+      {
+        mask[l] = 0x0000;
+        if(!running[l] || PC[l] != pc) continue;
+
+        if(result[l].instructions >= max_instructions)
+        { running[l] = false; continue; }
+
+        if(data.code == OP::STP)
+        { result[l].status = Status::Halted; running[l] = false; continue; }
+
+        if(max_ticks - result[l].ticks < data.ticks)
+        { result[l].status = Status::TickLimit; running[l] = false; continue; }
+
+        mask[l] = 0xffff;
+        tick[l] += data.ticks;
+        result[l].ticks += data.ticks;
+        ++result[l].instructions;
+        ++active;
+      }
+
+      if(active == 0) continue;
+      step(data, pc, mask);
+
+      // Too few lanes agree on where to go, finish them one by one
+      if(active <= std::max<std::size_t>(1, live / BATCH::divergence_ratio)) { ++sparse; }
+      else { sparse = 0; }
+
+      if(sparse > BATCH::divergence_steps)
+      {
+        for(std::size_t l = 0; l < N; ++l)
+        {
+          if(running[l]) runLane(l, max_ticks, max_instructions, result[l]);
+        }
+
+        return result;
+      }
+    }
+  }
+
+  template<std::size_t N>
+  void CPUBatch<N>::step(const Decoded& data, WORD pc, const WORD (&m)[N])
+  {
+    WORD (&ra)[N] = reg[data.rega];
+    const WORD (&rb)[N] = reg[data.regb];
+    const WORD (&rc)[N] = reg[data.regc];
+    const WORD next = WORD(pc + 1);
+
+    switch(data.code)
+    {
+      // Jump/Condition
+      case OP::JAL:
+        for(std::size_t l = 0; l < N; ++l)
+        {
+          const WORD target = rb[l];
+          ra[l] = blend(m[l], WORD(pc + 2), ra[l]);
+          PC[l] = blend(m[l], target, PC[l]);
+        }
+        return;
+
+      case OP::JIE:
+        for(std::size_t l = 0; l < N; ++l)
+        { PC[l] = blend(m[l], ra[l] == rb[l] ? rc[l] : next, PC[l]); }
+        return;
+
+      case OP::JIL:
+        for(std::size_t l = 0; l < N; ++l)
+        { PC[l] = blend(m[l], ra[l] < rb[l] ? rc[l] : next, PC[l]); }
+        return;
+
+      // Store/Load/Set
+      case OP::STR:
+        for(std::size_t l = 0; l < N; ++l)
+        { if(m[l]) { mem[l][rb[l]] = ra[l]; wrote(l, rb[l]); } }
+        break;
+
+      case OP::LOD:
+        for(std::size_t l = 0; l < N; ++l)
+        { if(m[l]) ra[l] = mem[l][rb[l]]; }
+        break;
+
+      case OP::SHB:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD((ra[l] & 0x00ff) | data.imm), ra[l]); }
+        break;
+
+      case OP::SLB:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD((ra[l] & 0xff00) | data.imm), ra[l]); }
+        break;
+
+      // Bitwise
+      case OP::AND:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(rb[l] & rc[l]), ra[l]); }
+        break;
+
+      case OP::NND:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(~(rb[l] & rc[l])), ra[l]); }
+        break;
+
+      case OP::IOR:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(rb[l] | rc[l]), ra[l]); }
+        break;
+
+      case OP::XOR:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(rb[l] ^ rc[l]), ra[l]); }
+        break;
+
+      // Math
+      case OP::ADD:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(rb[l] + rc[l]), ra[l]); }
+        break;
+
+      case OP::SUB:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], WORD(rb[l] - rc[l]), ra[l]); }
+        break;
+
+      case OP::MUL:
+        for(std::size_t l = 0; l < N; ++l)
+        { ra[l] = blend(m[l], OP::multiply(rb[l], rc[l]), ra[l]); }
+        break;
+
+      // No vector integer divide, and masked out lanes may hold zero
+      case OP::DIV:
+        for(std::size_t l = 0; l < N; ++l)
+        {
+          if(!m[l]) continue;
+          if(rc[l] == 0 && trap.enabled) { fault(l, Fault::DivideByZero, pc); continue; }
+          ra[l] = OP::divide(rb[l], rc[l]);
+          PC[l] = next;
+        }
+        return;
+    }
+
+    for(std::size_t l = 0; l < N; ++l)
+    { PC[l] = blend(m[l], next, PC[l]); }
+  }
+
+  template<std::size_t N>
+  void CPUBatch<N>::runLane(std::size_t lane, COUNT max_ticks,
+                            COUNT max_instructions, RunResult& result)
+  {
+    WORD& pc = PC[lane];
+
+    while(result.instructions < max_instructions)
+    {
+      const Decoded& data = decoded[pc];
+      WORD& ra = reg[data.rega][lane];
+      const WORD rb = reg[data.regb][lane];
+      const WORD rc = reg[data.regc][lane];
+
+      if(data.code == OP::STP)
+      { result.status = Status::Halted; return; }
+
+      if(max_ticks - result.ticks < data.ticks)
+      { result.status = Status::TickLimit; return; }
+
+      tick[lane] += data.ticks;
+      result.ticks += data.ticks;
+      ++result.instructions;
+      ++pc;
+
+      switch(data.code)
+      {
+        // Jump/Condition
+        case OP::JAL: ra = WORD(pc + 1); pc = rb; break;
+        case OP::JIE: if(ra == rb) { pc = rc; } break;
+        case OP::JIL: if(ra < rb) { pc = rc; } break;
+
+        // Store/Load/Set
+        case OP::STR: mem[lane][rb] = ra; wrote(lane, rb); break;
+        case OP::LOD: ra = mem[lane][rb]; break;
+        case OP::SHB: ra = WORD((ra & 0x00ff) | data.imm); break;
+        case OP::SLB: ra = WORD((ra & 0xff00) | data.imm); break;
+
+        // Bitwise
+        case OP::AND: ra = WORD(rb & rc); break;
+        case OP::NND: ra = WORD(~(rb & rc)); break;
+        case OP::IOR: ra = WORD(rb | rc); break;
+        case OP::XOR: ra = WORD(rb ^ rc); break;
+
+        // Math
+        case OP::ADD: ra = WORD(rb + rc); break;
+        case OP::SUB: ra = WORD(rb - rc); break;
+        case OP::MUL: ra = OP::multiply(rb, rc); break;
+        case OP::DIV:
+          if(rc == 0 && trap.enabled) { fault(lane, Fault::DivideByZero, WORD(pc - 1)); }
+          else { ra = OP::divide(rb, rc); }
+          break;
+      }
+    }
+  }
+
+  /* Traps */
+  template<std::size_t N>
+  void CPUBatch<N>::fault(std::size_t lane, WORD cause, WORD pc)
+  {
+    mem[lane][trap.frame] = cause;
+    mem[lane][WORD(trap.frame + 1)] = pc;
+    wrote(lane, trap.frame);
+    wrote(lane, WORD(trap.frame + 1));
+    PC[lane] = trap.handler;
+  }
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef SDISCCONSTEXPR_HPP
+#define SDISCCONSTEXPR_HPP
+
+#include "SDISC.hpp"
+
+#include <array>
+
+namespace SDISC // Compile Time Execution
+{
+  // A CPU that can run in constant evaluation, to bake the results of
+  // guest programs into the binary:
+  //
+  //   constexpr Instruction program[] = { ... };
+  //   constexpr auto cpu = SDISC::run(program);
+  //   static_assert(cpu.status == Status::Halted);
+  //
+  // It holds its N words of program and all of mem by value, so it has
+  // no images, devices, profile or trace, and only one dispatch engine.
+  // Program words past N are STP, as they are on a CPU. It gives the same
+  // results as CPU::run(), so it is also usable at run time.
+  //
+  // Compilers limit how long constant evaluation may run, and a program
+  // that runs too long fails to compile. With GCC raise the limits with
+  // -fconstexpr-loop-limit= and -fconstexpr-ops-limit=, with Clang with
+  // -fconstexpr-steps=.
+  template<std::size_t N>
+  class ConstexprCPU
+  {
+  public: // Constructor
+    constexpr ConstexprCPU() { reset(); }
+
+    template<class ArrayType>
+    constexpr explicit ConstexprCPU(const ArrayType& in_program)
+    { reset(); loadProgram(in_program); }
+
+    constexpr void reset()
+    {
+      PC = 0;
+      tick = 0;
+      for(WORD& i : reg) i = init_reg;
+      for(WORD& i : mem) i = init_mem;
+      for(Instruction& i : program) i = init_pro;
+      status = Status::InstructionLimit;
+    }
+
+    // Copies up to N words from the start of in_program
+    template<class ArrayType>
+    constexpr void loadProgram(const ArrayType& in_program)
+    {
+      std::size_t address = 0;
+      for(const Instruction& i : in_program)
+      {
+        if(address == N) break;
+        program[address++] = i;
+      }
+    }
+
+  public: // Instructions
+    constexpr Instruction fetch(WORD address) const
+    { return address < N ? program[address] : init_pro; }
+
+    /* Execute Instruction */
+    constexpr COUNT CYCLE() { const Instruction in = fetch(PC++); return RUN(in); }
+    constexpr COUNT RUN(const Instruction& in);
+
+    /* Execute until STP or a budget runs out */
+    // Stops where CPU::run() would, and sets status to why
+    constexpr RunResult run(COUNT max_ticks = no_limit,
+                            COUNT max_instructions = no_limit);
+
+  public: // Variables
+    WORD PC = 0;
+    Instruction program[N] = {};
+    WORD reg[reg_size] = {};
+    WORD mem[mem_size] = {};
+
+    COUNT tick = 0;
+    Status status = Status::InstructionLimit; // Why run() last returned
+    Trap trap; // Kept by reset(), as on a CPU
+  };
+
+  // Runs program from PC 0 on a fresh ConstexprCPU, which is returned
+  // for its registers, mem and tick
+  template<std::size_t N>
+  constexpr ConstexprCPU<N> run(const Instruction (&program)[N],
+                                COUNT max_ticks = no_limit,
+                                COUNT max_instructions = no_limit);
+
+  template<std::size_t N>
+  constexpr ConstexprCPU<N> run(const std::array<Instruction, N>& program,
+                                COUNT max_ticks = no_limit,
+                                COUNT max_instructions = no_limit);
+}
+
+namespace SDISC
+{
+  /* Execute Instruction */
+  // The same as the CPU handlers of each opcode
+  template<std::size_t N>
+  constexpr COUNT ConstexprCPU<N>::RUN(const Instruction& in)
+  {
+    WORD& a = reg[in.rega()];
+    const WORD b = reg[in.regb()];
+    const WORD c = reg[in.regc()];
+
+    switch(in.code())
+    {
+      // Program Control
+      case OP::STP: --PC; break;
+
+      // Jump/Condition
+      case OP::JAL: a = ++PC; PC = b; break;
+      case OP::JIE: if(a == b) PC = c; break;
+      case OP::JIL: if(a < b) PC = c; break;
+
+      // Store/Load/Set
+      case OP::STR: mem[b] = a; break;
+      case OP::LOD: a = mem[b]; break;
+      case OP::SHB: a = WORD((a & 0x00ff) | in.byte() << 8); break;
+      case OP::SLB: a = WORD((a & 0xff00) | in.byte()); break;
+
+      // Bitwise
+      case OP::AND: a = WORD(b & c); break;
+      case OP::NND: a = WORD(~(b & c)); break;
+      case OP::IOR: a = WORD(b | c); break;
+      case OP::XOR: a = WORD(b ^ c); break;
+
+      // Math
+      case OP::ADD: a = WORD(b + c); break;
+      case OP::SUB: a = WORD(b - c); break;
+      case OP::MUL: a = OP::multiply(b, c); break;
+      case OP::DIV:
+        if(c == 0 && trap.enabled)
+        {
+          mem[trap.frame] = Fault::DivideByZero;
+          mem[WORD(trap.frame + 1)] = WORD(PC - 1);
+          PC = trap.handler;
+        }
+        else { a = OP::divide(b, c); }
+        break;
+    }
+
+    tick += OP::tick_count[in.code()];
+    return OP::tick_count[in.code()];
+  }
+
+  /* Run Loop */
+  template<std::size_t N>
+  constexpr RunResult ConstexprCPU<N>::run(COUNT max_ticks, COUNT max_instructions)
+  {
+    RunResult result{Status::InstructionLimit, 0, 0};
+
+    while(result.instructions < max_instructions)
+    {
+      const Instruction in = fetch(PC);
+
+      if(in.code() == OP::STP)
+      { result.status = Status::Halted; break; }
+
+      if(max_ticks - result.ticks < OP::tick_count[in.code()])
+      { result.status = Status::TickLimit; break; }
+
+      ++PC; result.ticks += RUN(in);
+      ++result.instructions;
+    }
+
+    status = result.status;
+    return result;
+  }
+
+  template<std::size_t N>
+  constexpr ConstexprCPU<N> run(const Instruction (&program)[N],
+                                COUNT max_ticks, COUNT max_instructions)
+  {
+    ConstexprCPU<N> cpu(program);
+    cpu.run(max_ticks, max_instructions);
+    return cpu;
+  }
+
+  template<std::size_t N>
+  constexpr ConstexprCPU<N> run(const std::array<Instruction, N>& program,
+                                COUNT max_ticks, COUNT max_instructions)
+  {
+    ConstexprCPU<N> cpu(program);
+    cpu.run(max_ticks, max_instructions);
+    return cpu;
+  }
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC // Compile Time Checks
+{
+  // 0xffff * 0xffff wraps to 1, and would overflow int if WORDs were
+  // multiplied as they promote
+  namespace CONSTEXPR_CHECK
+  {
+    constexpr Instruction wrapping_mul[] =
+    {
+      Instruction(OP::SHB, 1, 0xff),
+      Instruction(OP::SLB, 1, 0xff),
+      Instruction(OP::MUL, 2, 1, 1),
+      Instruction(OP::STP)
+    };
+
+    static_assert(run(wrapping_mul).reg[2] == 1, "MUL must wrap to 16 bits");
+  }
+}
+#endif
+
+#endif
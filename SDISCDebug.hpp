@@ -0,0 +1,707 @@
+#ifndef SDISCDEBUG_HPP
+#define SDISCDEBUG_HPP
+
+// Breakpoints and watchpoints on a CPU, and a GDB remote stub to drive
+// them. Breakpoints work on any CPU, watchpoints only with
+// Features::Watch, which CPU has with SDISC_WATCH defined to 1 for the
+// whole program. Defining it in only some files would give CPU two
+// layouts.
+
+#include "SDISC.hpp"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define SDISC_HAS_GDB_SOCKET 1
+  #include <poll.h>
+  #include <unistd.h>
+#else
+  #define SDISC_HAS_GDB_SOCKET 0
+#endif
+
+namespace SDISC // GDB Constants
+{
+  namespace GDB
+  {
+    // Where gdb sees program words and words of mem, as byte addresses
+    const std::uint32_t program_base = 0x00000;
+    const std::uint32_t mem_base = 0x20000;
+
+    // r0 to r15, then pc
+    const std::size_t registers = reg_size + 1;
+
+    // Ticks run between checks for an interrupt from gdb
+    const COUNT slice_ticks = 0x100000;
+
+    // Largest packet gdb may send
+    const std::size_t packet_size = 0x4000;
+  }
+}
+
+namespace SDISC // Debugger
+{
+  // Stops Debugger::run() with PC on pc, before it runs. A conditional one
+  // only stops while reg[reg] == value there, and otherwise runs on.
+  struct Breakpoint
+  {
+    WORD pc = 0;
+    bool conditional = false;
+    BYTE reg = 0;
+    WORD value = 0;
+  };
+
+  // Breakpoints and watchpoints on one CPU.
+  //
+  // Breakpoints decode as STP in a copy of the program that only cpu
+  // runs, so every engine, the JIT included, stops there at full speed
+  // and code between them runs as it always does. code keeps the real
+  // instructions, and run() and step() run the one under a breakpoint
+  // themselves. When cpu is given another program, or writes its
+  // program, the breakpoints are put into that one on the next run().
+  //
+  // Watchpoints are the words of cpu.watch, which LOD and STR check. A
+  // CPU built without Features::Watch checks nothing and can not have
+  // any.
+  class Debugger
+  {
+  public: // Constructor
+    explicit Debugger(CPU& in_cpu) : cpu(in_cpu) {}
+
+    // Takes the breakpoints back out of cpu's program
+    ~Debugger();
+
+    Debugger(const Debugger&) = delete;
+    Debugger& operator=(const Debugger&) = delete;
+
+  public: // Breakpoints
+    void addBreakpoint(WORD pc) { addBreakpoint(Breakpoint{pc, false, 0, 0}); }
+    void addBreakpoint(WORD pc, BYTE reg, WORD value) { addBreakpoint(Breakpoint{pc, true, BYTE(reg & 0xf), value}); }
+    void addBreakpoint(const Breakpoint& in);
+
+    void removeBreakpoint(WORD pc);
+    void clearBreakpoints();
+
+    bool breakpoint(WORD pc) const { return breakpoints.count(pc) != 0; }
+
+  public: // Watchpoints
+    // Adds access to what stops at words [address, address + length),
+    // false without Features::Watch
+    bool watch(WORD address, std::size_t length, BYTE access);
+
+    // Takes access away from them
+    bool unwatch(WORD address, std::size_t length, BYTE access = Access::Both);
+
+    bool clearWatchpoints();
+
+    // The LOD or STR run() last stopped after, nullptr if it did not
+    const WatchState* watchHit() const { return cpu.watchHit(); }
+
+  public: // Running
+    // CPU::run() that also returns Status::Breakpoint at a breakpoint that
+    // holds. A breakpoint at PC when it is called is run past, so calling
+    // it again carries on.
+    RunResult run(COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit,
+                  Dispatch engine = default_dispatch);
+
+    // Runs the instruction at PC, even with a breakpoint on it
+    RunResult step(COUNT max_ticks = no_limit);
+
+  public: // Variables
+    CPU& cpu;
+
+  private: // Program
+    // Makes cpu run a copy of its program with the breakpoints in it
+    void patch();
+
+    bool holds(const Breakpoint& in) const
+    { return !in.conditional || cpu.reg[in.reg] == in.value; }
+
+  private: // Variables
+    std::map<WORD, Breakpoint> breakpoints;
+    std::map<WORD, BYTE> watches;
+
+    std::shared_ptr<const Program> original; // cpu's program without them
+    std::shared_ptr<const Program> patched;  // What cpu runs while there are any
+    std::vector<WORD> stops;                 // Where patched decodes STP
+    bool changed = false;                    // Breakpoints since patched was made
+  };
+}
+
+namespace SDISC // GDB Remote Stub
+{
+  // Answers the GDB remote serial protocol for a Debugger:
+  //
+  //   gdb -ex 'target remote localhost:1234'
+  //
+  // gdb sees r0 to r15 then pc as 16 bit registers, and program words at
+  // GDB::program_base + 2 * pc and words of mem at GDB::mem_base + 2 *
+  // address, all little endian. Device pages read as 0 and ignore writes,
+  // so gdb looking at them does nothing to the devices. It handles
+  // reading and writing both and the registers, continue and step,
+  // breakpoints (Z0 and Z1), write, read and access watchpoints (Z2 to Z4)
+  // and qXfer of a target description. Reaching STP stops with SIGTRAP as
+  // a breakpoint does, so what it stopped with can still be looked at.
+  class GDBStub
+  {
+  public: // Constructor
+    explicit GDBStub(Debugger& in_debugger) : debugger(in_debugger) {}
+
+  public: // Packets
+    // The reply to one packet, both without $ and the checksum. While a
+    // continue runs, interrupted is called every GDB::slice_ticks, and it
+    // stops with SIGINT once that returns true.
+    std::string handle(const std::string& packet);
+
+    // True once gdb has detached or killed the target
+    bool finished() const { return done; }
+
+#if SDISC_HAS_GDB_SOCKET
+    // Serves packets from gdb on fd, a connected socket or pipe, until gdb
+    // detaches or the connection closes. False if it closed first.
+    bool serve(int fd);
+#endif
+
+  public: // Variables
+    std::function<bool()> interrupted;
+    Dispatch engine = default_dispatch;
+
+  private: // Commands
+    std::string stopReply() const;
+    std::string resume(const std::string& args, bool step);
+    std::string readMemory(std::uint32_t address, std::size_t length) const;
+    bool writeMemory(std::uint32_t address, const std::string& hex);
+    std::string point(bool insert, const std::string& args);
+
+    WORD readRegister(std::size_t index) const;
+    void writeRegister(std::size_t index, WORD value);
+
+  private: // Variables
+    Debugger& debugger;
+    int signal = 5; // Of the last stop, SIGTRAP
+    bool done = false;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Debugger */
+  SDISC_INLINE Debugger::~Debugger()
+  {
+    if(patched != nullptr && cpu.programImage() == patched) cpu.loadProgram(original);
+  }
+
+  SDISC_INLINE void Debugger::addBreakpoint(const Breakpoint& in)
+  {
+    changed |= !breakpoint(in.pc);
+    breakpoints[in.pc] = in;
+  }
+
+  SDISC_INLINE void Debugger::removeBreakpoint(WORD pc)
+  { changed |= breakpoints.erase(pc) != 0; }
+
+  SDISC_INLINE void Debugger::clearBreakpoints()
+  {
+    changed |= !breakpoints.empty();
+    breakpoints.clear();
+  }
+
+  SDISC_INLINE bool Debugger::watch(WORD address, std::size_t length, BYTE access)
+  {
+    if(!CPU::has(Features::Watch)) return false;
+
+    for(std::size_t i = 0; i < length && i < mem_size; ++i)
+    {
+      const WORD word = WORD(address + i);
+      BYTE& now = watches[word];
+      now |= access & Access::Both;
+
+      cpu.watchWord(word, now);
+      if(now == Access::None) watches.erase(word);
+    }
+
+    return true;
+  }
+
+  SDISC_INLINE bool Debugger::unwatch(WORD address, std::size_t length, BYTE access)
+  {
+    if(!CPU::has(Features::Watch)) return false;
+
+    for(std::size_t i = 0; i < length && i < mem_size; ++i)
+    {
+      const WORD word = WORD(address + i);
+      const auto found = watches.find(word);
+      if(found == watches.end()) continue;
+
+      found->second &= BYTE(~access);
+      cpu.watchWord(word, found->second);
+      if(found->second == Access::None) watches.erase(found);
+    }
+
+    return true;
+  }
+
+  SDISC_INLINE bool Debugger::clearWatchpoints()
+  {
+    if(!CPU::has(Features::Watch)) return false;
+
+    for(const auto& i : watches) cpu.watchWord(i.first, Access::None);
+    watches.clear();
+    return true;
+  }
+
+  SDISC_INLINE RunResult Debugger::run(COUNT max_ticks, COUNT max_instructions, Dispatch engine)
+  {
+    patch();
+    RunResult total{Status::InstructionLimit, 0, 0};
+
+    for(bool resuming = true;; resuming = false)
+    {
+      // cpu only stops at a breakpoint by reaching its STP, so the real
+      // instruction there is run here
+      const auto found = breakpoints.find(cpu.PC);
+      if(found != breakpoints.end())
+      {
+        if(!resuming && holds(found->second))
+        { total.status = Status::Breakpoint; return total; }
+
+        if(total.instructions == max_instructions) return total;
+
+        const RunResult one = step(max_ticks - total.ticks);
+        total.ticks += one.ticks;
+        total.instructions += one.instructions;
+        total.status = one.status;
+        if(one.status != Status::InstructionLimit) return total;
+      }
+
+      const RunResult part = cpu.run(max_ticks - total.ticks, max_instructions - total.instructions, engine);
+      total.ticks += part.ticks;
+      total.instructions += part.instructions;
+      total.status = part.status;
+
+      if(part.status != Status::Halted || !breakpoint(cpu.PC)) return total;
+    }
+  }
+
+  SDISC_INLINE RunResult Debugger::step(COUNT max_ticks)
+  {
+    patch();
+    return cpu.step(Decoded(cpu.program[cpu.PC]), max_ticks);
+  }
+
+  SDISC_INLINE void Debugger::patch()
+  {
+    const std::shared_ptr<const Program>& image = cpu.programImage();
+    if(image == patched && !changed) return;
+    changed = false;
+
+    // cpu has a new program. If it was written from patched, it still
+    // decodes STP where the breakpoints were.
+    if(image != patched)
+    {
+      original = image;
+
+      bool stale = false;
+      for(WORD pc : stops) stale |= image->decoded[pc].code != image->code[pc].code();
+
+      if(stale)
+      {
+        std::shared_ptr<Program> clean = std::make_shared<Program>(*image);
+        for(WORD pc : stops) clean->stopAt(pc, false);
+        original = std::move(clean);
+      }
+    }
+
+    stops.clear();
+    if(breakpoints.empty())
+    {
+      patched = nullptr;
+      cpu.loadProgram(original);
+      return;
+    }
+
+    std::shared_ptr<Program> copy = std::make_shared<Program>(*original);
+    for(const auto& i : breakpoints)
+    {
+      copy->stopAt(i.first, true);
+      stops.push_back(i.first);
+    }
+
+    patched = std::move(copy);
+    cpu.loadProgram(patched);
+  }
+
+  /* GDB Remote Stub */
+  namespace GDB
+  {
+    SDISC_INLINE int digit(char in)
+    {
+      if(in >= '0' && in <= '9') return in - '0';
+      if(in >= 'a' && in <= 'f') return in - 'a' + 10;
+      if(in >= 'A' && in <= 'F') return in - 'A' + 10;
+      return -1;
+    }
+
+    // Reads hex digits from at up to the first other character
+    SDISC_INLINE std::uint32_t number(const std::string& in, std::size_t& at)
+    {
+      std::uint32_t out = 0;
+      for(; at < in.size() && digit(in[at]) >= 0; ++at) out = out << 4 | std::uint32_t(digit(in[at]));
+      return out;
+    }
+
+    SDISC_INLINE void byte(std::string& out, BYTE in)
+    {
+      const char* const hex = "0123456789abcdef";
+      out += hex[in >> 4];
+      out += hex[in & 0xf];
+    }
+
+    // Two hex digits at in[at], which the caller has checked are there
+    SDISC_INLINE BYTE byte(const std::string& in, std::size_t at)
+    { return BYTE(std::max(digit(in[at]), 0) << 4 | std::max(digit(in[at + 1]), 0)); }
+
+    // Words are sent low byte first
+    SDISC_INLINE void word(std::string& out, WORD in)
+    { byte(out, BYTE(in)); byte(out, BYTE(in >> 8)); }
+
+    SDISC_INLINE WORD word(const std::string& in, std::size_t at)
+    { return WORD(byte(in, at) | byte(in, at + 2) << 8); }
+
+    SDISC_INLINE std::string frame(const std::string& payload)
+    {
+      BYTE sum = 0;
+      for(char i : payload) sum = BYTE(sum + BYTE(i));
+
+      std::string out = "$" + payload + "#";
+      byte(out, sum);
+      return out;
+    }
+
+    SDISC_INLINE std::string description()
+    {
+      std::string out =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\"><feature name=\"org.sdisc.core\">";
+
+      for(std::size_t i = 0; i < reg_size; ++i)
+      { out += "<reg name=\"r" + std::to_string(i) + "\" bitsize=\"16\" type=\"uint16\"/>"; }
+
+      out += "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/></feature></target>";
+      return out;
+    }
+  }
+
+  SDISC_INLINE std::string GDBStub::handle(const std::string& packet)
+  {
+    if(packet.empty()) return "";
+
+    const std::string args = packet.substr(1);
+    std::size_t at = 0;
+
+    switch(packet[0])
+    {
+      case '?': return stopReply();
+
+      case 'g':
+      {
+        std::string out;
+        for(std::size_t i = 0; i < GDB::registers; ++i) GDB::word(out, readRegister(i));
+        return out;
+      }
+
+      case 'G':
+        if(args.size() < GDB::registers * 4) return "E01";
+        for(std::size_t i = 0; i < GDB::registers; ++i) writeRegister(i, GDB::word(args, i * 4));
+        return "OK";
+
+      case 'p':
+      {
+        const std::uint32_t index = GDB::number(args, at);
+        if(index >= GDB::registers) return "E01";
+
+        std::string out;
+        GDB::word(out, readRegister(index));
+        return out;
+      }
+
+      case 'P':
+      {
+        const std::uint32_t index = GDB::number(args, at);
+        if(index >= GDB::registers || at >= args.size() || args[at] != '=' || args.size() < at + 5) return "E01";
+        writeRegister(index, GDB::word(args, at + 1));
+        return "OK";
+      }
+
+      case 'm':
+      {
+        const std::uint32_t address = GDB::number(args, at);
+        if(at >= args.size() || args[at] != ',') return "E01";
+        const std::uint32_t length = GDB::number(args, ++at);
+        return readMemory(address, std::min<std::size_t>(length, GDB::packet_size / 2));
+      }
+
+      case 'M':
+      {
+        const std::uint32_t address = GDB::number(args, at);
+        if(at >= args.size() || args[at] != ',') return "E01";
+        const std::uint32_t length = GDB::number(args, ++at);
+        if(at >= args.size() || args[at] != ':' || args.size() - at - 1 < length * 2) return "E01";
+        return writeMemory(address, args.substr(at + 1, length * 2)) ? "OK" : "E01";
+      }
+
+      case 'c': return resume(args, false);
+      case 's': return resume(args, true);
+
+      case 'Z': return point(true, args);
+      case 'z': return point(false, args);
+
+      case 'H': return "OK";
+      case 'T': return "OK";
+
+      case 'D': done = true; return "OK";
+      case 'k': done = true; return "";
+
+      case 'q':
+        if(packet.compare(0, 10, "qSupported") == 0)
+        {
+          std::string size;
+          for(int shift = 12; shift >= 0; shift -= 4) size += "0123456789abcdef"[(GDB::packet_size >> shift) & 0xf];
+          return "PacketSize=" + size + ";qXfer:features:read+";
+        }
+        if(packet == "qAttached") return "1";
+        if(packet == "qC") return "QC1";
+        if(packet == "qfThreadInfo") return "m1";
+        if(packet == "qsThreadInfo") return "l";
+
+        if(packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0)
+        {
+          const std::string range = packet.substr(31);
+          const std::uint32_t offset = GDB::number(range, at);
+          if(at >= range.size() || range[at] != ',') return "E01";
+          const std::uint32_t length = GDB::number(range, ++at);
+
+          const std::string text = GDB::description();
+          if(offset >= text.size()) return "l";
+          return (offset + length >= text.size() ? "l" : "m") + text.substr(offset, length);
+        }
+        return "";
+    }
+
+    return "";
+  }
+
+  SDISC_INLINE std::string GDBStub::stopReply() const
+  {
+    std::string out = "T";
+    GDB::byte(out, BYTE(signal));
+
+    const WatchState* hit = debugger.watchHit();
+    if(signal == 5 && hit != nullptr)
+    {
+      out += hit->access == Access::Write ? "watch:" : "rwatch:";
+
+      std::string address;
+      const std::uint32_t byte_address = GDB::mem_base + 2 * std::uint32_t(hit->address);
+      for(int shift = 16; shift >= 0; shift -= 8) GDB::byte(address, BYTE(byte_address >> shift));
+      out += address + ";";
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE std::string GDBStub::resume(const std::string& args, bool step)
+  {
+    CPU& cpu = debugger.cpu;
+
+    std::size_t at = 0;
+    if(!args.empty())
+    {
+      const std::uint32_t address = GDB::number(args, at);
+      if(address >= GDB::program_base && address < GDB::mem_base)
+      { cpu.PC = WORD((address - GDB::program_base) / 2); }
+    }
+
+    signal = 5;
+    if(step) { debugger.step(); return stopReply(); }
+
+    for(;;)
+    {
+      const RunResult result = debugger.run(GDB::slice_ticks, no_limit, engine);
+      if(result.status != Status::TickLimit) return stopReply();
+
+      if(interrupted && interrupted())
+      {
+        signal = 2;
+        return stopReply();
+      }
+    }
+  }
+
+  SDISC_INLINE std::string GDBStub::readMemory(std::uint32_t address, std::size_t length) const
+  {
+    const CPU& cpu = debugger.cpu;
+    std::string out;
+
+    for(std::uint32_t i = address; i < address + length; ++i)
+    {
+      WORD word;
+      if(i >= GDB::program_base && i < GDB::program_base + 2 * pro_size)
+      { word = cpu.program[(i - GDB::program_base) / 2].word(); }
+      else if(i >= GDB::mem_base && i < GDB::mem_base + 2 * mem_size)
+      {
+        const WORD where = WORD((i - GDB::mem_base) / 2);
+        word = cpu.mem.device(where >> page_shift) ? 0 : cpu.mem.load(where);
+      }
+      else return out.empty() ? "E01" : out;
+
+      GDB::byte(out, BYTE(i & 1 ? word >> 8 : word));
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE bool GDBStub::writeMemory(std::uint32_t address, const std::string& hex)
+  {
+    CPU& cpu = debugger.cpu;
+
+    for(std::size_t n = 0; n + 1 < hex.size(); n += 2)
+    {
+      const BYTE value = GDB::byte(hex, n);
+      const std::uint32_t i = address + std::uint32_t(n / 2);
+      const int shift = i & 1 ? 8 : 0;
+      const WORD mask = WORD(0xff << shift);
+
+      if(i >= GDB::program_base && i < GDB::program_base + 2 * pro_size)
+      {
+        const WORD pc = WORD((i - GDB::program_base) / 2);
+        const WORD word = WORD((cpu.program[pc].word() & ~mask) | value << shift);
+        cpu.writeProgram(pc, Instruction::fromWord(word));
+      }
+      else if(i >= GDB::mem_base && i < GDB::mem_base + 2 * mem_size)
+      {
+        const WORD where = WORD((i - GDB::mem_base) / 2);
+        if(cpu.mem.device(where >> page_shift)) continue;
+        cpu.mem.store(where, WORD((cpu.mem.load(where) & ~mask) | value << shift));
+      }
+      else return false;
+    }
+
+    return true;
+  }
+
+  // Z and z: type, byte address, then kind or length in bytes
+  SDISC_INLINE std::string GDBStub::point(bool insert, const std::string& args)
+  {
+    std::size_t at = 0;
+    const std::uint32_t type = GDB::number(args, at);
+    if(at >= args.size() || args[at] != ',') return "E01";
+    const std::uint32_t address = GDB::number(args, ++at);
+    if(at >= args.size() || args[at] != ',') return "E01";
+    const std::uint32_t length = std::max<std::uint32_t>(GDB::number(args, ++at), 1);
+
+    if(type <= 1)
+    {
+      if(address < GDB::program_base || address >= GDB::mem_base) return "E01";
+      const WORD pc = WORD((address - GDB::program_base) / 2);
+      if(insert) debugger.addBreakpoint(pc);
+      else debugger.removeBreakpoint(pc);
+      return "OK";
+    }
+
+    if(type <= 4)
+    {
+      if(address < GDB::mem_base || address >= GDB::mem_base + 2 * mem_size) return "E01";
+      const BYTE access = type == 2 ? Access::Write : type == 3 ? Access::Read : Access::Both;
+
+      const std::uint32_t first = (address - GDB::mem_base) / 2;
+      const std::uint32_t last = (address - GDB::mem_base + length - 1) / 2;
+      const bool ok = insert ? debugger.watch(WORD(first), last - first + 1, access)
+                             : debugger.unwatch(WORD(first), last - first + 1, access);
+      return ok ? "OK" : "";
+    }
+
+    return "";
+  }
+
+  SDISC_INLINE WORD GDBStub::readRegister(std::size_t index) const
+  { return index < reg_size ? debugger.cpu.reg[index] : debugger.cpu.PC; }
+
+  SDISC_INLINE void GDBStub::writeRegister(std::size_t index, WORD value)
+  {
+    if(index < reg_size) debugger.cpu.reg[index] = value;
+    else debugger.cpu.PC = value;
+  }
+
+#if SDISC_HAS_GDB_SOCKET
+  SDISC_INLINE bool GDBStub::serve(int fd)
+  {
+    auto send = [fd](const std::string& in)
+    {
+      for(std::size_t at = 0; at < in.size();)
+      {
+        const ssize_t sent = ::write(fd, in.data() + at, in.size() - at);
+        if(sent <= 0) return false;
+        at += std::size_t(sent);
+      }
+      return true;
+    };
+
+    // gdb sends 0x03 alone to interrupt a continue
+    std::function<bool()> outer = interrupted;
+    interrupted = [fd, &outer]
+    {
+      pollfd waiting{fd, POLLIN, 0};
+      BYTE in = 0;
+      if(::poll(&waiting, 1, 0) > 0 && ::read(fd, &in, 1) == 1 && in == 0x03) return true;
+      return outer && outer();
+    };
+
+    std::string packet, last;
+    enum { Idle, Payload, Sum1, Sum2 } state = Idle;
+
+    for(char in; !done;)
+    {
+      if(::read(fd, &in, 1) != 1) break;
+
+      switch(state)
+      {
+        case Idle:
+          if(in == '$') { packet.clear(); state = Payload; }
+          else if(in == '-' && !last.empty()) send(last);
+          else if(in == 0x03) { signal = 2; send(last = GDB::frame(stopReply())); }
+          break;
+
+        case Payload:
+          if(in == '#') state = Sum1;
+          else if(packet.size() < GDB::packet_size) packet += in;
+          break;
+
+        // The link is reliable, so checksums are not checked
+        case Sum1: state = Sum2; break;
+        case Sum2:
+        {
+          state = Idle;
+          if(!send("+")) break;
+
+          const std::string reply = handle(packet);
+          if(packet == "k") break;
+          send(last = GDB::frame(reply));
+          break;
+        }
+      }
+    }
+
+    interrupted = outer;
+    return done;
+  }
+#endif
+}
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef SDISCDEVICES_HPP
+#define SDISCDEVICES_HPP
+
+#include "SDISC.hpp"
+
+#include <cstdio>
+#include <deque>
+
+namespace SDISC // Devices
+{
+  // Writes to offset 0 print their low byte. Each batch of writes is
+  // printed with one fwrite().
+  class Console : public Device
+  {
+  public:
+    explicit Console(std::FILE* in_out = stdout) : out{in_out} {}
+
+    WORD read(WORD) override { return 0; }
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+  private:
+    std::FILE* out;
+    std::vector<char> text;
+  };
+
+  // Reads of offsets 0 to 3 give a 64 bit tick count, low word first.
+  // Reading offset 0 latches the count, so reading 0 then 1 to 3 never
+  // tears. Dispatch::Block and the JIT only add ticks between blocks, so
+  // there it reads as of the start of the block.
+  class Timer : public Device
+  {
+  public:
+    explicit Timer(const COUNT& in_tick) : tick(in_tick) {}
+
+    WORD read(WORD offset) override;
+    void write(const DeviceWrite*, std::size_t) override {}
+
+  private:
+    const COUNT& tick;
+    COUNT latch = 0;
+  };
+
+  // Copies blocks of mem. Write the source to offset 0, the destination
+  // to 1 and the length to 2, then anything to 3 to copy. Like every
+  // device write, the copy happens when the bus hands the batch over,
+  // so a guest reads offset 3, which is always 0, before relying on it.
+  class DMA : public Device
+  {
+  public:
+    explicit DMA(Memory& in_mem) : mem(in_mem) {}
+
+    WORD read(WORD offset) override { return offset < 3 ? regs[offset] : 0; }
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+  private:
+    Memory& mem;
+    WORD regs[3] = {};
+  };
+
+  // Words to and from the host. Writes to offset 0 are sent to the host,
+  // reads of offset 0 take the next word the host sent, or init_mem if
+  // there is none. Offset 1 reads how many words are waiting for the
+  // guest and offset 2 how many are waiting for the host.
+  class Queue : public Device
+  {
+  public:
+    WORD read(WORD offset) override;
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+    /* Host Side */
+    void send(WORD value) { to_guest.push_back(value); }
+
+    // False if the guest has sent nothing more
+    bool receive(WORD& value);
+
+  private:
+    static WORD size(std::size_t in) { return WORD(std::min<std::size_t>(in, 0xffff)); }
+
+    std::deque<WORD> to_guest;
+    std::deque<WORD> to_host;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Console */
+  SDISC_INLINE void Console::write(const DeviceWrite* in, std::size_t count)
+  {
+    text.clear();
+    for(std::size_t i = 0; i < count; ++i)
+    { if(in[i].offset == 0) text.push_back(char(in[i].value)); }
+
+    if(!text.empty()) std::fwrite(text.data(), 1, text.size(), out);
+  }
+
+  /* Timer */
+  SDISC_INLINE WORD Timer::read(WORD offset)
+  {
+    if(offset == 0) latch = tick;
+    return offset < 4 ? WORD(latch >> (16 * offset)) : 0;
+  }
+
+  /* DMA */
+  SDISC_INLINE void DMA::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      if(in[i].offset < 3) { regs[in[i].offset] = in[i].value; continue; }
+      if(in[i].offset != 3) continue;
+
+      // Copies as memmove would when the ranges overlap
+      const WORD from = regs[0], to = regs[1], length = regs[2];
+      if(WORD(to - from) < length)
+      { for(WORD n = length; n-- > 0;) mem.store(WORD(to + n), mem.load(WORD(from + n))); }
+      else
+      { for(WORD n = 0; n < length; ++n) mem.store(WORD(to + n), mem.load(WORD(from + n))); }
+    }
+  }
+
+  /* Queue */
+  SDISC_INLINE WORD Queue::read(WORD offset)
+  {
+    switch(offset)
+    {
+      case 0:
+      {
+        if(to_guest.empty()) return init_mem;
+        const WORD out = to_guest.front();
+        to_guest.pop_front();
+        return out;
+      }
+
+      case 1: return size(to_guest.size());
+      case 2: return size(to_host.size());
+    }
+
+    return 0;
+  }
+
+  SDISC_INLINE void Queue::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    { if(in[i].offset == 0) to_host.push_back(in[i].value); }
+  }
+
+  SDISC_INLINE bool Queue::receive(WORD& value)
+  {
+    if(to_host.empty()) return false;
+    value = to_host.front();
+    to_host.pop_front();
+    return true;
+  }
+}
+#endif
+
+#endif
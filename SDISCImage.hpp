@@ -0,0 +1,222 @@
+#ifndef SDISCIMAGE_HPP
+#define SDISCIMAGE_HPP
+
+#include "SDISC.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define SDISC_HAS_MMAP 1
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#else
+  #define SDISC_HAS_MMAP 0
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define SDISC_LITTLE_ENDIAN 1
+#else
+  #define SDISC_LITTLE_ENDIAN 0
+#endif
+
+namespace SDISC // Image Format
+{
+  namespace IMAGE
+  {
+    const BYTE magic[4] = {'S', 'D', 'I', 'M'};
+    const WORD version = 1;
+
+    const std::size_t header_bytes = 16;
+    const std::size_t page_bytes = page_size * sizeof(WORD);
+  }
+
+  // A program and the mem it starts with, ready for CPU::loadProgram()
+  // and CPU::loadMemory()
+  struct Image
+  {
+    std::shared_ptr<const Program> program;
+    std::shared_ptr<const MemoryImage> mem;
+  };
+
+  // Images as little endian bytes, laid out so they can be used in place:
+  //
+  //   magic[4], version, page count, program length (4 bytes), 0 (4 bytes)
+  //   page count page indices, program length program words
+  //   zeros up to a multiple of page_bytes, then page_bytes for each page
+  //
+  // Every field is a 16 bit word unless noted. Only pages that are not
+  // all init_mem are written.
+  std::vector<BYTE> saveImage(const Program& program, const MemoryImage& mem);
+  bool writeImage(const char* path, const Program& program, const MemoryImage& mem);
+
+  // Returns false, leaving out alone, if data is not a valid image. On
+  // little endian hosts the pages of mem point straight into data, which
+  // they keep alive, and the program words are read from it once.
+  bool loadImage(const std::shared_ptr<const BYTE>& data, std::size_t size, Image& out);
+
+  // A whole file, mapped rather than read where possible, so only the
+  // pages of it that are used are ever paged in. data keeps it mapped.
+  bool mapFile(const char* path, std::shared_ptr<const BYTE>& data, std::size_t& size);
+
+  // loadImage() of mapFile()
+  bool mapImage(const char* path, Image& out);
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  namespace IMAGE
+  {
+    SDISC_INLINE void put(std::vector<BYTE>& out, WORD value)
+    { out.push_back(BYTE(value)); out.push_back(BYTE(value >> 8)); }
+
+    SDISC_INLINE WORD get(const BYTE* in)
+    { return WORD(in[0] | (in[1] << 8)); }
+
+    SDISC_INLINE bool blankPage(const Page& page)
+    {
+      for(WORD i : page.word) if(i != init_mem) return false;
+      return true;
+    }
+  }
+
+  SDISC_INLINE std::vector<BYTE> saveImage(const Program& program, const MemoryImage& mem)
+  {
+    std::vector<WORD> pages;
+    for(std::size_t i = 0; i < page_count; ++i)
+    {
+      const std::shared_ptr<const Page>& page = mem.pages[i];
+      if(page != MemoryImage::blankPage() && !IMAGE::blankPage(*page))
+      { pages.push_back(WORD(i)); }
+    }
+
+    std::vector<BYTE> out(IMAGE::magic, IMAGE::magic + 4);
+    IMAGE::put(out, IMAGE::version);
+    IMAGE::put(out, WORD(pages.size()));
+    IMAGE::put(out, WORD(program.length));
+    IMAGE::put(out, WORD(program.length >> 16));
+    IMAGE::put(out, 0);
+    IMAGE::put(out, 0);
+
+    for(WORD i : pages) IMAGE::put(out, i);
+    for(std::uint32_t i = 0; i < program.length; ++i) IMAGE::put(out, program.code[i].word());
+
+    out.resize((out.size() + IMAGE::page_bytes - 1) / IMAGE::page_bytes * IMAGE::page_bytes, 0);
+    for(WORD i : pages) for(WORD word : mem.pages[i]->word) IMAGE::put(out, word);
+
+    return out;
+  }
+
+  SDISC_INLINE bool writeImage(const char* path, const Program& program, const MemoryImage& mem)
+  {
+    const std::vector<BYTE> bytes = saveImage(program, mem);
+
+    std::FILE* file = std::fopen(path, "wb");
+    if(file == nullptr) return false;
+
+    const bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return std::fclose(file) == 0 && written;
+  }
+
+  SDISC_INLINE bool loadImage(const std::shared_ptr<const BYTE>& data, std::size_t size, Image& out)
+  {
+    const BYTE* in = data.get();
+    if(size < IMAGE::header_bytes || std::memcmp(in, IMAGE::magic, 4) != 0) return false;
+    if(IMAGE::get(in + 4) != IMAGE::version) return false;
+
+    const std::size_t pages = IMAGE::get(in + 6);
+    const std::size_t length = IMAGE::get(in + 8) | std::size_t(IMAGE::get(in + 10)) << 16;
+    if(pages > page_count || length > pro_size) return false;
+
+    const std::size_t words = IMAGE::header_bytes + 2 * pages;
+    const std::size_t first = (words + 2 * length + IMAGE::page_bytes - 1)
+                            / IMAGE::page_bytes * IMAGE::page_bytes;
+    if(size < first + pages * IMAGE::page_bytes) return false;
+
+    // Words can be used where they are if they are already in host order
+    const bool direct = SDISC_LITTLE_ENDIAN &&
+      reinterpret_cast<std::uintptr_t>(in) % alignof(WORD) == 0;
+
+    // Program
+    Image image;
+    if(direct) image.program = Program::load(reinterpret_cast<const WORD*>(in + words), length);
+    else
+    {
+      std::vector<WORD> copy(length);
+      for(std::size_t i = 0; i < length; ++i) copy[i] = IMAGE::get(in + words + 2 * i);
+      image.program = Program::load(copy.data(), length);
+    }
+
+    // Memory
+    std::shared_ptr<MemoryImage> mem = std::make_shared<MemoryImage>();
+    for(std::size_t i = 0; i < pages; ++i)
+    {
+      const std::size_t index = IMAGE::get(in + IMAGE::header_bytes + 2 * i);
+      const BYTE* page = in + first + i * IMAGE::page_bytes;
+      if(index >= page_count) return false;
+
+      if(direct)
+      { mem->pages[index] = std::shared_ptr<const Page>(data, reinterpret_cast<const Page*>(page)); }
+      else
+      {
+        std::shared_ptr<Page> copy = std::make_shared<Page>();
+        for(std::size_t w = 0; w < page_size; ++w) copy->word[w] = IMAGE::get(page + 2 * w);
+        mem->pages[index] = std::move(copy);
+      }
+    }
+
+    image.mem = std::move(mem);
+    out = std::move(image);
+    return true;
+  }
+
+  SDISC_INLINE bool mapFile(const char* path, std::shared_ptr<const BYTE>& data, std::size_t& size)
+  {
+#if SDISC_HAS_MMAP
+    const int file = ::open(path, O_RDONLY);
+    if(file < 0) return false;
+
+    struct stat info;
+    if(::fstat(file, &info) != 0 || info.st_size <= 0) { ::close(file); return false; }
+
+    const std::size_t length = std::size_t(info.st_size);
+    void* map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if(map == MAP_FAILED) return false;
+
+    data = std::shared_ptr<const BYTE>(static_cast<const BYTE*>(map),
+      [length](const BYTE* in){ ::munmap(const_cast<BYTE*>(in), length); });
+    size = length;
+#else
+    std::FILE* file = std::fopen(path, "rb");
+    if(file == nullptr) return false;
+
+    std::vector<BYTE> bytes;
+    BYTE buffer[0x1000];
+    for(std::size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) != 0;)
+    { bytes.insert(bytes.end(), buffer, buffer + read); }
+    std::fclose(file);
+
+    size = bytes.size();
+    const std::shared_ptr<const std::vector<BYTE>> owner =
+      std::make_shared<const std::vector<BYTE>>(std::move(bytes));
+    data = std::shared_ptr<const BYTE>(owner, owner->data());
+#endif
+
+    return true;
+  }
+
+  SDISC_INLINE bool mapImage(const char* path, Image& out)
+  {
+    std::shared_ptr<const BYTE> data;
+    std::size_t size;
+    return mapFile(path, data, size) && loadImage(data, size, out);
+  }
+}
+#endif
+
+#endif
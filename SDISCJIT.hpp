@@ -0,0 +1,491 @@
+#ifndef SDISCJIT_HPP
+#define SDISCJIT_HPP
+
+#include "SDISC.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+// Native code is only generated for x86-64 with the System V calling
+// convention. Everywhere else JIT::run() falls back to Dispatch::Block,
+// as it also does when CPU is built with Features::Profile or Trace, since
+// native code is neither counted nor traced, or without Features::Ticks,
+// since native code always counts ticks. It also falls back while a
+// Timing model is set, since native blocks charge flat ticks, and while
+// any word is watched, since native LOD and STR do not check. Debugger
+// breakpoints are STP in the decoded program, and stop native code too.
+#if defined(__x86_64__) && !defined(_WIN32)
+  #define SDISC_HAS_JIT 1
+  #include <sys/mman.h>
+#else
+  #define SDISC_HAS_JIT 0
+#endif
+
+namespace SDISC // JIT Constants
+{
+  namespace JIT_LIMIT
+  {
+    // Longest body translated into one native block, longer bodies are
+    // split into several blocks.
+    const std::uint32_t block_length = 0x400;
+
+    // Worst case native bytes for one instruction, and for a whole block
+    const std::size_t instruction_bytes = 80;
+    const std::size_t block_bytes = (block_length + 1) * instruction_bytes;
+
+    // Size of the code buffer, which is flushed whenever it fills up
+    const std::size_t buffer_bytes = 0x400000;
+
+    // Program images whose blocks are kept while another is loaded, so
+    // switching between a few banks does not translate them again
+    const std::size_t images = 8;
+
+    // Added to the address of a DIV that trapped, or of a LOD of a device
+    // that was not ready, in place of the next PC
+    const std::uint32_t trapped = 0x10000;
+    const std::uint32_t stalled = 0x20000;
+
+    // What JIT::load() gives for a device that is not ready
+    const std::uint32_t not_ready = ~std::uint32_t(0);
+  }
+}
+
+namespace SDISC
+{
+  // Translates the basic blocks of a CPU's program into native code as
+  // they are first reached. Each native block runs its body and the jump
+  // that ends it, keeps reg in the CPU and returns the next PC, which is
+  // looked up in a table of translated blocks. mem is reached through its
+  // page tables, calling back into Memory the first time a page is
+  // written. Anything a native block can not cover in the remaining
+  // budget is single stepped by the interpreter, so ticks and halts match
+  // CPU::run() exactly. A DIV by zero with the CPU's trap enabled, or a
+  // LOD of a device that is not ready, leaves the block early, and only
+  // the part of it that ran is counted.
+  //
+  // Translated blocks are kept for each of the last few program images
+  // the CPU had, and only dropped when that image is written or the
+  // code buffer fills up. The image is checked between blocks, so a
+  // device that loads another program in the middle of run() is seen
+  // before the next block.
+  class JIT
+  {
+  public: // Constructor
+    explicit JIT(CPU& in_cpu);
+    ~JIT();
+
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+  public: // JIT Control
+    /* Execute until STP or a budget runs out */
+    RunResult run(COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit);
+
+    /* Drop every translated block, of every image */
+    void invalidate();
+
+    /* Native code is being used */
+    bool native() const { return buffer != nullptr; }
+
+  private: // Types
+    using Code = std::uint32_t (*)(WORD* reg, const Memory::Table* mem);
+
+    struct Entry
+    {
+      Code code;                  // nullptr until translated
+      std::uint32_t instructions; // Instructions run by code
+      std::uint32_t ticks;        // Ticks of those instructions
+    };
+
+    // Blocks translated from one image
+    struct Cache
+    {
+      std::weak_ptr<const Program> image; // Expired if the slot is free
+      std::uint32_t edits;                // Of image when translated
+      COUNT used;                         // When last selected
+      std::unique_ptr<Entry[]> table;
+    };
+
+    // Points table at the blocks of the CPU's image, making room if needed
+    void select();
+
+  private: // Code Generation
+    bool compile(WORD address);
+
+    // Called by native STR when the page is not writable yet
+    static void store(Memory* memory, std::uint32_t address, std::uint32_t value)
+    { memory->store(WORD(address), WORD(value)); }
+
+    // Called by native LOD for device pages, which have no read pointer
+    static std::uint32_t load(Memory* memory, std::uint32_t address)
+    {
+      WORD out;
+      return memory->tryLoad(WORD(address), out) ? out : JIT_LIMIT::not_ready;
+    }
+
+    void emit(BYTE byte) { buffer[used++] = byte; }
+    void emit16(WORD word) { emit(BYTE(word)); emit(BYTE(word >> 8)); }
+    void emit32(std::uint32_t word) { emit16(WORD(word)); emit16(WORD(word >> 16)); }
+    void emit64(std::uint64_t word) { emit32(std::uint32_t(word)); emit32(std::uint32_t(word >> 32)); }
+
+    // Operand for reg[r] relative to the reg pointer
+    static BYTE offset(BYTE r) { return BYTE(r * sizeof(WORD)); }
+
+  private: // Variables
+    CPU& cpu;
+    COUNT revision;
+
+    BYTE* buffer = nullptr;
+    std::size_t used = 0;
+
+    Cache caches[JIT_LIMIT::images];
+    Entry* table = nullptr;
+    COUNT selections = 0;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  SDISC_INLINE JIT::JIT(CPU& in_cpu)
+    : cpu(in_cpu), revision{in_cpu.revision}
+  {
+#if SDISC_HAS_JIT
+    void* map = mmap(nullptr, JIT_LIMIT::buffer_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map != MAP_FAILED) buffer = static_cast<BYTE*>(map);
+#endif
+    invalidate();
+  }
+
+  SDISC_INLINE JIT::~JIT()
+  {
+#if SDISC_HAS_JIT
+    if(buffer) munmap(buffer, JIT_LIMIT::buffer_bytes);
+#endif
+  }
+
+  SDISC_INLINE void JIT::invalidate()
+  {
+    for(Cache& i : caches) i.image.reset();
+    used = 0;
+    select();
+  }
+
+  SDISC_INLINE void JIT::select()
+  {
+    revision = cpu.revision;
+    const std::shared_ptr<const Program>& image = cpu.programImage();
+
+    Cache* slot = &caches[0];
+    for(Cache& i : caches)
+    {
+      if(i.image.lock() == image && i.edits == image->edits)
+      {
+        i.used = ++selections;
+        table = i.table.get();
+        return;
+      }
+
+      // Free slots first, then the one selected longest ago
+      if(!slot->image.expired() && (i.image.expired() || i.used < slot->used)) slot = &i;
+    }
+
+    if(slot->table == nullptr) slot->table.reset(new Entry[pro_size]);
+    std::memset(slot->table.get(), 0, pro_size * sizeof(Entry));
+
+    slot->image = image;
+    slot->edits = image->edits;
+    slot->used = ++selections;
+    table = slot->table.get();
+  }
+
+  /* Run Loop */
+  SDISC_INLINE RunResult JIT::run(COUNT max_ticks, COUNT max_instructions)
+  {
+    if((CPU::features & (Features::Profile | Features::Trace)) != 0 ||
+       !CPU::has(Features::Ticks) || !native() || cpu.timed() || cpu.watching())
+    { return cpu.run(max_ticks, max_instructions, Dispatch::Block); }
+
+    RunResult result{Status::InstructionLimit, 0, 0};
+
+    while(result.instructions < max_instructions)
+    {
+      if(revision != cpu.revision) select();
+
+      // compile() may flush every table, and select another one
+      const bool compiled = table[cpu.PC].code || compile(cpu.PC);
+      const Entry& entry = table[cpu.PC];
+
+      if(compiled &&
+         entry.instructions <= max_instructions - result.instructions &&
+         entry.ticks <= max_ticks - result.ticks)
+      {
+        const std::uint32_t next = entry.code(cpu.reg, &cpu.mem.table);
+        COUNT ticks = entry.ticks;
+
+        if(next < JIT_LIMIT::trapped)
+        {
+          cpu.PC = WORD(next);
+          result.instructions += entry.instructions;
+        }
+
+        // Everything before the LOD ran, and the LOD runs again next time
+        else if(next >= JIT_LIMIT::stalled)
+        {
+          const std::uint32_t address = next - JIT_LIMIT::stalled;
+
+          ticks = 0;
+          for(std::uint32_t i = cpu.PC; i < address; ++i) ticks += cpu.decoded[i].ticks;
+          result.instructions += address - cpu.PC;
+          cpu.PC = WORD(address);
+
+          cpu.tick += ticks;
+          result.ticks += ticks;
+          result.status = Status::Stalled;
+          cpu.mem.flush();
+          return result;
+        }
+
+        else
+        {
+          const std::uint32_t address = next - JIT_LIMIT::trapped;
+
+          ticks = 0;
+          for(std::uint32_t i = cpu.PC; i <= address; ++i) ticks += cpu.decoded[i].ticks;
+          result.instructions += address + 1 - cpu.PC;
+          cpu.fault(Fault::DivideByZero, WORD(address));
+        }
+
+        cpu.tick += ticks;
+        result.ticks += ticks;
+        continue;
+      }
+
+      const RunResult step = cpu.run(max_ticks - result.ticks, 1);
+      result.ticks += step.ticks;
+      result.instructions += step.instructions;
+
+      if(step.status != Status::InstructionLimit)
+      { result.status = step.status; return result; }
+    }
+
+    cpu.mem.flush();
+    return result;
+  }
+
+  /* Code Generation */
+  // Native blocks are called as code(reg, &mem.table), so reg is in rdi
+  // and the page tables in rsi. eax, ecx and edx are scratch and eax
+  // returns the next PC.
+  SDISC_INLINE bool JIT::compile(WORD address)
+  {
+#if SDISC_HAS_JIT
+    const Block& block = cpu.blocks[address];
+    const std::uint32_t length = std::min(block.length, JIT_LIMIT::block_length);
+    const std::uint32_t end = address + length;
+
+    // A lone STP is left to the interpreter, which reports the halt
+    if(length == 0 && cpu.decoded[address].code == OP::STP) return false;
+
+    if(JIT_LIMIT::buffer_bytes - used < JIT_LIMIT::block_bytes) invalidate();
+    if(mprotect(buffer, JIT_LIMIT::buffer_bytes, PROT_READ | PROT_WRITE) != 0)
+    { return false; }
+
+    Entry& entry = table[address];
+    entry.code = reinterpret_cast<Code>(buffer + used);
+    entry.instructions = 0;
+    entry.ticks = 0;
+
+    for(std::uint32_t i = address; i < end; ++i)
+    {
+      const Decoded& data = cpu.decoded[i];
+      const BYTE a = offset(data.rega);
+      const BYTE b = offset(data.regb);
+      const BYTE c = offset(data.regc);
+
+      entry.instructions += 1;
+      entry.ticks += data.ticks;
+
+      // mov word [rdi+a], imm16
+      if(cpu.blocks[i].op == OP::SET && i + 1 < end)
+      {
+        emit(0x66); emit(0xC7); emit(0x47); emit(a);
+        emit16(data.imm | cpu.decoded[i + 1].imm);
+
+        entry.instructions += 1;
+        entry.ticks += cpu.decoded[++i].ticks;
+        continue;
+      }
+
+      switch(data.code)
+      {
+        // Store/Load/Set
+        case OP::STR:
+          // movzx eax, word [rdi+b]; movzx ecx, ah
+          emit(0x0F); emit(0xB7); emit(0x47); emit(b);
+          emit(0x0F); emit(0xB6); emit(0xCC);
+          // mov rdx, [rsi+rcx*8+write]; test rdx, rdx; jz slow
+          emit(0x48); emit(0x8B); emit(0x94); emit(0xCE);
+          emit32(std::uint32_t(offsetof(Memory::Table, write)));
+          emit(0x48); emit(0x85); emit(0xD2);
+          emit(0x74); emit(13);
+          // movzx eax, al; movzx ecx, word [rdi+a]; mov [rdx+rax*2], cx
+          emit(0x0F); emit(0xB6); emit(0xC0);
+          emit(0x0F); emit(0xB7); emit(0x4F); emit(a);
+          emit(0x66); emit(0x89); emit(0x0C); emit(0x42);
+          emit(0xEB); emit(40); // jmp done
+          // slow: push rdi; push rsi; sub rsp, 8
+          emit(0x57); emit(0x56);
+          emit(0x48); emit(0x83); emit(0xEC); emit(0x08);
+          // store(&mem, eax, reg[a])
+          emit(0x0F); emit(0xB7); emit(0x57); emit(a);
+          emit(0x89); emit(0xC6);
+          emit(0x48); emit(0xBF); emit64(reinterpret_cast<std::uintptr_t>(&cpu.mem));
+          emit(0x48); emit(0xB8); emit64(reinterpret_cast<std::uintptr_t>(&JIT::store));
+          emit(0xFF); emit(0xD0);
+          // add rsp, 8; pop rsi; pop rdi
+          emit(0x48); emit(0x83); emit(0xC4); emit(0x08);
+          emit(0x5E); emit(0x5F);
+          break;
+
+        case OP::LOD:
+          // movzx eax, word [rdi+b]; movzx ecx, ah; movzx eax, al
+          emit(0x0F); emit(0xB7); emit(0x47); emit(b);
+          emit(0x0F); emit(0xB6); emit(0xCC);
+          emit(0x0F); emit(0xB6); emit(0xC0);
+          // mov rdx, [rsi+rcx*8]; test rdx, rdx; jz slow
+          emit(0x48); emit(0x8B); emit(0x14); emit(0xCE);
+          emit(0x48); emit(0x85); emit(0xD2);
+          emit(0x74); emit(6);
+          // movzx eax, word [rdx+rax*2]
+          emit(0x0F); emit(0xB7); emit(0x04); emit(0x42);
+          emit(0xEB); emit(49); // jmp done
+          // slow: push rdi; push rsi; sub rsp, 8
+          emit(0x57); emit(0x56);
+          emit(0x48); emit(0x83); emit(0xEC); emit(0x08);
+          // eax = load(&mem, reg[b])
+          emit(0x0F); emit(0xB7); emit(0x77); emit(b);
+          emit(0x48); emit(0xBF); emit64(reinterpret_cast<std::uintptr_t>(&cpu.mem));
+          emit(0x48); emit(0xB8); emit64(reinterpret_cast<std::uintptr_t>(&JIT::load));
+          emit(0xFF); emit(0xD0);
+          // add rsp, 8; pop rsi; pop rdi
+          emit(0x48); emit(0x83); emit(0xC4); emit(0x08);
+          emit(0x5E); emit(0x5F);
+          // cmp eax, not_ready; jne done; mov eax, stalled + i; ret
+          emit(0x83); emit(0xF8); emit(BYTE(JIT_LIMIT::not_ready));
+          emit(0x75); emit(0x06);
+          emit(0xB8); emit32(JIT_LIMIT::stalled + i);
+          emit(0xC3);
+          // done: mov word [rdi+a], ax
+          emit(0x66); emit(0x89); emit(0x47); emit(a);
+          break;
+
+        case OP::SHB: // mov byte [rdi+a+1], imm8
+          emit(0xC6); emit(0x47); emit(BYTE(a + 1)); emit(BYTE(data.imm >> 8));
+          break;
+
+        case OP::SLB: // mov byte [rdi+a], imm8
+          emit(0xC6); emit(0x47); emit(a); emit(BYTE(data.imm));
+          break;
+
+        // Bitwise and Add/Subtract: movzx eax, word [rdi+b]; op ax, [rdi+c]
+        case OP::AND: case OP::NND: case OP::IOR:
+        case OP::XOR: case OP::ADD: case OP::SUB:
+        {
+          static const BYTE alu[0x10] =
+          {
+            0, 0, 0, 0, 0, 0, 0, 0,
+            0x23, 0x23, 0x0B, 0x33, // and, and, or, xor
+            0x03, 0x2B, 0, 0        // add, sub
+          };
+
+          emit(0x0F); emit(0xB7); emit(0x47); emit(b);
+          emit(0x66); emit(alu[data.code]); emit(0x47); emit(c);
+          if(data.code == OP::NND) { emit(0x66); emit(0xF7); emit(0xD0); } // not ax
+          emit(0x66); emit(0x89); emit(0x47); emit(a);
+          break;
+        }
+
+        // Multiply/Divide: movzx eax, word [rdi+b]; movzx ecx, word [rdi+c]
+        case OP::MUL: case OP::DIV:
+          emit(0x0F); emit(0xB7); emit(0x47); emit(b);
+          emit(0x0F); emit(0xB7); emit(0x4F); emit(c);
+          if(data.code == OP::MUL)
+          { emit(0x0F); emit(0xAF); emit(0xC1); }             // imul eax, ecx, low word as OP::multiply()
+          else
+          {
+            // A zero divisor traps with trap enabled, or gives 0xffff as
+            // OP::divide(), and only then is trap read
+            emit(0x85); emit(0xC9);                         // test ecx, ecx
+            emit(0x75); emit(0x1C);                         // jnz .divide
+            emit(0x48); emit(0xB8);                         // mov rax, &trap.enabled
+            emit64(reinterpret_cast<std::uintptr_t>(&cpu.trap.enabled));
+            emit(0x80); emit(0x38); emit(0x00);             // cmp byte [rax], 0
+            emit(0x74); emit(0x06);                         // je .zero
+            emit(0xB8); emit32(JIT_LIMIT::trapped + i);     // mov eax, trapped + i
+            emit(0xC3);                                     // ret
+            emit(0xB8); emit32(0xffff);                     // .zero: mov eax, 0xffff
+            emit(0xEB); emit(0x04);                         // jmp .done
+            emit(0x31); emit(0xD2); emit(0xF7); emit(0xF1); // .divide: xor edx, edx; div ecx
+          }                                                 // .done:
+          emit(0x66); emit(0x89); emit(0x47); emit(a);
+          break;
+      }
+    }
+
+    const Decoded& last = cpu.decoded[WORD(end)];
+    const std::uint32_t next = WORD(end);
+
+    // Bodies cut short, or ended by STP, return the PC after the body
+    if(length != block.length || end == pro_size || last.code == OP::STP)
+    {
+      emit(0xB8); emit32(next); // mov eax, next
+      emit(0xC3);               // ret
+    }
+
+    else
+    {
+      const BYTE a = offset(last.rega);
+      const BYTE b = offset(last.regb);
+      const BYTE c = offset(last.regc);
+
+      entry.instructions += 1;
+      entry.ticks += last.ticks;
+
+      if(last.code == OP::JAL)
+      {
+        // movzx eax, word [rdi+b]; mov word [rdi+a], PC + 2
+        emit(0x0F); emit(0xB7); emit(0x47); emit(b);
+        emit(0x66); emit(0xC7); emit(0x47); emit(a); emit16(WORD(next + 2));
+      }
+
+      else
+      {
+        // movzx edx, word [rdi+a]; movzx ecx, word [rdi+c]; mov eax, PC + 1
+        emit(0x0F); emit(0xB7); emit(0x57); emit(a);
+        emit(0x0F); emit(0xB7); emit(0x4F); emit(c);
+        emit(0xB8); emit32(WORD(next + 1));
+        // cmp dx, word [rdi+b]; cmove/cmovb eax, ecx
+        emit(0x66); emit(0x3B); emit(0x57); emit(b);
+        emit(0x0F); emit(last.code == OP::JIE ? 0x44 : 0x42); emit(0xC1);
+      }
+
+      emit(0xC3); // ret
+    }
+
+    if(mprotect(buffer, JIT_LIMIT::buffer_bytes, PROT_READ | PROT_EXEC) != 0)
+    { entry.code = nullptr; return false; }
+
+    return true;
+#else
+    (void)address;
+    return false;
+#endif
+  }
+}
+#endif
+
+#endif
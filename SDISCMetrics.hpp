@@ -0,0 +1,280 @@
+#ifndef SDISCMETRICS_HPP
+#define SDISCMETRICS_HPP
+
+#include "SDISC.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+  #define SDISC_HAS_METRICS_SOCKET 1
+  #include <unistd.h>
+#else
+  #define SDISC_HAS_METRICS_SOCKET 0
+#endif
+
+namespace SDISC // Metrics Constants
+{
+  namespace METRICS
+  {
+    const std::size_t cache_line = 64;
+
+    // Ticks Counters::run() goes between samples of the instruction mix.
+    // A turn is never less than the CPU's CPU::maxCost().
+    const COUNT sample_ticks = 0x1000;
+
+    // Longest HTTP request serve() reads before answering anyway
+    const std::size_t request_bytes = 0x2000;
+  }
+}
+
+namespace SDISC // Counters
+{
+  // What one worker thread has run, written only by that thread. Each is
+  // on its own cache lines, and is added to once per run() rather than
+  // per instruction, with a plain load and store rather than an atomic
+  // add. Metrics reads them all whenever it is asked, while they are
+  // still being written.
+  //
+  // The instruction mix is sampled rather than counted. Each run that
+  // stops short of STP counts the opcode it stopped at, so with runs cut
+  // off by a tick budget the samples are weighted by ticks, as a
+  // profiler's timer would weight them. Dispatch::Block and the JIT
+  // mostly stop where a block starts, which skews samples toward those.
+  class alignas(METRICS::cache_line) Counters
+  {
+  public: // Constructor
+    Counters() { for(std::atomic<COUNT>& i : samples) i.store(0, std::memory_order_relaxed); }
+
+    Counters(const Counters&) = delete;
+    Counters& operator=(const Counters&) = delete;
+
+  public: // Counting
+    // CPU::run() in turns of sample_ticks, counting each turn
+    RunResult run(CPU& cpu, COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit,
+                  Dispatch engine = default_dispatch,
+                  COUNT sample_ticks = METRICS::sample_ticks);
+
+    // Counts a run made some other way, such as with the JIT, during
+    // which cpu made faults faults
+    void count(const CPU& cpu, const RunResult& result, COUNT faults);
+
+  private:
+    friend class Metrics;
+
+    static void add(std::atomic<COUNT>& to, COUNT value)
+    { to.store(to.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+
+    std::atomic<COUNT> instructions{0};
+    std::atomic<COUNT> ticks{0};
+    std::atomic<COUNT> runs{0};
+    std::atomic<COUNT> halts{0};
+    std::atomic<COUNT> faults{0};
+    std::atomic<COUNT> samples[0x10];
+  };
+
+  // Every worker's Counters added up at one moment
+  struct MetricTotals
+  {
+    COUNT instructions = 0;
+    COUNT ticks = 0;
+    COUNT runs = 0;
+    COUNT halts = 0;
+    COUNT faults = 0;
+    COUNT samples[0x10] = {}; // By opcode
+
+    std::chrono::steady_clock::time_point at = std::chrono::steady_clock::now();
+
+    // Millions of guest instructions a second from before to these
+    double mips(const MetricTotals& before) const;
+  };
+}
+
+namespace SDISC // Metrics
+{
+  // Counters for a fleet of CPUs, one for each worker thread running
+  // them, added up on demand. A Runner counts into one with
+  // Runner::setMetrics(). prometheus() gives the totals in the
+  // Prometheus text format, which an OpenTelemetry collector can also
+  // scrape, and serve() answers an HTTP request for them.
+  class Metrics
+  {
+  public: // Constructor
+    explicit Metrics(std::size_t workers = 1);
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+  public: // Counters
+    // Only ever written by one thread at a time
+    Counters& worker(std::size_t index) { return counters[index]; }
+    std::size_t workers() const { return count; }
+
+    MetricTotals totals() const;
+
+  public: // Export
+    // Counters, and the guest MIPS since the last call as a gauge
+    std::string prometheus();
+
+#if SDISC_HAS_METRICS_SOCKET
+    // Reads one HTTP request from fd, a connected socket, and answers it
+    // with prometheus(). False if fd closed first. fd is left open.
+    bool serve(int fd);
+#endif
+
+  private: // Variables
+    const std::size_t count;
+    std::unique_ptr<Counters[]> counters;
+
+    std::mutex lock;
+    MetricTotals last; // Of the last prometheus(), under lock
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Counters */
+  SDISC_INLINE RunResult Counters::run(CPU& cpu, COUNT max_ticks, COUNT max_instructions,
+                                       Dispatch engine, COUNT sample_ticks)
+  {
+    const COUNT turn = std::max(sample_ticks, cpu.maxCost());
+    RunResult total{Status::TickLimit, 0, 0};
+
+    for(;;)
+    {
+      const COUNT budget = std::min(turn, max_ticks - total.ticks);
+      const COUNT before = cpu.faults;
+      const RunResult result = cpu.run(budget, max_instructions - total.instructions, engine);
+      count(cpu, result, cpu.faults - before);
+
+      total.ticks += result.ticks;
+      total.instructions += result.instructions;
+      total.status = result.status;
+
+      // A turn always fits the next instruction, so no progress means the
+      // whole budget has run out
+      if(result.status != Status::TickLimit || budget != turn || result.ticks == 0) return total;
+    }
+  }
+
+  SDISC_INLINE void Counters::count(const CPU& cpu, const RunResult& result, COUNT in_faults)
+  {
+    add(instructions, result.instructions);
+    add(ticks, result.ticks);
+    add(runs, 1);
+    add(faults, in_faults);
+
+    if(result.status == Status::Halted) add(halts, 1);
+    else if(result.instructions != 0) add(samples[cpu.decoded[cpu.PC].code], 1);
+  }
+
+  SDISC_INLINE double MetricTotals::mips(const MetricTotals& before) const
+  {
+    const double seconds = std::chrono::duration<double>(at - before.at).count();
+    if(seconds <= 0) return 0;
+    return double(instructions - before.instructions) / seconds / 1e6;
+  }
+
+  /* Metrics */
+  SDISC_INLINE Metrics::Metrics(std::size_t workers)
+    : count{std::max<std::size_t>(workers, 1)}, counters(new Counters[count]) {}
+
+  SDISC_INLINE MetricTotals Metrics::totals() const
+  {
+    MetricTotals out;
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const Counters& in = counters[i];
+      out.instructions += in.instructions.load(std::memory_order_relaxed);
+      out.ticks += in.ticks.load(std::memory_order_relaxed);
+      out.runs += in.runs.load(std::memory_order_relaxed);
+      out.halts += in.halts.load(std::memory_order_relaxed);
+      out.faults += in.faults.load(std::memory_order_relaxed);
+      for(std::size_t op = 0; op < 0x10; ++op) out.samples[op] += in.samples[op].load(std::memory_order_relaxed);
+    }
+
+    out.at = std::chrono::steady_clock::now();
+    return out;
+  }
+
+  SDISC_INLINE std::string Metrics::prometheus()
+  {
+    const MetricTotals now = totals();
+    double mips;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      mips = now.mips(last);
+      last = now;
+    }
+
+    std::string out;
+    auto metric = [&out](const char* name, const char* type, const char* help)
+    {
+      out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+      out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+    };
+
+    auto counter = [&](const char* name, const char* help, COUNT value)
+    {
+      metric(name, "counter", help);
+      out += name; out += ' '; out += std::to_string(value); out += '\n';
+    };
+
+    counter("sdisc_instructions_total", "Guest instructions run.", now.instructions);
+    counter("sdisc_ticks_total", "Guest ticks run.", now.ticks);
+    counter("sdisc_runs_total", "Calls to run a CPU.", now.runs);
+    counter("sdisc_halts_total", "Runs that reached STP.", now.halts);
+    counter("sdisc_faults_total", "Faults sent to a trap handler.", now.faults);
+
+    metric("sdisc_instruction_samples_total", "counter", "Opcodes runs stopped at, a sample of the instruction mix.");
+    for(std::size_t op = 0; op < 0x10; ++op)
+    {
+      out += "sdisc_instruction_samples_total{op=\""; out += OP::name[op]; out += "\"} ";
+      out += std::to_string(now.samples[op]); out += '\n';
+    }
+
+    metric("sdisc_mips", "gauge", "Millions of guest instructions a second since the last scrape.");
+    out += "sdisc_mips "; out += std::to_string(mips); out += '\n';
+
+    return out;
+  }
+
+#if SDISC_HAS_METRICS_SOCKET
+  // Whatever was asked for, the answer is the metrics
+  SDISC_INLINE bool Metrics::serve(int fd)
+  {
+    std::string request;
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < METRICS::request_bytes)
+    {
+      char in[0x200];
+      const ssize_t got = ::read(fd, in, sizeof(in));
+      if(got <= 0) return false;
+      request.append(in, std::size_t(got));
+    }
+
+    const std::string body = prometheus();
+    const std::string reply =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      "Connection: close\r\n\r\n" + body;
+
+    for(std::size_t at = 0; at < reply.size();)
+    {
+      const ssize_t sent = ::write(fd, reply.data() + at, reply.size() - at);
+      if(sent <= 0) return false;
+      at += std::size_t(sent);
+    }
+
+    return true;
+  }
+#endif
+}
+#endif
+
+#endif
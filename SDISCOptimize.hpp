@@ -0,0 +1,930 @@
+#ifndef SDISCOPTIMIZE_HPP
+#define SDISCOPTIMIZE_HPP
+
+#include "SDISC.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace SDISC // Optimizer
+{
+  namespace OPTIMIZE
+  {
+    // Values a register is followed as possibly holding before it is
+    // treated as unknown
+    const std::size_t max_values = 16;
+
+    // Words of mem remembered along straight line code
+    const std::size_t max_facts = 32;
+
+    // What a removed instruction becomes when code is not closed up
+    constexpr Instruction nop = Instruction(OP::IOR, 0, 0, 0);
+  }
+
+  enum class OptimizeMode
+  {
+    PreserveTicks, // Every instruction keeps its address and its ticks
+    ReduceTicks    // Instructions may get cheaper, or go
+  };
+
+  struct OptimizeOptions
+  {
+    OptimizeMode mode = OptimizeMode::PreserveTicks;
+
+    // ReduceTicks only: close up removed and unreachable instructions.
+    // Only done if every jump target is an SHB/SLB pair used for nothing
+    // else, or a JAL link, so that they can be moved with the code.
+    bool compact = true;
+
+    // LOD and STR of pages with a device on bus are left alone
+    const Bus* bus = nullptr;
+
+    // What the program is run with. A DIV that may trap is also a jump to
+    // trap.handler, which is not moved, so nothing is closed up.
+    Trap trap;
+  };
+
+  struct OptimizeResult
+  {
+    std::vector<Instruction> program;
+
+    // False if a jump target could not be found, program is unchanged
+    bool resolved = false;
+
+    // Code moved up, so PC and any code address left in a register at
+    // STP differ from the original program
+    bool compacted = false;
+
+    std::size_t reachable = 0; // Instructions some path gets to
+    std::size_t removed = 0;   // Reachable ones made no-ops or closed up
+    std::size_t replaced = 0;  // Swapped for cheaper ones
+    std::size_t relocated = 0; // SHB/SLB pairs given moved code addresses
+  };
+
+  // Optimizes a program run from PC 0 with every register init_reg, as
+  // after reset(), and any mem. Jump targets come from registers, so the
+  // control flow graph is found by constant propagation, following the
+  // few values each register may hold. If a reachable jump could go
+  // anywhere nothing is changed.
+  //
+  // It removes instructions that change nothing, such as SHB/SLB of a
+  // byte already there, writes to registers that are never read, STR of
+  // a word already in mem and branches never taken. Instructions with a
+  // known result become an SHB, SLB or register copy, as do LOD of words
+  // the same straight line of code already loaded or stored.
+  //
+  // There is no instruction without ticks, so with PreserveTicks only
+  // swaps of equal ticks are made, which leaves LOD becoming register
+  // copies. With ReduceTicks and no compaction a removal leaves a 4 tick
+  // OPTIMIZE::nop, so only instructions dearer than that are removed.
+  //
+  // Registers and mem are the same at STP, and so is tick with
+  // PreserveTicks. A run stopped by a budget may stop in another state.
+  // DIV by zero folds to 0xffff unless options.trap is enabled.
+  OptimizeResult optimize(const std::vector<Instruction>& program,
+                          const OptimizeOptions& options = OptimizeOptions());
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  namespace OPTIMIZE
+  {
+    // Where a value was made, to tell code addresses apart from data.
+    // Otherwise the address of the first of an SHB/SLB pair.
+    const std::int32_t no_origin = -1;
+    const std::int32_t link_origin = 0x10000; // | address of the JAL
+    const std::int32_t half_origin = 0x20000; // | address of the SHB/SLB
+
+    struct Value
+    {
+      WORD value;
+      std::int32_t origin;
+    };
+
+    // Every value a register may hold at one point of the program
+    struct Register
+    {
+      bool unknown = false;
+      std::vector<Value> values; // Sorted by value, while not unknown
+
+      // Bytes an unknown register is known to have, or -1, and the
+      // origin of one set by an SHB/SLB
+      int high = -1, low = -1;
+      std::int32_t origin = no_origin;
+
+      // Origins of every code address it may hold, sorted. Kept when it
+      // becomes unknown, so that a code address used as data is seen.
+      std::vector<std::int32_t> codes;
+    };
+
+    struct State
+    {
+      bool reached = false;
+      Register reg[reg_size];
+    };
+
+    // A word of mem known along straight line code, as what a register
+    // holds until it is written again, and maybe as a value
+    struct Fact
+    {
+      WORD address;
+      BYTE reg;
+      COUNT version;
+      bool constant;
+      WORD value;
+    };
+
+    // What became of an instruction
+    enum Change : BYTE
+    {
+      Kept,
+      NoOp, // Writes what its rega already holds
+      Gone  // Nothing it does is needed
+    };
+
+    // Whether a value from origin is a code address
+    SDISC_INLINE bool codeAddress(std::int32_t origin)
+    { return origin != no_origin && origin < half_origin; }
+
+    SDISC_INLINE void addCode(std::vector<std::int32_t>& codes, std::int32_t origin)
+    {
+      if(!codeAddress(origin)) return;
+      auto at = std::lower_bound(codes.begin(), codes.end(), origin);
+      if(at == codes.end() || *at != origin) codes.insert(at, origin);
+    }
+
+    SDISC_INLINE Register constant(WORD value, std::int32_t origin = no_origin)
+    {
+      Register out;
+      out.values.push_back(Value{value, origin});
+      addCode(out.codes, origin);
+      return out;
+    }
+
+    SDISC_INLINE Register unknown(int high = -1, int low = -1, std::int32_t origin = no_origin)
+    {
+      Register out;
+      out.unknown = true;
+      out.high = high;
+      out.low = low;
+      out.origin = high < 0 && low < 0 ? no_origin : origin;
+      return out;
+    }
+
+    SDISC_INLINE bool single(const Register& in)
+    { return !in.unknown && in.values.size() == 1; }
+
+    SDISC_INLINE int highByte(const Register& in)
+    {
+      if(in.unknown) return in.high;
+      for(const Value& i : in.values) if(i.value >> 8 != in.values[0].value >> 8) return -1;
+      return in.values[0].value >> 8;
+    }
+
+    SDISC_INLINE int lowByte(const Register& in)
+    {
+      if(in.unknown) return in.low;
+      for(const Value& i : in.values) if((i.value & 0xff) != (in.values[0].value & 0xff)) return -1;
+      return in.values[0].value & 0xff;
+    }
+
+    SDISC_INLINE std::int32_t byteOrigin(const Register& in)
+    {
+      if(in.unknown) return in.origin;
+      for(const Value& i : in.values) if(i.origin != in.values[0].origin) return no_origin;
+      return in.values[0].origin >= half_origin ? in.values[0].origin : no_origin;
+    }
+
+    // Adds in, a value seen with two origins has neither
+    SDISC_INLINE void insert(std::vector<Value>& values, const Value& in)
+    {
+      auto at = std::lower_bound(values.begin(), values.end(), in,
+        [](const Value& a, const Value& b){ return a.value < b.value; });
+
+      if(at == values.end() || at->value != in.value) values.insert(at, in);
+      else if(at->origin != in.origin) at->origin = no_origin;
+    }
+
+    SDISC_INLINE bool same(const Register& a, const Register& b)
+    {
+      if(a.unknown != b.unknown || a.values.size() != b.values.size()) return false;
+      if(a.high != b.high || a.low != b.low || a.origin != b.origin) return false;
+      if(a.codes != b.codes) return false;
+
+      for(std::size_t i = 0; i < a.values.size(); ++i)
+      {
+        if(a.values[i].value != b.values[i].value) return false;
+        if(a.values[i].origin != b.values[i].origin) return false;
+      }
+
+      return true;
+    }
+
+    // Makes into hold anything either may hold, true if it changed
+    SDISC_INLINE bool merge(Register& into, const Register& in)
+    {
+      Register out;
+      if(!into.unknown && !in.unknown)
+      {
+        out.values = into.values;
+        for(const Value& i : in.values) insert(out.values, i);
+        if(out.values.size() > max_values)
+        { out = unknown(highByte(out), lowByte(out), byteOrigin(out)); }
+      }
+      else
+      {
+        const int high = highByte(into) == highByte(in) ? highByte(in) : -1;
+        const int low = lowByte(into) == lowByte(in) ? lowByte(in) : -1;
+        const std::int32_t origin = byteOrigin(into) == byteOrigin(in) ? byteOrigin(in) : no_origin;
+        out = unknown(high, low, origin);
+      }
+
+      out.codes = into.codes;
+      for(std::int32_t i : in.codes) addCode(out.codes, i);
+
+      if(same(into, out)) return false;
+      into = std::move(out);
+      return true;
+    }
+
+    // Liveness is kept for each byte of each register, as SHB and SLB
+    // leave the other byte alone
+    typedef std::uint32_t Bytes;
+    const Bytes all_bytes = ~Bytes(0);
+
+    SDISC_INLINE Bytes lowOf(BYTE reg) { return Bytes(1) << (2 * reg); }
+    SDISC_INLINE Bytes highOf(BYTE reg) { return Bytes(2) << (2 * reg); }
+    SDISC_INLINE Bytes bothOf(BYTE reg) { return Bytes(3) << (2 * reg); }
+
+    class Optimizer
+    {
+    public:
+      Optimizer(const std::vector<Instruction>& in_program, const OptimizeOptions& in_options)
+        : code(in_program), options(in_options), size(in_program.size()),
+          states(size), successors(size), exits(size, false), joins(size, false),
+          queued(size, false), moving(size, false), pinned(size, false),
+          out(in_program), change(size, Kept), replaced(size, false),
+          live_in(size, 0), live_out(size, 0) {}
+
+      OptimizeResult run()
+      {
+        OptimizeResult result;
+        result.program = code;
+
+        analyse();
+        if(unresolved) return result;
+
+        result.resolved = true;
+        for(const State& i : states) if(i.reached) ++result.reachable;
+
+        compacting = reduce() && options.compact && movable();
+        fold();
+        sweep();
+
+        for(std::size_t p = 0; p < size; ++p)
+        {
+          if(!states[p].reached) continue;
+          if(change[p] != Kept) ++result.removed;
+          else if(replaced[p]) ++result.replaced;
+        }
+
+        if(compacting) close(result);
+        else
+        {
+          for(std::size_t p = 0; p < size; ++p)
+          { if(states[p].reached && change[p] != Kept) out[p] = nop; }
+          result.program = out;
+        }
+
+        return result;
+      }
+
+    private: /* Helpers */
+      bool reduce() const { return options.mode == OptimizeMode::ReduceTicks; }
+
+      Instruction at(std::size_t p) const { return p < size ? code[p] : init_pro; }
+
+      bool device(WORD address) const
+      { return options.bus != nullptr && options.bus->device(address >> page_shift) != nullptr; }
+
+      // Whether the instruction at p is a DIV that may trap
+      bool traps(std::size_t p) const
+      {
+        const Instruction in = out[p];
+        return options.trap.enabled && in.code() == OP::DIV && !nonzero(states[p].reg[in.regc()]);
+      }
+
+      // Whether the word before p and p set the two bytes of one register
+      bool pairs(std::size_t p) const
+      {
+        if(p == 0 || p >= size) return false;
+        const Instruction first = code[p - 1], second = code[p];
+        if(first.rega() != second.rega()) return false;
+        return (first.code() == OP::SHB && second.code() == OP::SLB)
+            || (first.code() == OP::SLB && second.code() == OP::SHB);
+      }
+
+      // A removal gains something, and a no-op can stand in for it
+      bool removable(std::size_t p) const
+      {
+        if(!reduce() || pinned[p]) return false;
+        return options.compact ? true : OP::tick_count[out[p].code()] > OP::tick_count[nop.code()];
+      }
+
+      // Whether a value in in has its code address moved by close()
+      bool moves(const Register& in) const
+      {
+        if(!compacting) return false;
+        for(std::int32_t i : in.codes)
+        { if(i >= link_origin || moving[std::size_t(i)]) return true; }
+
+        return false;
+      }
+
+      // A register holding only value at p whose value does not move, or -1
+      int holding(const State& state, WORD value) const
+      {
+        for(std::size_t i = 0; i < reg_size; ++i)
+        {
+          const Register& in = state.reg[i];
+          if(single(in) && in.values[0].value == value && !moves(in)) return int(i);
+        }
+
+        return -1;
+      }
+
+    private: /* Constant Propagation */
+      void analyse()
+      {
+        if(size == 0) return;
+
+        State entry;
+        entry.reached = true;
+        for(Register& i : entry.reg) i = constant(init_reg);
+
+        states[0] = entry;
+        joins[0] = true;
+        queued[0] = true;
+        work.push_back(0);
+
+        while(!work.empty())
+        {
+          const std::size_t p = work.back();
+          work.pop_back();
+          queued[p] = false;
+          step(p);
+        }
+      }
+
+      void step(std::size_t p)
+      {
+        const Instruction in = code[p];
+        State next = states[p];
+
+        switch(in.code())
+        {
+          case OP::STP: return;
+
+          case OP::JAL:
+          {
+            const Register target = next.reg[in.regb()];
+            next.reg[in.rega()] = constant(WORD(p + 2), link_origin | std::int32_t(p));
+            jump(p, target, next);
+            return;
+          }
+
+          case OP::JIE: case OP::JIL:
+          {
+            bool taken, falls;
+            branches(in, next, taken, falls);
+            if(taken) jump(p, next.reg[in.regc()], next);
+            if(falls) flow(p, p + 1, next);
+            return;
+          }
+
+          case OP::STR: break;
+          case OP::LOD: next.reg[in.rega()] = unknown(); break;
+          default: next.reg[in.rega()] = result(p, states[p]); break;
+        }
+
+        // A trap writes no register, and mem only where nothing looks
+        if(traps(p))
+        {
+          const WORD handler = options.trap.handler;
+          if(handler < size) joins[handler] = true;
+          trapping = true;
+          flow(p, handler, states[p]);
+        }
+
+        flow(p, p + 1, next);
+      }
+
+      void jump(std::size_t p, const Register& target, const State& state)
+      {
+        if(target.unknown) { unresolved = true; return; }
+        for(const Value& i : target.values) flow(p, i.value, state);
+      }
+
+      void flow(std::size_t from, std::size_t to, const State& state)
+      {
+        to = WORD(to);
+        if(to >= size) { exits[from] = true; return; }
+
+        std::vector<std::size_t>& next = successors[from];
+        if(std::find(next.begin(), next.end(), to) == next.end()) next.push_back(to);
+        if(to != from + 1) joins[to] = true;
+
+        State& into = states[to];
+        bool changed = !into.reached;
+        if(changed) into = state;
+        else for(std::size_t i = 0; i < reg_size; ++i) changed |= merge(into.reg[i], state.reg[i]);
+
+        if(changed && !queued[to]) { queued[to] = true; work.push_back(to); }
+      }
+
+      // Whether the JIE/JIL in may be taken, and whether it may not
+      void branches(const Instruction& in, const State& state, bool& taken, bool& falls) const
+      {
+        const bool equal = in.code() == OP::JIE;
+        const Register& a = state.reg[in.rega()];
+        const Register& b = state.reg[in.regb()];
+
+        if(in.rega() == in.regb()) { taken = equal; falls = !equal; return; }
+        if(a.unknown || b.unknown) { taken = falls = true; return; }
+
+        taken = falls = false;
+        for(const Value& x : a.values) for(const Value& y : b.values)
+        { (equal ? x.value == y.value : x.value < y.value) ? taken = true : falls = true; }
+      }
+
+      // What the SHB/SLB/ALU instruction at p writes to its rega
+      Register result(std::size_t p, const State& state) const
+      {
+        const Instruction in = code[p];
+        const Register& a = state.reg[in.rega()];
+        const Register& b = state.reg[in.regb()];
+        const Register& c = state.reg[in.regc()];
+        const bool twice = in.regb() == in.regc();
+
+        switch(in.code())
+        {
+          case OP::SHB: return setByte(a, in.byte(), true, p);
+          case OP::SLB: return setByte(a, in.byte(), false, p);
+
+          case OP::AND: return combine(b, c, twice, [](WORD x, WORD y){ return WORD(x & y); });
+          case OP::NND: return combine(b, c, twice, [](WORD x, WORD y){ return WORD(~(x & y)); });
+          case OP::IOR: return combine(b, c, twice, [](WORD x, WORD y){ return WORD(x | y); });
+          case OP::XOR:
+            if(twice) return constant(0);
+            return combine(b, c, twice, [](WORD x, WORD y){ return WORD(x ^ y); });
+
+          case OP::ADD: return combine(b, c, twice, [](WORD x, WORD y){ return WORD(x + y); });
+          case OP::SUB:
+            if(twice) return constant(0);
+            return combine(b, c, twice, [](WORD x, WORD y){ return WORD(x - y); });
+          case OP::MUL: return combine(b, c, twice, OP::multiply);
+          case OP::DIV:
+            // Never folds a divide by zero that traps
+            if(options.trap.enabled && !nonzero(c)) return unknown();
+            return combine(b, c, twice, OP::divide);
+        }
+
+        return unknown();
+      }
+
+      static bool nonzero(const Register& in)
+      {
+        if(in.unknown) return false;
+        for(const Value& i : in.values) if(i.value == 0) return false;
+        return true;
+      }
+
+      Register setByte(const Register& a, BYTE byte, bool high, std::size_t p) const
+      {
+        // With the SHB/SLB just before it this makes a pair, whose value
+        // may be a code address
+        const std::int32_t own = half_origin | std::int32_t(p);
+        const std::int32_t other = pairs(p) ? half_origin | std::int32_t(p - 1) : no_origin;
+        auto origin = [&](std::int32_t from)
+        { return other != no_origin && from == other ? std::int32_t(p - 1) : own; };
+
+        Register out;
+        bool whole = true; // Every value is all the pair's
+
+        if(a.unknown)
+        {
+          const int kept = high ? a.low : a.high;
+          if(kept < 0) out = high ? unknown(byte, -1, own) : unknown(-1, byte, own);
+          else out = constant(high ? WORD(byte << 8 | kept) : WORD(kept << 8 | byte), origin(a.origin));
+          whole = kept >= 0 && origin(a.origin) != own;
+        }
+        else
+        {
+          for(const Value& i : a.values)
+          {
+            const WORD value = high ? WORD((i.value & 0x00ff) | byte << 8)
+                                    : WORD((i.value & 0xff00) | byte);
+            insert(out.values, Value{value, origin(i.origin)});
+            addCode(out.codes, origin(i.origin));
+            whole &= origin(i.origin) != own;
+          }
+        }
+
+        // Otherwise the byte left alone may be of a code address
+        if(!whole) for(std::int32_t i : a.codes) addCode(out.codes, i);
+        return out;
+      }
+
+      template<class Function>
+      static Register combine(const Register& b, const Register& c, bool twice, Function function)
+      {
+        if(b.unknown || c.unknown) return unknown();
+
+        Register out;
+        if(twice)
+        { for(const Value& x : b.values) insert(out.values, Value{function(x.value, x.value), no_origin}); }
+        else
+        {
+          for(const Value& x : b.values) for(const Value& y : c.values)
+          {
+            insert(out.values, Value{function(x.value, y.value), no_origin});
+            if(out.values.size() > max_values) return unknown();
+          }
+        }
+        return out;
+      }
+
+    private: /* Code Addresses */
+      // Finds the SHB/SLB pairs that make jump targets. Code can only be
+      // closed up if none of them, and no JAL link, is also used as data.
+      bool movable()
+      {
+        if(size == pro_size) return false; // Running off the end wraps to 0
+        if(trapping) return false;         // The handler has to stay put
+
+        std::vector<bool> target(size, false), data(size, false);
+        bool ok = true;
+
+        // Every code address in may hold, even as an unknown value
+        auto use = [&](const Register& in, bool as_target)
+        {
+          for(const Value& i : in.values) if(!codeAddress(i.origin)) ok &= !as_target;
+          for(std::int32_t i : in.codes)
+          {
+            if(i >= link_origin) ok &= as_target;
+            else (as_target ? target : data)[std::size_t(i)] = true;
+          }
+        };
+
+        for(std::size_t p = 0; p < size && ok; ++p)
+        {
+          if(!states[p].reached) continue;
+
+          const Instruction in = code[p];
+          const Register* reg = states[p].reg;
+          const bool twice = in.regb() == in.regc();
+
+          switch(in.code())
+          {
+            // What SHB/SLB leave of a code address is followed in codes
+            case OP::STP: case OP::SHB: case OP::SLB: break;
+            case OP::JAL: use(reg[in.regb()], true); break;
+
+            case OP::JIE: case OP::JIL:
+            {
+              bool taken, falls;
+              branches(in, states[p], taken, falls);
+              if(in.rega() != in.regb()) { use(reg[in.rega()], false); use(reg[in.regb()], false); }
+              if(taken) use(reg[in.regc()], true);
+              break;
+            }
+
+            case OP::STR: use(reg[in.rega()], false); use(reg[in.regb()], false); break;
+            case OP::LOD: use(reg[in.regb()], false); break;
+
+            case OP::XOR: case OP::SUB:
+              if(twice) break;
+              use(reg[in.regb()], false); use(reg[in.regc()], false);
+              break;
+
+            default: use(reg[in.regb()], false); use(reg[in.regc()], false); break;
+          }
+        }
+
+        if(!ok) return false;
+        for(std::size_t q = 0; q < size; ++q) if(target[q] && data[q]) return false;
+
+        for(std::size_t q = 0; q < size; ++q)
+        {
+          if(!target[q]) continue;
+          moving[q] = true;
+          pinned[q] = pinned[q + 1] = true;
+          relocate.push_back(q);
+        }
+
+        // A JAL returns to the word after next, so the word after it stays
+        for(std::size_t p = 0; p + 1 < size; ++p)
+        { if(states[p].reached && code[p].code() == OP::JAL) pinned[p + 1] = true; }
+
+        return true;
+      }
+
+    private: /* Rewrites */
+      // Swaps in with for the instruction at p if it is cheaper, or for
+      // PreserveTicks takes as long but does not load
+      void offer(std::size_t p, const Instruction& with)
+      {
+        if(pinned[p] || change[p] != Kept) return;
+
+        const COUNT now = OP::tick_count[out[p].code()], then = OP::tick_count[with.code()];
+        if(reduce() ? then < now : then == now && out[p].code() == OP::LOD)
+        { out[p] = with; replaced[p] = true; }
+      }
+
+      void noop(std::size_t p)
+      { if(removable(p)) change[p] = NoOp; }
+
+      // The instruction at p writes value to its rega
+      void known(std::size_t p, WORD value)
+      {
+        const State& state = states[p];
+        const BYTE a = code[p].rega();
+        const Register& old = state.reg[a];
+        const int zero = holding(state, 0);
+
+        if(single(old) && old.values[0].value == value && !moves(old))
+        {
+          noop(p);
+          if(zero >= 0) offer(p, Instruction(OP::ADD, a, a, BYTE(zero)));
+          return;
+        }
+
+        if(!moves(old) && highByte(old) == value >> 8) offer(p, Instruction(OP::SLB, a, BYTE(value)));
+        if(!moves(old) && lowByte(old) == (value & 0xff)) offer(p, Instruction(OP::SHB, a, BYTE(value >> 8)));
+
+        const int from = holding(state, value);
+        if(from >= 0) copy(p, BYTE(from));
+      }
+
+      // The instruction at p writes what register from holds to its rega
+      void copy(std::size_t p, BYTE from)
+      {
+        const State& state = states[p];
+        const BYTE a = code[p].rega();
+        const int zero = holding(state, 0);
+
+        if(from == a) { noop(p); if(zero >= 0) offer(p, Instruction(OP::ADD, a, a, BYTE(zero))); return; }
+        if(moves(state.reg[from])) return;
+
+        offer(p, Instruction(OP::IOR, a, from, from));
+        if(zero >= 0) offer(p, Instruction(OP::ADD, a, from, BYTE(zero)));
+      }
+
+      // Folds known results and forwards mem along straight line code
+      void fold()
+      {
+        std::vector<Fact> facts;
+        COUNT versions[reg_size] = {};
+
+        auto find = [&](WORD address) -> const Fact*
+        {
+          for(const Fact& i : facts)
+          {
+            if(i.address != address) continue;
+            if(i.constant || versions[i.reg] == i.version) return &i;
+          }
+          return nullptr;
+        };
+
+        auto learn = [&](const Fact& in)
+        {
+          facts.erase(std::remove_if(facts.begin(), facts.end(),
+            [&](const Fact& i){ return i.address == in.address; }), facts.end());
+          if(facts.size() >= max_facts) facts.erase(facts.begin());
+          facts.push_back(in);
+        };
+
+        for(std::size_t p = 0; p < size; ++p)
+        {
+          if(!states[p].reached) continue;
+          if(joins[p]) facts.clear();
+
+          const Instruction in = code[p];
+          const State& state = states[p];
+          const BYTE a = in.rega();
+          const Register& address = state.reg[in.regb()];
+          const bool ram = single(address) && !device(address.values[0].value);
+
+          switch(in.code())
+          {
+            case OP::STP: break;
+            case OP::JAL: ++versions[a]; break;
+
+            case OP::JIE: case OP::JIL:
+            {
+              bool taken, falls;
+              branches(in, state, taken, falls);
+              if(!taken && removable(p)) change[p] = Gone;
+              break;
+            }
+
+            case OP::STR:
+            {
+              // Devices may write anywhere in mem when handed a write
+              if(!ram) { facts.clear(); break; }
+
+              const WORD at = address.values[0].value;
+              const Fact* known = find(at);
+              const bool constant = single(state.reg[a]);
+              const WORD value = constant ? state.reg[a].values[0].value : 0;
+
+              const bool held = known && known->reg == a && versions[a] == known->version;
+              const bool equal = known && known->constant && constant && known->value == value;
+              if((held || equal) && removable(p)) { change[p] = Gone; break; }
+
+              learn(Fact{at, a, versions[a], constant, value});
+              break;
+            }
+
+            case OP::LOD:
+            {
+              if(!ram)
+              {
+                ++versions[a];
+                if(options.bus != nullptr) facts.clear();
+                break;
+              }
+
+              const WORD at = address.values[0].value;
+              const Fact* from = find(at);
+              const bool constant = from && from->constant;
+              const WORD value = constant ? from->value : 0;
+
+              if(constant) known(p, value);
+              else if(from) copy(p, from->reg);
+
+              ++versions[a];
+              learn(Fact{at, a, versions[a], constant, value});
+              break;
+            }
+
+            default:
+            {
+              const Register written = result(p, state);
+              if(single(written)) known(p, written.values[0].value);
+              ++versions[a];
+              break;
+            }
+          }
+        }
+      }
+
+      // Register bytes the instruction at p reads and writes as it is now.
+      // A removed one leaves what its rega holds, so does neither.
+      void access(std::size_t p, Bytes& read, Bytes& written) const
+      {
+        const Instruction in = out[p];
+        read = written = 0;
+        if(change[p] != Kept) return;
+
+        switch(in.code())
+        {
+          case OP::STP: read = all_bytes; break;
+          case OP::JAL: read = bothOf(in.regb()); written = bothOf(in.rega()); break;
+          case OP::JIE: case OP::JIL: read = bothOf(in.rega()) | bothOf(in.regb()) | bothOf(in.regc()); break;
+          case OP::STR: read = bothOf(in.rega()) | bothOf(in.regb()); break;
+          case OP::LOD: read = bothOf(in.regb()); written = bothOf(in.rega()); break;
+          case OP::SHB: written = highOf(in.rega()); break;
+          case OP::SLB: written = lowOf(in.rega()); break;
+          default: read = bothOf(in.regb()) | bothOf(in.regc()); written = bothOf(in.rega()); break;
+        }
+
+        // The handler may see rega as it was
+        if(traps(p)) written = 0;
+      }
+
+      void liveness()
+      {
+        for(bool changed = true; changed;)
+        {
+          changed = false;
+          for(std::size_t p = size; p-- > 0;)
+          {
+            if(!states[p].reached) continue;
+
+            Bytes after = exits[p] ? all_bytes : 0;
+            for(std::size_t i : successors[p]) after |= live_in[i];
+
+            Bytes read, written;
+            access(p, read, written);
+            const Bytes before = read | (after & ~written);
+
+            if(after != live_out[p] || before != live_in[p])
+            { live_out[p] = after; live_in[p] = before; changed = true; }
+          }
+        }
+      }
+
+      // Whether the instruction at p does nothing but write its rega
+      bool pure(std::size_t p) const
+      {
+        const Instruction in = out[p];
+        const Register& address = states[p].reg[in.regb()];
+
+        switch(in.code())
+        {
+          case OP::STP: case OP::JAL: case OP::JIE: case OP::JIL: case OP::STR: return false;
+          case OP::LOD: return options.bus == nullptr || (single(address) && !device(address.values[0].value));
+          case OP::DIV: return !traps(p);
+        }
+
+        return true;
+      }
+
+      // Removes writes to registers never read, until none are left
+      void sweep()
+      {
+        for(bool changed = true; changed;)
+        {
+          changed = false;
+          liveness();
+
+          for(std::size_t p = 0; p < size; ++p)
+          {
+            if(!states[p].reached || change[p] != Kept || !pure(p) || !removable(p)) continue;
+            Bytes read, written;
+            access(p, read, written);
+            if(live_out[p] & written) continue;
+            change[p] = Gone;
+            changed = true;
+          }
+        }
+      }
+
+    private: /* Compaction */
+      void close(OptimizeResult& result)
+      {
+        std::vector<std::size_t> index(size + 1);
+        std::vector<Instruction> moved;
+
+        for(std::size_t p = 0; p < size; ++p)
+        {
+          index[p] = moved.size();
+          if(pinned[p] || (states[p].reached && change[p] == Kept)) moved.push_back(out[p]);
+        }
+        index[size] = moved.size();
+
+        for(std::size_t q : relocate)
+        {
+          const Instruction first = code[q], second = code[q + 1];
+          const bool high_first = first.code() == OP::SHB;
+          const WORD from = high_first ? WORD(first.byte() << 8 | second.byte())
+                                       : WORD(second.byte() << 8 | first.byte());
+          const WORD to = WORD(index[std::min<std::size_t>(from, size)]);
+
+          moved[index[q]] = Instruction(first.code(), first.rega(), BYTE(high_first ? to >> 8 : to));
+          moved[index[q + 1]] = Instruction(second.code(), second.rega(), BYTE(high_first ? to : to >> 8));
+          if(to != from) ++result.relocated;
+        }
+
+        result.compacted = moved.size() < size;
+        result.program = std::move(moved);
+      }
+
+    private: /* Variables */
+      const std::vector<Instruction>& code;
+      const OptimizeOptions& options;
+      const std::size_t size;
+
+      // Constant propagation and the control flow graph it finds
+      std::vector<State> states; // Before each instruction
+      std::vector<std::vector<std::size_t>> successors;
+      std::vector<bool> exits;   // May go on to an STP past the program
+      std::vector<bool> joins;   // Entered other than from the word before
+      std::vector<bool> queued;
+      std::vector<std::size_t> work;
+      bool unresolved = false;
+      bool trapping = false; // Some DIV may trap
+
+      // Code addresses, for compaction
+      std::vector<bool> moving;  // SHB/SLB pairs at each address making jump targets
+      std::vector<bool> pinned;  // Words that are left as they are
+      std::vector<std::size_t> relocate;
+      bool compacting = false;
+
+      // The rewritten program
+      std::vector<Instruction> out;
+      std::vector<Change> change;
+      std::vector<bool> replaced;
+      std::vector<Bytes> live_in, live_out;
+    };
+  }
+
+  SDISC_INLINE OptimizeResult optimize(const std::vector<Instruction>& program,
+                                       const OptimizeOptions& options)
+  { return OPTIMIZE::Optimizer(program, options).run(); }
+}
+#endif
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef SDISCPOOL_HPP
+#define SDISCPOOL_HPP
+
+#include "SDISC.hpp"
+
+#include <atomic>
+#include <memory>
+#include <new>
+
+#if defined(__linux__)
+  #define SDISC_HAS_HUGE_PAGES 1
+  #include <sys/mman.h>
+#else
+  #define SDISC_HAS_HUGE_PAGES 0
+#endif
+
+namespace SDISC // Pool Constants
+{
+  namespace POOL
+  {
+    // Arenas are a multiple of this, and aligned to it where they can be
+    const std::size_t huge_page = 0x200000;
+
+    // CPUs start on their own cache lines
+    const std::size_t cache_line = 64;
+
+    // Freelist link past the last free CPU
+    const std::uint32_t none = ~std::uint32_t(0);
+  }
+
+  // What a CPUPool's arena is in
+  enum class Backing
+  {
+    Pages,       // Whatever the host gives
+    Transparent, // Memory the kernel is asked to back with huge pages
+    HugeTLB      // Huge pages reserved for it up front
+  };
+}
+
+namespace SDISC // CPU Pool
+{
+  // A fixed number of CPUs in one arena, for churning through many short
+  // jobs without new, delete and a fresh set of page faults for each one.
+  // On Linux the arena comes from reserved 2 MB huge pages if there are
+  // enough, then from memory the kernel is asked to back with them, so a
+  // CPU's page tables take fewer TLB entries. CPUs are built the first
+  // time they are handed out, so arena pages are touched as they are
+  // needed.
+  //
+  // acquire() and release() can be called from any thread at once. They
+  // share a lock free freelist, and a CPU is rebuilt in place when it is
+  // released, so the next acquire() hands it out as a new CPU would be.
+  class CPUPool
+  {
+  public: // Constructor
+    // huge_pages false keeps the arena on ordinary pages
+    explicit CPUPool(std::size_t count, bool huge_pages = true);
+
+    // Every CPU must be released, or no longer used, by then
+    ~CPUPool();
+
+    CPUPool(const CPUPool&) = delete;
+    CPUPool& operator=(const CPUPool&) = delete;
+
+  public: // CPUs
+    // nullptr if every CPU is handed out
+    CPU* acquire();
+
+    // cpu must have come from acquire() on this pool
+    void release(CPU& cpu);
+
+    bool owns(const CPU& cpu) const;
+
+  public: // Arena
+    std::size_t capacity() const { return count; }
+    Backing backing() const { return kind; }
+
+  private:
+    CPU* slot(std::size_t index) const
+    { return reinterpret_cast<CPU*>(arena + index * stride); }
+
+    const std::size_t count;
+    const std::size_t stride; // Bytes from one CPU to the next
+    std::size_t bytes;
+    Backing kind = Backing::Pages;
+
+    BYTE* arena;
+    void* mapping = nullptr; // What to munmap(), if arena was mapped
+    std::size_t mapped = 0;
+
+    // The top free CPU in the low half and a count of pops in the high
+    // half, so a CPU popped and pushed back between another thread's
+    // load and compare exchange does not look like nothing changed
+    std::atomic<std::uint64_t> head{POOL::none};
+    std::unique_ptr<std::atomic<std::uint32_t>[]> links;
+
+    // CPUs [0, built) have been built at some point
+    std::atomic<std::size_t> built{0};
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  SDISC_INLINE CPUPool::CPUPool(std::size_t in_count, bool huge_pages)
+    : count{std::min<std::size_t>(std::max<std::size_t>(in_count, 1), POOL::none)},
+      stride{(sizeof(CPU) + POOL::cache_line - 1) / POOL::cache_line * POOL::cache_line},
+      links(new std::atomic<std::uint32_t>[count])
+  {
+    static_assert(alignof(CPU) <= POOL::cache_line, "CPUs must fit the arena's alignment");
+    bytes = (count * stride + POOL::huge_page - 1) / POOL::huge_page * POOL::huge_page;
+
+#if SDISC_HAS_HUGE_PAGES
+    void* map = MAP_FAILED;
+    if(huge_pages)
+    {
+      map = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(map != MAP_FAILED) { mapping = map; mapped = bytes; kind = Backing::HugeTLB; }
+    }
+
+    // Otherwise a huge page more than needed, so the arena can start on one
+    if(map == MAP_FAILED)
+    {
+      map = ::mmap(nullptr, bytes + POOL::huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(map == MAP_FAILED) throw std::bad_alloc();
+
+      mapping = map;
+      mapped = bytes + POOL::huge_page;
+
+      const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(map);
+      map = reinterpret_cast<void*>((start + POOL::huge_page - 1) / POOL::huge_page * POOL::huge_page);
+      if(huge_pages && ::madvise(map, bytes, MADV_HUGEPAGE) == 0) kind = Backing::Transparent;
+    }
+
+    arena = static_cast<BYTE*>(map);
+#else
+    (void)huge_pages;
+    arena = static_cast<BYTE*>(::operator new(bytes, std::align_val_t(POOL::cache_line)));
+#endif
+  }
+
+  SDISC_INLINE CPUPool::~CPUPool()
+  {
+    const std::size_t used = std::min(built.load(), count);
+    for(std::size_t i = 0; i < used; ++i) slot(i)->~CPU();
+
+#if SDISC_HAS_HUGE_PAGES
+    ::munmap(mapping, mapped);
+#else
+    ::operator delete(arena, std::align_val_t(POOL::cache_line));
+#endif
+  }
+
+  // Released CPUs first, then ones never built
+  SDISC_INLINE CPU* CPUPool::acquire()
+  {
+    std::uint64_t top = head.load(std::memory_order_acquire);
+    while(std::uint32_t(top) != POOL::none)
+    {
+      const std::uint32_t index = std::uint32_t(top);
+      const std::uint64_t next = ((top >> 32) + 1) << 32 | links[index].load(std::memory_order_relaxed);
+      if(head.compare_exchange_weak(top, next, std::memory_order_acquire, std::memory_order_acquire))
+      { return slot(index); }
+    }
+
+    if(built.load(std::memory_order_relaxed) >= count) return nullptr;
+
+    const std::size_t index = built.fetch_add(1, std::memory_order_relaxed);
+    if(index >= count) return nullptr;
+    return new(slot(index)) CPU();
+  }
+
+  SDISC_INLINE void CPUPool::release(CPU& cpu)
+  {
+    const std::uint32_t index = std::uint32_t((reinterpret_cast<BYTE*>(&cpu) - arena) / stride);
+
+    cpu.~CPU();
+    new(&cpu) CPU();
+
+    std::uint64_t top = head.load(std::memory_order_relaxed);
+    std::uint64_t next;
+    do
+    {
+      links[index].store(std::uint32_t(top), std::memory_order_relaxed);
+      next = (top >> 32) << 32 | index;
+    } while(!head.compare_exchange_weak(top, next, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  SDISC_INLINE bool CPUPool::owns(const CPU& cpu) const
+  {
+    const BYTE* at = reinterpret_cast<const BYTE*>(&cpu);
+    return at >= arena && at < arena + count * stride && std::size_t(at - arena) % stride == 0;
+  }
+}
+#endif
+
+#endif
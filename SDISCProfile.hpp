@@ -0,0 +1,129 @@
+#ifndef SDISCPROFILE_HPP
+#define SDISCPROFILE_HPP
+
+// Reports for the Profile a BasicCPU with Features::Profile gathers,
+// which CPU is with SDISC_PROFILE defined to 1 for the whole program.
+// Defining it in only some files would give CPU two layouts.
+
+#include "SDISC.hpp"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+namespace SDISC // Profile Reports
+{
+  // Opcode totals, then the top hottest PCs with the instruction there
+  // in program and, for JIE/JIL, how often they were taken.
+  void printProfile(const Profile& profile, const Program& program,
+                    std::FILE* out = stdout, std::size_t top = 32);
+
+  // Every JAL target as a function running until the next target, with
+  // the instructions and ticks spent in it and each site calling it.
+  void printCallGraph(const Profile& profile, const Program& program,
+                      std::FILE* out = stdout);
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  namespace PROFILE
+  {
+    SDISC_INLINE double percent(COUNT part, COUNT whole)
+    { return whole == 0 ? 0.0 : 100.0 * double(part) / double(whole); }
+
+    SDISC_INLINE COUNT total(const COUNT* begin, const COUNT* end)
+    {
+      COUNT sum = 0;
+      for(; begin != end; ++begin) sum += *begin;
+      return sum;
+    }
+  }
+
+  SDISC_INLINE void printProfile(const Profile& profile, const Program& program,
+                    std::FILE* out, std::size_t top)
+  {
+    const COUNT instructions = PROFILE::total(profile.op_count, profile.op_count + 0x10);
+    const COUNT ticks = PROFILE::total(profile.op_ticks, profile.op_ticks + 0x10);
+
+    std::fprintf(out, "%llu instructions, %llu ticks\n\n",
+                 (unsigned long long)instructions, (unsigned long long)ticks);
+
+    std::fprintf(out, "op   %12s %7s %12s %7s\n", "count", "%", "ticks", "%");
+    for(BYTE op = 0; op < 0x10; ++op)
+    {
+      if(profile.op_count[op] == 0) continue;
+      std::fprintf(out, "%s  %12llu %6.2f%% %12llu %6.2f%%\n", OP::name[op],
+                   (unsigned long long)profile.op_count[op],
+                   PROFILE::percent(profile.op_count[op], instructions),
+                   (unsigned long long)profile.op_ticks[op],
+                   PROFILE::percent(profile.op_ticks[op], ticks));
+    }
+
+    std::vector<WORD> hot;
+    for(std::size_t pc = 0; pc < pro_size; ++pc)
+    { if(profile.pc_count[pc] != 0) hot.push_back(WORD(pc)); }
+
+    std::sort(hot.begin(), hot.end(), [&](WORD a, WORD b)
+    { return profile.pc_count[a] > profile.pc_count[b] ||
+             (profile.pc_count[a] == profile.pc_count[b] && a < b); });
+
+    if(hot.size() > top) hot.resize(top);
+
+    std::fprintf(out, "\npc     op   %12s %7s %12s %7s\n", "count", "%", "taken", "%");
+    for(WORD pc : hot)
+    {
+      const Instruction& in = program.code[pc];
+      const COUNT count = profile.pc_count[pc];
+      std::fprintf(out, "0x%04x %s  %12llu %6.2f%%", pc, OP::name[in.code()],
+                   (unsigned long long)count, PROFILE::percent(count, instructions));
+
+      if(in.code() == OP::JIE || in.code() == OP::JIL)
+      {
+        std::fprintf(out, " %12llu %6.2f%%", (unsigned long long)profile.taken[pc],
+                     PROFILE::percent(profile.taken[pc], count));
+      }
+
+      std::fprintf(out, "\n");
+    }
+  }
+
+  SDISC_INLINE void printCallGraph(const Profile& profile, const Program& program,
+                      std::FILE* out)
+  {
+    // target -> site -> calls, ordered so each function ends at the next
+    std::map<WORD, std::map<WORD, COUNT>> callers;
+    for(const auto& i : profile.calls)
+    { callers[WORD(i.first)][WORD(i.first >> 16)] += i.second; }
+
+    callers[0]; // Whatever runs before the first call
+
+    const COUNT ticks = PROFILE::total(profile.op_ticks, profile.op_ticks + 0x10);
+
+    for(auto i = callers.begin(); i != callers.end(); ++i)
+    {
+      const std::size_t end = std::next(i) == callers.end() ? pro_size : std::next(i)->first;
+      COUNT calls = 0, self = 0, self_ticks = 0;
+
+      for(const auto& site : i->second) calls += site.second;
+      for(std::size_t pc = i->first; pc < end; ++pc)
+      {
+        self += profile.pc_count[pc];
+        self_ticks += profile.pc_count[pc] * OP::tick_count[program.code[pc].code()];
+      }
+
+      std::fprintf(out, "0x%04x  %llu calls, %llu instructions, %llu ticks (%.2f%%)\n",
+                   i->first, (unsigned long long)calls, (unsigned long long)self,
+                   (unsigned long long)self_ticks, PROFILE::percent(self_ticks, ticks));
+
+      for(const auto& site : i->second)
+      {
+        std::fprintf(out, "  from 0x%04x  %llu calls (%.2f%%)\n", site.first,
+                     (unsigned long long)site.second, PROFILE::percent(site.second, calls));
+      }
+    }
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef SDISCREPLAY_HPP
+#define SDISCREPLAY_HPP
+
+#include "SDISC.hpp"
+#include "SDISCSnapshot.hpp"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace SDISC // Replay Constants
+{
+  namespace REPLAY
+  {
+    const BYTE magic[4] = {'S', 'D', 'R', 'P'};
+    const WORD version = 1;
+
+    // Ticks between the checkpoints a Recorder or Replayer takes, so a
+    // seek() replays at most about this many. Turns of run() are never
+    // less than the CPU's CPU::maxCost().
+    const COUNT checkpoint_ticks = 0x100000;
+
+    // InputRecord::address of a Register input that sets PC
+    const WORD pc_index = reg_size;
+  }
+
+  // What the CPU could not have worked out for itself
+  namespace Input
+  {
+    enum : BYTE
+    {
+      DeviceRead = 0, // What the guest's LOD of a device gave
+      Store      = 1, // The host stored value to mem
+      Register   = 2  // The host set reg[address], or PC at REPLAY::pc_index
+    };
+  }
+
+  struct InputRecord
+  {
+    COUNT tick; // CPU::tick when it happened
+    BYTE kind;  // One of Input
+    WORD address;
+    WORD value;
+  };
+
+  // The CPU at tick, and where in the inputs it goes on from
+  struct Checkpoint
+  {
+    Snapshot state;
+    std::size_t next;
+  };
+
+  // Everything needed to run a CPU again exactly as it was recorded: the
+  // state it started from, which pages were devices, and every input in
+  // the order it came. Checkpoints are keyed by tick, the first being
+  // where the recording starts.
+  struct Recording
+  {
+    std::uint64_t devices[page_count / 64] = {};
+    std::vector<InputRecord> inputs;
+    std::map<COUNT, Checkpoint> checkpoints;
+    COUNT end = 0; // CPU::tick when anything was last recorded
+
+    bool device(std::size_t page) const
+    { return (devices[page / 64] >> (page % 64)) & 1; }
+
+    // The last checkpoint at or before tick, or the first
+    const Checkpoint& before(COUNT tick) const;
+  };
+
+  // Recordings as little endian bytes:
+  //
+  //   magic[4], version, devices (page_count / 16 words), end (8 bytes)
+  //   first checkpoint's snapshot length (4 bytes), then saveSnapshot()
+  //   input count (8 bytes), then for each: tick (8 bytes), kind,
+  //   address, value
+  //
+  // Every field is a 16 bit word unless noted. Only the first checkpoint
+  // is written, a Replayer takes the others again as it goes.
+  std::vector<BYTE> saveRecording(const Recording& in);
+
+  // Returns false, leaving out alone, if data is not a valid recording
+  bool loadRecording(const BYTE* data, std::size_t size, Recording& out);
+}
+
+namespace SDISC // Recording
+{
+  // Runs a CPU while logging only what it can not reproduce on its own:
+  // every read of a device, and every store to mem and register set that
+  // the host makes through here, each with the tick it happened at. The
+  // CPU's devices must be attached before, and whatever the host changes
+  // any other way is not recorded. A checkpoint is taken every interval
+  // ticks of run(), so a Replayer can seek() without starting over.
+  class Recorder : public BusTap
+  {
+  public: // Constructor
+    // Starts recording from the CPU as it is now
+    explicit Recorder(CPU& in_cpu, COUNT in_interval = REPLAY::checkpoint_ticks);
+    ~Recorder() override;
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+  public: // Running
+    // As CPU::run() would, taking checkpoints as it goes
+    RunResult run(COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit,
+                  Dispatch engine = default_dispatch);
+
+  public: // Host Inputs
+    // Made now, at the CPU's tick. index is below reg_size.
+    void store(WORD address, WORD value);
+    void setRegister(BYTE index, WORD value);
+    void setPC(WORD value);
+
+  public: // Recording
+    const Recording& recording() const { return log; }
+
+  public: // BusTap
+    WORD read(WORD address, Device& device, WORD offset) override;
+
+  public: // Variables
+    CPU& cpu;
+    const COUNT interval;
+
+  private:
+    // Before any host inputs at the CPU's tick, which come after it
+    void checkpoint();
+    void add(BYTE kind, WORD address, WORD value);
+
+    Bus* bus;
+    Recording log;
+  };
+}
+
+namespace SDISC // Replaying
+{
+  // Runs a CPU again as a Recording says it ran. Reads of a device page
+  // give what was logged, in the order they were made. The host's inputs
+  // are made again when the CPU reaches their tick.
+  //
+  // With a bus attached to the CPU, its devices still take every write,
+  // so one that changes mem because of them, like DMA, does it again.
+  // Without one, writes to the recorded device pages are dropped, and
+  // nothing but the recording is needed.
+  //
+  // Another checkpoint is taken every interval ticks past the last one,
+  // so a recording loaded from bytes can seek() quickly once replayed.
+  //
+  // Reads are matched by order and address rather than tick, since
+  // Dispatch::Block and the JIT only add ticks between blocks. Any
+  // engine can replay what any other recorded. A read that was not
+  // recorded gives init_mem and makes diverged() true.
+  //
+  // Timing models are not part of a Snapshot, so seek() with one set is
+  // only exact if its state does not change what it charges.
+  class Replayer : public BusTap
+  {
+  public: // Constructor
+    // Restores the CPU to where the recording starts, which must come
+    // from a Recorder or loadRecording(). Reads through the CPU's bus, or
+    // one of its own, until the Replayer is gone.
+    Replayer(CPU& in_cpu, Recording in_log, COUNT in_interval = REPLAY::checkpoint_ticks);
+    ~Replayer() override;
+
+    Replayer(const Replayer&) = delete;
+    Replayer& operator=(const Replayer&) = delete;
+
+  public: // Running
+    // As the recorded CPU ran, up to the end of the recording, making the
+    // host's inputs when the CPU reaches their tick, and always those at
+    // the tick it starts at
+    RunResult run(COUNT max_ticks = no_limit,
+                  COUNT max_instructions = no_limit,
+                  Dispatch engine = default_dispatch);
+
+    // Puts the CPU where it was at tick, before the host's inputs at it,
+    // from the last checkpoint before. Ticks between instructions go to
+    // the one before, and past the end of the recording to the end.
+    void seek(COUNT tick, Dispatch engine = default_dispatch);
+
+  public: // State
+    // Whether the CPU did something the recording does not have
+    bool diverged() const { return mismatch; }
+
+    // Whether every input has been made
+    bool finished() const { return next == log.inputs.size(); }
+
+    const Recording& recording() const { return log; }
+
+  public: // BusTap
+    WORD read(WORD address, Device& device, WORD offset) override;
+
+    // Reads come from the recording, which only has the ones that were
+    // made, so a device is never waited on
+    bool ready(WORD address, Device& device, WORD offset) override
+    { (void)address; (void)device; (void)offset; return true; }
+
+  public: // Variables
+    CPU& cpu;
+    const COUNT interval;
+
+  private:
+    // Takes nothing, every device page is read through the tap
+    class Sink : public Device
+    {
+    public:
+      WORD read(WORD) override { return init_mem; }
+      void write(const DeviceWrite*, std::size_t) override {}
+    };
+
+    // Where the first host input from next is, or the end of the inputs
+    std::size_t hostInput() const
+    {
+      std::vector<std::size_t>::const_iterator at = std::lower_bound(hosts.begin(), hosts.end(), next);
+      return at == hosts.end() ? log.inputs.size() : *at;
+    }
+
+    // Makes every host input at the CPU's tick
+    void applyInputs();
+
+    Recording log;
+    std::vector<std::size_t> hosts; // Where each host input is in log
+    std::size_t next = 0;
+    bool mismatch = false;
+
+    Bus* target; // Tapped, the CPU's own or bus
+    Bus bus;
+    Sink sink;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Recording */
+  SDISC_INLINE const Checkpoint& Recording::before(COUNT tick) const
+  {
+    std::map<COUNT, Checkpoint>::const_iterator at = checkpoints.upper_bound(tick);
+    if(at != checkpoints.begin()) --at;
+    return at->second;
+  }
+
+  SDISC_INLINE std::vector<BYTE> saveRecording(const Recording& in)
+  {
+    std::vector<BYTE> out(REPLAY::magic, REPLAY::magic + 4);
+    SNAPSHOT::Writer writer(out);
+
+    writer.put(REPLAY::version);
+    for(std::uint64_t i : in.devices) writer.put64(i);
+    writer.put64(in.end);
+
+    const std::vector<BYTE> start = saveSnapshot(in.checkpoints.begin()->second.state);
+    writer.put32(std::uint32_t(start.size()));
+    out.insert(out.end(), start.begin(), start.end());
+
+    writer.put64(in.inputs.size());
+    for(const InputRecord& i : in.inputs)
+    {
+      writer.put64(i.tick);
+      writer.put(i.kind);
+      writer.put(i.address);
+      writer.put(i.value);
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE bool loadRecording(const BYTE* data, std::size_t size, Recording& out)
+  {
+    if(size < 4 || !std::equal(REPLAY::magic, REPLAY::magic + 4, data))
+    { return false; }
+
+    SNAPSHOT::Reader reader(data + 4, size - 4);
+    Recording in;
+    WORD version;
+
+    if(!reader.get(version) || version != REPLAY::version) return false;
+    for(std::uint64_t& i : in.devices) if(!reader.get64(i)) return false;
+    if(!reader.get64(in.end)) return false;
+
+    // The snapshot's bytes are not words, so they are read past reader
+    std::uint32_t length;
+    const std::size_t header = 4 + 2 + sizeof(in.devices) + 8 + 4;
+    if(!reader.get32(length) || size - header < length) return false;
+
+    Snapshot start;
+    if(!loadSnapshot(data + header, length, start)) return false;
+    in.checkpoints.emplace(start.tick, Checkpoint{start, 0});
+
+    SNAPSHOT::Reader records(data + header + length, size - header - length);
+    COUNT count;
+    if(!records.get64(count)) return false;
+
+    // Each is 14 bytes, so a count past what is left is not believed
+    if(count > (size - header - length) / 14) return false;
+    in.inputs.resize(std::size_t(count));
+
+    for(InputRecord& i : in.inputs)
+    {
+      WORD kind;
+      if(!records.get64(i.tick) || !records.get(kind) || kind > Input::Register) return false;
+      if(!records.get(i.address) || !records.get(i.value)) return false;
+      if(kind == Input::Register && i.address > REPLAY::pc_index) return false;
+      i.kind = BYTE(kind);
+    }
+
+    if(!records.done()) return false;
+
+    out = std::move(in);
+    return true;
+  }
+
+  /* Recorder */
+  SDISC_INLINE Recorder::Recorder(CPU& in_cpu, COUNT in_interval)
+    : cpu(in_cpu), interval{in_interval},
+      bus(in_cpu.mem.attached())
+  {
+    static_assert(CPU::has(Features::Ticks), "Inputs are recorded by tick");
+
+    for(std::size_t i = 0; i < page_count; ++i)
+    { if(cpu.mem.device(i)) log.devices[i / 64] |= std::uint64_t(1) << (i % 64); }
+
+    log.end = cpu.tick;
+    checkpoint();
+    if(bus != nullptr) bus->setTap(this);
+  }
+
+  SDISC_INLINE Recorder::~Recorder()
+  {
+    if(bus != nullptr && bus->tapped() == this) bus->setTap(nullptr);
+  }
+
+  // Runs in turns of interval ticks, with a checkpoint after any that
+  // ends interval ticks past the last one. Turns always fit the next
+  // instruction, so one that adds no ticks is out of the caller's budget.
+  SDISC_INLINE RunResult Recorder::run(COUNT max_ticks, COUNT max_instructions, Dispatch engine)
+  {
+    RunResult out{Status::TickLimit, 0, 0};
+
+    for(;;)
+    {
+      const COUNT turn = std::max(interval, cpu.maxCost());
+      const COUNT budget = std::min(turn, max_ticks - out.ticks);
+      const RunResult result = cpu.run(budget, max_instructions - out.instructions, engine);
+
+      out.status = result.status;
+      out.ticks += result.ticks;
+      out.instructions += result.instructions;
+      log.end = cpu.tick;
+
+      if(cpu.tick >= log.checkpoints.rbegin()->first + interval) checkpoint();
+      if(result.status != Status::TickLimit || budget < turn || result.ticks == 0) return out;
+    }
+  }
+
+  SDISC_INLINE void Recorder::store(WORD address, WORD value)
+  {
+    add(Input::Store, address, value);
+    cpu.mem.store(address, value);
+  }
+
+  SDISC_INLINE void Recorder::setRegister(BYTE index, WORD value)
+  {
+    add(Input::Register, index, value);
+    cpu.reg[index] = value;
+  }
+
+  SDISC_INLINE void Recorder::setPC(WORD value)
+  {
+    add(Input::Register, REPLAY::pc_index, value);
+    cpu.PC = value;
+  }
+
+  SDISC_INLINE void Recorder::checkpoint()
+  {
+    log.checkpoints.emplace(cpu.tick, Checkpoint{cpu.snapshot(), log.inputs.size()});
+  }
+
+  SDISC_INLINE WORD Recorder::read(WORD address, Device& device, WORD offset)
+  {
+    const WORD value = device.read(offset);
+    add(Input::DeviceRead, address, value);
+    return value;
+  }
+
+  SDISC_INLINE void Recorder::add(BYTE kind, WORD address, WORD value)
+  {
+    log.inputs.push_back(InputRecord{cpu.tick, kind, address, value});
+    log.end = cpu.tick;
+  }
+
+  /* Replayer */
+  SDISC_INLINE Replayer::Replayer(CPU& in_cpu, Recording in_log, COUNT in_interval)
+    : cpu(in_cpu), interval{in_interval},
+      log(std::move(in_log)), target(in_cpu.mem.attached())
+  {
+    static_assert(CPU::has(Features::Ticks), "Inputs are replayed by tick");
+
+    if(target == nullptr)
+    {
+      for(std::size_t i = 0; i < page_count; ++i)
+      { if(log.device(i)) bus.map(i, 1, sink); }
+
+      target = &bus;
+      cpu.mem.attach(bus);
+    }
+
+    target->setTap(this);
+
+    for(std::size_t i = 0; i < log.inputs.size(); ++i)
+    { if(log.inputs[i].kind != Input::DeviceRead) hosts.push_back(i); }
+
+    const Checkpoint& start = log.checkpoints.begin()->second;
+    cpu.restore(start.state);
+    next = start.next;
+  }
+
+  SDISC_INLINE Replayer::~Replayer()
+  {
+    target->setTap(nullptr);
+    if(target == &bus) cpu.mem.detach();
+  }
+
+  // Each turn ends at the next host input, which the recorded CPU was
+  // stopped exactly at, or after interval ticks for a checkpoint
+  SDISC_INLINE RunResult Replayer::run(COUNT max_ticks, COUNT max_instructions, Dispatch engine)
+  {
+    RunResult out{Status::TickLimit, 0, 0};
+
+    for(;;)
+    {
+      applyInputs();
+
+      // Host inputs left are all after the CPU's tick
+      const std::size_t host = hostInput();
+      const COUNT until = cpu.tick < log.end ? log.end - cpu.tick : 0;
+      const COUNT remaining = std::min(max_ticks - out.ticks, until);
+      COUNT budget = std::min(std::max(interval, cpu.maxCost()), remaining);
+
+      const bool to_input = host < log.inputs.size() && log.inputs[host].tick - cpu.tick <= budget;
+      if(to_input) budget = log.inputs[host].tick - cpu.tick;
+
+      const RunResult result = cpu.run(budget, max_instructions - out.instructions, engine);
+      out.status = result.status;
+      out.ticks += result.ticks;
+      out.instructions += result.instructions;
+
+      if(cpu.tick >= log.before(cpu.tick).state.tick + interval)
+      { log.checkpoints.emplace(cpu.tick, Checkpoint{cpu.snapshot(), next}); }
+
+      if(result.status != Status::TickLimit && result.status != Status::Halted) return out;
+      if(to_input && cpu.tick != log.inputs[host].tick) { mismatch = true; return out; }
+      if(to_input && budget < remaining) continue;
+      if(result.status == Status::Halted || budget == remaining || result.ticks == 0) return out;
+    }
+  }
+
+  SDISC_INLINE void Replayer::seek(COUNT tick, Dispatch engine)
+  {
+    const Checkpoint& from = log.before(tick);
+    cpu.restore(from.state);
+    next = from.next;
+    mismatch = false;
+
+    if(tick > cpu.tick) run(tick - cpu.tick, no_limit, engine);
+  }
+
+  SDISC_INLINE WORD Replayer::read(WORD address, Device& device, WORD offset)
+  {
+    (void)device; (void)offset;
+
+    if(next < log.inputs.size() && log.inputs[next].kind == Input::DeviceRead &&
+       log.inputs[next].address == address)
+    { return log.inputs[next++].value; }
+
+    mismatch = true;
+    return init_mem;
+  }
+
+  SDISC_INLINE void Replayer::applyInputs()
+  {
+    for(std::size_t host; (host = hostInput()) < log.inputs.size() && log.inputs[host].tick <= cpu.tick;)
+    {
+      // Every read before it was made before its tick
+      const InputRecord& in = log.inputs[host];
+      if(in.tick < cpu.tick || host != next) mismatch = true;
+      next = host + 1;
+
+      if(in.kind == Input::Store) cpu.mem.store(in.address, in.value);
+      else if(in.address == REPLAY::pc_index) cpu.PC = in.value;
+      else cpu.reg[in.address] = in.value;
+    }
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef SDISCRUNNER_HPP
+#define SDISCRUNNER_HPP
+
+#include "SDISC.hpp"
+#include "SDISCMetrics.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SDISC // Runner Constants
+{
+  namespace RUNNER
+  {
+    // Ticks a job runs for before it goes back on its worker's queue. A
+    // slice is never less than the job's CPU::maxCost().
+    const COUNT slice_ticks = 0x10000;
+
+    // Submit a job to whichever worker has the least queued
+    const std::size_t any_worker = ~std::size_t(0);
+
+    const std::size_t cache_line = 64;
+  }
+}
+
+namespace SDISC
+{
+  // Runs CPUs on a fixed set of worker threads. Each job runs in slices
+  // of slice_ticks with CPU::run() and goes back to the end of its own
+  // worker's queue, so a CPU stays on one core and in its cache while
+  // that worker has work. Idle workers steal from the other end of the
+  // busiest queue. Workers are padded to their own cache lines and all
+  // counting happens in the job, so workers never write shared lines on
+  // the hot path.
+  class Runner
+  {
+  public: // Types
+    using Callback = std::function<void(CPU&, const RunResult&)>;
+
+  public: // Constructor
+    explicit Runner(std::size_t workers = std::thread::hardware_concurrency(),
+                    COUNT slice_ticks = RUNNER::slice_ticks);
+
+    // Waits for every submitted job to finish
+    ~Runner();
+
+    Runner(const Runner&) = delete;
+    Runner& operator=(const Runner&) = delete;
+
+  public: // Jobs
+    // Runs cpu until it stops for anything but its slice running out, or
+    // until max_ticks have been used, as CPU::run() would. The caller
+    // keeps ownership of cpu and must not touch it until the job is done.
+    // done, if given, is called on the worker thread before the future
+    // becomes ready. The result covers the whole job, not one slice.
+    std::future<RunResult> submit(CPU& cpu, COUNT max_ticks = no_limit,
+                                  Callback done = Callback(),
+                                  std::size_t worker = RUNNER::any_worker);
+
+    /* Block until every submitted job is done */
+    void wait();
+
+    std::size_t workers() const { return queues.size(); }
+
+  public: // Metrics
+    // Each worker counts every slice into its own Counters of in_metrics,
+    // which needs at least workers() of them, or nothing with nullptr.
+    // Only set while no jobs are running.
+    void setMetrics(Metrics* in_metrics) { metrics = in_metrics; }
+
+  private: // Types
+    struct Job
+    {
+      CPU* cpu;
+      COUNT remaining;
+      RunResult total;
+      Callback done;
+      std::promise<RunResult> promise;
+    };
+
+    struct alignas(RUNNER::cache_line) Queue
+    {
+      std::mutex lock;
+      std::deque<Job*> jobs;
+    };
+
+  private: // Workers
+    void work(std::size_t worker);
+    Job* take(std::size_t worker);
+    Job* steal(std::size_t worker);
+
+    // Runs one slice, returning true once the job is finished
+    bool step(Job& job, std::size_t worker);
+
+  private: // Variables
+    const COUNT slice;
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::condition_variable finished;
+    std::size_t pending = 0;   // Jobs submitted but not done, under idle_lock
+    std::size_t submitted = 0; // Jobs ever submitted, under idle_lock
+    bool stopping = false;
+
+    Metrics* metrics = nullptr;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  SDISC_INLINE Runner::Runner(std::size_t workers, COUNT slice_ticks)
+    : slice{slice_ticks},
+      queues(std::max<std::size_t>(workers, 1))
+  {
+    for(std::size_t i = 0; i < queues.size(); ++i)
+    { threads.emplace_back(&Runner::work, this, i); }
+  }
+
+  SDISC_INLINE Runner::~Runner()
+  {
+    wait();
+
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      stopping = true;
+    }
+
+    idle.notify_all();
+    for(std::thread& i : threads) i.join();
+  }
+
+  /* Jobs */
+  SDISC_INLINE std::future<RunResult> Runner::submit(CPU& cpu, COUNT max_ticks,
+                                        Callback done, std::size_t worker)
+  {
+    Job* job = new Job{&cpu, max_ticks, RunResult{Status::TickLimit, 0, 0},
+                       std::move(done), std::promise<RunResult>()};
+    std::future<RunResult> out = job->promise.get_future();
+
+    if(worker >= queues.size())
+    {
+      std::size_t shortest = ~std::size_t(0);
+      for(std::size_t i = 0; i < queues.size(); ++i)
+      {
+        std::lock_guard<std::mutex> guard(queues[i].lock);
+        if(queues[i].jobs.size() < shortest)
+        { shortest = queues[i].jobs.size(); worker = i; }
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(queues[worker].lock);
+      queues[worker].jobs.push_back(job);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      ++pending;
+      ++submitted;
+      idle.notify_one();
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE void Runner::wait()
+  {
+    std::unique_lock<std::mutex> guard(idle_lock);
+    finished.wait(guard, [this]{ return pending == 0; });
+  }
+
+  /* Workers */
+  SDISC_INLINE void Runner::work(std::size_t worker)
+  {
+    // Every job submitted before this was read was queued before take()
+    // and steal() last looked. Jobs put back by a worker are run by it.
+    std::size_t seen = 0;
+
+    for(;;)
+    {
+      Job* job = take(worker);
+      if(job == nullptr) job = steal(worker);
+
+      if(job == nullptr)
+      {
+        std::unique_lock<std::mutex> guard(idle_lock);
+        idle.wait(guard, [&]{ return stopping || submitted != seen; });
+        if(stopping) return;
+
+        seen = submitted;
+        continue;
+      }
+
+      if(!step(*job, worker))
+      {
+        std::lock_guard<std::mutex> guard(queues[worker].lock);
+        queues[worker].jobs.push_back(job);
+        continue;
+      }
+
+      if(job->done) job->done(*job->cpu, job->total);
+      job->promise.set_value(job->total);
+      delete job;
+
+      std::lock_guard<std::mutex> guard(idle_lock);
+      if(--pending == 0) finished.notify_all();
+    }
+  }
+
+  SDISC_INLINE Runner::Job* Runner::take(std::size_t worker)
+  {
+    Queue& queue = queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.jobs.empty()) return nullptr;
+
+    Job* job = queue.jobs.front();
+    queue.jobs.pop_front();
+    return job;
+  }
+
+  SDISC_INLINE Runner::Job* Runner::steal(std::size_t worker)
+  {
+    std::size_t victim = worker;
+    std::size_t longest = 0;
+
+    for(std::size_t i = 0; i < queues.size(); ++i)
+    {
+      if(i == worker) continue;
+
+      std::lock_guard<std::mutex> guard(queues[i].lock);
+      if(queues[i].jobs.size() > longest)
+      { longest = queues[i].jobs.size(); victim = i; }
+    }
+
+    if(victim == worker) return nullptr;
+
+    Queue& queue = queues[victim];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.jobs.empty()) return nullptr;
+
+    Job* job = queue.jobs.back();
+    queue.jobs.pop_back();
+    return job;
+  }
+
+  SDISC_INLINE bool Runner::step(Job& job, std::size_t worker)
+  {
+    const COUNT faults = job.cpu->faults;
+    const COUNT turn = std::max(slice, job.cpu->maxCost());
+    const RunResult result = job.cpu->run(std::min(turn, job.remaining));
+    if(metrics != nullptr) metrics->worker(worker).count(*job.cpu, result, job.cpu->faults - faults);
+
+    job.remaining -= result.ticks;
+    job.total.ticks += result.ticks;
+    job.total.instructions += result.instructions;
+    job.total.status = result.status;
+
+    // A slice always fits the next instruction, so no progress means the
+    // job's own budget has run out. Watchpoints and breakpoints finish
+    // the job where they stopped.
+    return result.status != Status::TickLimit || result.ticks == 0;
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef SDISCSNAPSHOT_HPP
+#define SDISCSNAPSHOT_HPP
+
+#include "SDISC.hpp"
+
+#include <vector>
+
+namespace SDISC // Snapshot Format
+{
+  namespace SNAPSHOT
+  {
+    const BYTE magic[4] = {'S', 'D', 'S', 'N'};
+    const WORD version = 2;
+  }
+
+  // Snapshots as little endian bytes, for disk or for another worker:
+  //
+  //   magic[4], version, PC, reg[reg_size], tick (8 bytes)
+  //   trap enabled (0 or 1), trap handler, trap frame
+  //   program length (4 bytes), program words up to the last non STP
+  //   page count, then for each page: index, page_size words
+  //
+  // Every field is a 16 bit word unless noted. Only pages that are not
+  // all init_mem are written.
+  std::vector<BYTE> saveSnapshot(const Snapshot& in);
+
+  // Returns false, leaving out alone, if data is not a valid snapshot
+  bool loadSnapshot(const BYTE* data, std::size_t size, Snapshot& out);
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  namespace SNAPSHOT
+  {
+    class Writer
+    {
+    public:
+      explicit Writer(std::vector<BYTE>& in_out) : out(in_out) {}
+
+      void put(WORD value)
+      { out.push_back(BYTE(value)); out.push_back(BYTE(value >> 8)); }
+
+      void put32(std::uint32_t value)
+      { put(WORD(value)); put(WORD(value >> 16)); }
+
+      void put64(COUNT value)
+      { put32(std::uint32_t(value)); put32(std::uint32_t(value >> 32)); }
+
+    private:
+      std::vector<BYTE>& out;
+    };
+
+    class Reader
+    {
+    public:
+      Reader(const BYTE* in_data, std::size_t in_size)
+        : data(in_data), size{in_size} {}
+
+      bool get(WORD& value)
+      {
+        if(size - used < 2) return false;
+        value = WORD(data[used] | (data[used + 1] << 8));
+        used += 2;
+        return true;
+      }
+
+      bool get32(std::uint32_t& value)
+      {
+        WORD low, high;
+        if(!get(low) || !get(high)) return false;
+        value = low | (std::uint32_t(high) << 16);
+        return true;
+      }
+
+      bool get64(COUNT& value)
+      {
+        std::uint32_t low, high;
+        if(!get32(low) || !get32(high)) return false;
+        value = low | (COUNT(high) << 32);
+        return true;
+      }
+
+      bool done() const { return used == size; }
+
+    private:
+      const BYTE* data;
+      std::size_t size;
+      std::size_t used = 0;
+    };
+
+    SDISC_INLINE bool blankPage(const Page& page)
+    {
+      for(WORD i : page.word) if(i != init_mem) return false;
+      return true;
+    }
+  }
+
+  SDISC_INLINE std::vector<BYTE> saveSnapshot(const Snapshot& in)
+  {
+    std::vector<BYTE> out(SNAPSHOT::magic, SNAPSHOT::magic + 4);
+    SNAPSHOT::Writer writer(out);
+
+    writer.put(SNAPSHOT::version);
+    writer.put(in.PC);
+    for(WORD i : in.reg) writer.put(i);
+    writer.put64(in.tick);
+    writer.put(in.trap.enabled);
+    writer.put(in.trap.handler);
+    writer.put(in.trap.frame);
+
+    // Program
+    const std::uint32_t length = in.program->length;
+    writer.put32(length);
+    for(std::uint32_t i = 0; i < length; ++i) writer.put(in.program->code[i].word());
+
+    // Memory
+    std::vector<WORD> pages;
+    for(std::size_t i = 0; i < page_count; ++i)
+    {
+      const std::shared_ptr<const Page>& page = in.mem->pages[i];
+      if(page != MemoryImage::blankPage() && !SNAPSHOT::blankPage(*page))
+      { pages.push_back(WORD(i)); }
+    }
+
+    writer.put(WORD(pages.size()));
+    for(WORD i : pages)
+    {
+      writer.put(i);
+      for(WORD word : in.mem->pages[i]->word) writer.put(word);
+    }
+
+    return out;
+  }
+
+  SDISC_INLINE bool loadSnapshot(const BYTE* data, std::size_t size, Snapshot& out)
+  {
+    if(size < 4 || !std::equal(SNAPSHOT::magic, SNAPSHOT::magic + 4, data))
+    { return false; }
+
+    SNAPSHOT::Reader reader(data + 4, size - 4);
+    Snapshot in;
+    WORD version;
+
+    if(!reader.get(version) || version != SNAPSHOT::version) return false;
+    if(!reader.get(in.PC)) return false;
+    for(WORD& i : in.reg) if(!reader.get(i)) return false;
+    if(!reader.get64(in.tick)) return false;
+
+    WORD enabled;
+    if(!reader.get(enabled) || enabled > 1) return false;
+    in.trap.enabled = enabled != 0;
+    if(!reader.get(in.trap.handler) || !reader.get(in.trap.frame)) return false;
+
+    // Program
+    std::uint32_t length;
+    if(!reader.get32(length) || length > pro_size) return false;
+
+    std::vector<Instruction> program(length);
+    for(Instruction& i : program)
+    {
+      WORD word;
+      if(!reader.get(word)) return false;
+      i = Instruction::fromWord(word);
+    }
+
+    in.program = Program::make(program);
+
+    // Memory
+    std::shared_ptr<MemoryImage> mem = std::make_shared<MemoryImage>();
+    WORD pages;
+    if(!reader.get(pages) || pages > page_count) return false;
+
+    for(WORD p = 0; p < pages; ++p)
+    {
+      WORD index;
+      if(!reader.get(index) || index >= page_count) return false;
+
+      std::shared_ptr<Page> page = std::make_shared<Page>();
+      for(WORD& word : page->word) if(!reader.get(word)) return false;
+      mem->pages[index] = std::move(page);
+    }
+
+    if(!reader.done()) return false;
+
+    in.mem = std::move(mem);
+    out = std::move(in);
+    return true;
+  }
+}
+#endif
+
+#endif
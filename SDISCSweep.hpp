@@ -0,0 +1,312 @@
+#ifndef SDISCSWEEP_HPP
+#define SDISCSWEEP_HPP
+
+#include "SDISC.hpp"
+#include "SDISCBatch.hpp"
+
+#include <atomic>
+#include <bitset>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace SDISC // Sweep Constants
+{
+  namespace SWEEP
+  {
+    // Variants a worker takes at once, which are also reduced together
+    const std::size_t chunk = 64;
+
+    // Lanes of the CPUBatch each worker runs variants in with batch set
+    const std::size_t lanes = 8;
+  }
+
+  struct SweepOptions
+  {
+    std::size_t workers = std::thread::hardware_concurrency();
+
+    // Each variant runs until STP or until it has used this many ticks
+    COUNT max_ticks = no_limit;
+    Dispatch dispatch = Dispatch::Block;
+
+    // Runs variants SWEEP::lanes at a time in the lanes of a CPUBatch.
+    // Only pays off while they mostly take the same branches.
+    bool batch = false;
+  };
+
+  // How one variant ended
+  struct SweepOutcome
+  {
+    std::size_t variant;
+    RunResult run;
+
+    WORD PC;
+    WORD reg[reg_size];
+    COUNT tick;
+
+    // Valid until the visit or measure it is handed to returns
+    WORD load(WORD address) const
+    { return lane != nullptr ? lane[address] : memory->load(address); }
+
+    const Memory* memory; // Of the CPU it ran on, or
+    const WORD* lane;     // the mem of its CPUBatch lane
+  };
+}
+
+namespace SDISC // Sweeps
+{
+  // Runs many variants of one starting state on every core. The state is
+  // a snapshot of a CPU that has already run whatever setup they share,
+  // once. Each worker keeps one CPU and restores it to the snapshot for
+  // every variant, which only puts back the pages the last variant
+  // wrote, so a variant costs the setup callback, its run and the pages
+  // it writes. Variants run without a bus, since devices are not part of
+  // a snapshot.
+  //
+  // Variants are handed out SWEEP::chunk at a time. Results are reduced
+  // within a chunk in variant order and then chunk by chunk, so run()
+  // gives the same answer with any number of workers as long as combine
+  // is associative.
+  class Sweep
+  {
+  public: // Types
+    // Changes cpu, just restored to the snapshot, into variant. With
+    // batch set it may change PC, reg, tick and mem, but not program or
+    // trap, which are shared by every lane.
+    using Setup = std::function<void(CPU& cpu, std::size_t variant)>;
+
+    // Called on the worker that ran it. Each chunk is only visited by one
+    // worker, in variant order.
+    using Visit = std::function<void(std::size_t chunk, const SweepOutcome& out)>;
+
+  public: // Constructor
+    explicit Sweep(const Snapshot& in_base, SweepOptions in_options = SweepOptions())
+      : base(in_base), options(in_options) {}
+
+    // Sweeps from where cpu has got to
+    explicit Sweep(CPU& prefix, SweepOptions in_options = SweepOptions())
+      : Sweep(prefix.snapshot(), in_options) {}
+
+  public: // Sweeps
+    // Runs variants [0, variants) and folds measure(outcome) of each into
+    // init with combine(T, T). The first exception thrown by setup or
+    // measure stops every worker and is rethrown here.
+    template<class T, class Measure, class Combine>
+    T run(std::size_t variants, const Setup& setup,
+          const Measure& measure, const Combine& combine, T init = T()) const;
+
+    // run() without the reduction
+    void each(std::size_t variants, const Setup& setup, const Visit& visit) const;
+
+    const Snapshot& snapshot() const { return base; }
+
+  private: // Workers
+    struct Shared
+    {
+      std::size_t variants;
+      std::size_t chunks;
+      const Setup& setup;
+      const Visit& visit;
+      const WORD* words; // base.mem as one array, with batch set
+
+      std::atomic<std::size_t> next{0};
+      std::atomic<bool> failed{false};
+    };
+
+    void workCPUs(Shared& shared) const;
+    void workBatch(Shared& shared) const;
+
+  private: // Variables
+    const Snapshot base;
+    const SweepOptions options;
+  };
+}
+
+namespace SDISC
+{
+  template<class T, class Measure, class Combine>
+  T Sweep::run(std::size_t variants, const Setup& setup,
+               const Measure& measure, const Combine& combine, T init) const
+  {
+    std::vector<std::optional<T>> partials((variants + SWEEP::chunk - 1) / SWEEP::chunk);
+
+    each(variants, setup, [&](std::size_t chunk, const SweepOutcome& out)
+    {
+      std::optional<T>& partial = partials[chunk];
+      if(partial) partial = combine(std::move(*partial), measure(out));
+      else partial.emplace(measure(out));
+    });
+
+    for(std::optional<T>& i : partials)
+    { if(i) init = combine(std::move(init), std::move(*i)); }
+    return init;
+  }
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  SDISC_INLINE void Sweep::each(std::size_t variants, const Setup& setup, const Visit& visit) const
+  {
+    std::vector<WORD> words;
+    if(options.batch)
+    {
+      words.resize(mem_size);
+      for(std::size_t i = 0; i < mem_size; ++i)
+      { words[i] = base.mem->pages[i >> page_shift]->word[i & (page_size - 1)]; }
+    }
+
+    Shared shared{variants, (variants + SWEEP::chunk - 1) / SWEEP::chunk, setup, visit, words.data()};
+    const std::size_t workers = std::min(std::max<std::size_t>(options.workers, 1), shared.chunks);
+
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    const auto work = [&]
+    {
+      try
+      {
+        if(options.batch) workBatch(shared);
+        else workCPUs(shared);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if(!error) error = std::current_exception();
+        shared.failed = true;
+      }
+    };
+
+    // The calling thread is one of the workers
+    std::vector<std::thread> threads;
+    for(std::size_t i = 1; i < workers; ++i) threads.emplace_back(work);
+    if(workers != 0) work();
+
+    for(std::thread& i : threads) i.join();
+    if(error) std::rethrow_exception(error);
+  }
+
+  SDISC_INLINE void Sweep::workCPUs(Shared& shared) const
+  {
+    const std::unique_ptr<CPU> cpu(new CPU(base));
+
+    for(;;)
+    {
+      const std::size_t chunk = shared.next.fetch_add(1, std::memory_order_relaxed);
+      if(chunk >= shared.chunks || shared.failed.load(std::memory_order_relaxed)) return;
+
+      const std::size_t end = std::min(shared.variants, (chunk + 1) * SWEEP::chunk);
+      for(std::size_t variant = chunk * SWEEP::chunk; variant < end; ++variant)
+      {
+        cpu->restore(base);
+        shared.setup(*cpu, variant);
+
+        SweepOutcome out{variant, cpu->run(options.max_ticks, no_limit, options.dispatch),
+                         0, {}, 0, &cpu->mem, nullptr};
+        out.PC = cpu->PC;
+        std::copy(cpu->reg, cpu->reg + reg_size, out.reg);
+        out.tick = cpu->tick;
+
+        shared.visit(chunk, out);
+      }
+    }
+  }
+
+  // Each lane starts as base.mem with the pages setup wrote on top.
+  // Lanes keep their mem between variants, so only the pages that may
+  // differ from base.mem are put back: those the last setup in the lane
+  // wrote and those its run wrote. Lanes past the last variant of a chunk
+  // copy the first lane and are not visited.
+  SDISC_INLINE void Sweep::workBatch(Shared& shared) const
+  {
+    using Batch = CPUBatch<SWEEP::lanes>;
+    using Pages = std::bitset<page_count>;
+    const std::unique_ptr<Batch> batch(new Batch());
+    const std::unique_ptr<CPU> cpu(new CPU(base));
+    batch->loadProgram(base.program);
+    batch->trap = base.trap;
+
+    // Pages of each lane that may differ from base.mem, all of them
+    // until a lane has been filled once
+    std::vector<Pages> changed(SWEEP::lanes);
+    for(Pages& i : changed) i.set();
+
+    for(;;)
+    {
+      const std::size_t chunk = shared.next.fetch_add(1, std::memory_order_relaxed);
+      if(chunk >= shared.chunks || shared.failed.load(std::memory_order_relaxed)) return;
+
+      const std::size_t end = std::min(shared.variants, (chunk + 1) * SWEEP::chunk);
+      for(std::size_t first = chunk * SWEEP::chunk; first < end; first += SWEEP::lanes)
+      {
+        const std::size_t count = std::min(SWEEP::lanes, end - first);
+
+        for(std::size_t l = 0; l < SWEEP::lanes; ++l)
+        {
+          WORD* mem = batch->mem[l];
+          Pages setup;
+
+          if(l >= count)
+          {
+            batch->PC[l] = batch->PC[0];
+            for(std::size_t r = 0; r < reg_size; ++r) batch->reg[r][l] = batch->reg[r][0];
+            batch->tick[l] = batch->tick[0];
+
+            setup = changed[0];
+            for(std::size_t p = 0; p < page_count; ++p)
+            {
+              if(setup[p])
+              { std::copy(batch->mem[0] + p * page_size, batch->mem[0] + (p + 1) * page_size, mem + p * page_size); }
+              else if(changed[l][p])
+              { std::copy(shared.words + p * page_size, shared.words + (p + 1) * page_size, mem + p * page_size); }
+            }
+          }
+          else
+          {
+            cpu->restore(base);
+            shared.setup(*cpu, first + l);
+
+            batch->PC[l] = cpu->PC;
+            for(std::size_t r = 0; r < reg_size; ++r) batch->reg[r][l] = cpu->reg[r];
+            batch->tick[l] = cpu->tick;
+
+            for(std::size_t p = 0; p < page_count; ++p)
+            {
+              if(cpu->mem.owns(p))
+              {
+                setup.set(p);
+                std::copy(cpu->mem.table.read[p], cpu->mem.table.read[p] + page_size, mem + p * page_size);
+              }
+              else if(changed[l][p])
+              { std::copy(shared.words + p * page_size, shared.words + (p + 1) * page_size, mem + p * page_size); }
+            }
+          }
+
+          changed[l] = setup;
+          std::fill(batch->written[l], batch->written[l] + page_count / 64, 0);
+        }
+
+        const Batch::Results results = batch->run(options.max_ticks);
+
+        for(std::size_t l = 0; l < SWEEP::lanes; ++l)
+        {
+          for(std::size_t p = 0; p < page_count; ++p)
+          { if(batch->written[l][p / 64] >> (p % 64) & 1) changed[l].set(p); }
+        }
+
+        for(std::size_t l = 0; l < count; ++l)
+        {
+          SweepOutcome out{first + l, results[l], batch->PC[l], {}, batch->tick[l], nullptr, batch->mem[l]};
+          for(std::size_t r = 0; r < reg_size; ++r) out.reg[r] = batch->reg[r][l];
+          shared.visit(chunk, out);
+        }
+      }
+    }
+  }
+}
+#endif
+
+#endif
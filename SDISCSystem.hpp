@@ -0,0 +1,341 @@
+#ifndef SDISCSYSTEM_HPP
+#define SDISCSYSTEM_HPP
+
+#include "SDISC.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace SDISC // System Constants
+{
+  namespace SYSTEM
+  {
+    // Pages [0, shared_pages) of every core are one SharedMemory, page
+    // atomics_page is the core's own Atomics, and the pages after it are
+    // the core's own RAM, which holds the default trap frame
+    const std::size_t shared_pages = 0xfe;
+    const std::size_t atomics_page = 0xfe;
+
+    // Ticks a core runs for before another one with Schedule::Ticks. A
+    // turn is never less than the core's CPU::maxCost().
+    const COUNT quantum_ticks = 0x40;
+  }
+}
+
+namespace SDISC // Memory Ordering
+{
+  // How cores on different threads see each other's LOD and STR of the
+  // shared pages. A core always sees its own in program order.
+  enum class Ordering
+  {
+    Sequential, // Every core sees every access in one order
+    Relaxed     // Accesses to different words only ordered by fences
+  };
+
+  // How System::run() runs its cores
+  enum class Schedule
+  {
+    Threads, // Each on its own host thread, all at once
+    Ticks    // In turns on the calling thread, the same on every run
+  };
+}
+
+namespace SDISC // Shared Memory
+{
+  // The pages every core of a System shares, as a Device each core's bus
+  // maps at page 0, so offsets are addresses. Every word is a std::atomic
+  // loaded and stored with ordering, so cores on different threads never
+  // race. A core's stores are buffered by its bus as for any device and
+  // reach the others at its next read of a device, every BUS::batch_writes
+  // stores, and when its run() returns.
+  class SharedMemory : public Device
+  {
+  public: // Constants
+    static const std::size_t size = SYSTEM::shared_pages * page_size;
+
+  public: // Constructor
+    explicit SharedMemory(Ordering in_ordering);
+
+  public: // Device
+    WORD read(WORD offset) override { return load(offset); }
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+  public: // Words
+    // From the host while nothing runs, or from Atomics. Addresses must
+    // be below size.
+    WORD load(WORD address) const { return words[address].load(order()); }
+    void store(WORD address, WORD value) { words[address].store(value, order()); }
+
+    // Sequentially consistent whatever ordering is, each giving the word
+    // from before
+    WORD compareExchange(WORD address, WORD expected, WORD desired);
+    WORD fetchAdd(WORD address, WORD value) { return words[address].fetch_add(value); }
+    WORD exchange(WORD address, WORD value) { return words[address].exchange(value); }
+
+    // Every word back to init_mem
+    void clear();
+
+  public: // Variables
+    const Ordering ordering;
+
+  private:
+    std::memory_order order() const
+    {
+      return ordering == Ordering::Sequential
+        ? std::memory_order_seq_cst : std::memory_order_relaxed;
+    }
+
+    std::unique_ptr<std::atomic<WORD>[]> words;
+  };
+
+  // Atomic operations on a SharedMemory for one core, since the ISA has
+  // no opcodes to spare. Write the address to offset 0, the operand to 1
+  // and, for compare and swap, what to swap in to 2. Reading one of these
+  // then does it, and gives the word that was there before:
+  //
+  //   3  compare and swap, the word becomes offset 2 if it was the operand
+  //   4  fetch and add, the operand is added to the word
+  //   5  swap, the word becomes the operand
+  //
+  // The bus hands the writes over before the read, and all three are
+  // sequentially consistent, even with Ordering::Relaxed. An address past
+  // the shared pages reads init_mem and changes nothing.
+  //
+  // Reading 6 is a fence, ordering every LOD and STR before it before
+  // every one after, and gives 0. Reading 7 gives the core's index, 8 how
+  // many cores there are, and 0 to 2 give back what was written.
+  class Atomics : public Device
+  {
+  public:
+    Atomics(SharedMemory& in_shared, WORD in_index, WORD in_cores)
+      : shared(in_shared), index{in_index}, cores{in_cores} {}
+
+    WORD read(WORD offset) override;
+    void write(const DeviceWrite* in, std::size_t count) override;
+
+  private:
+    SharedMemory& shared;
+    const WORD index;
+    const WORD cores;
+    WORD regs[3] = {};
+  };
+}
+
+namespace SDISC // Multi-Core System
+{
+  // Several CPUs sharing the pages of one SharedMemory. Each core has its
+  // own registers, PC, tick, bus, Atomics and private pages, and they all
+  // usually run one Program, telling themselves apart by their index.
+  //
+  // With Schedule::Threads every core runs on its own host thread, and
+  // ordering is what the cores can see. With Schedule::Ticks they take
+  // turns of quantum ticks on the calling thread, always the core with
+  // the least tick next and the lowest index on a tie. Nothing then
+  // depends on the host, so every run from the same state gives the same
+  // result, for replaying what a threaded run might have done.
+  class System
+  {
+  public: // Types
+    using RunResults = std::vector<RunResult>; // One for each core
+
+  public: // Constructor
+    explicit System(std::size_t cores = 2, Ordering ordering = Ordering::Sequential);
+
+    System(const System&) = delete;
+    System& operator=(const System&) = delete;
+
+  public: // System Control
+    // Resets every core, as CPU::reset() does, with PC back at 0, and the
+    // shared pages to init_mem. Devices stay mapped.
+    void reset();
+
+    // Every core runs in_program, from its own PC
+    template<class ArrayType>
+    void loadProgram(const ArrayType& in_program)
+    { loadProgram(Program::make(in_program)); }
+
+    void loadProgram(const std::shared_ptr<const Program>& in_image);
+
+    // Maps pages [first, first + count) of one core to device, over
+    // whatever they were
+    void map(std::size_t core, std::size_t first, std::size_t count, Device& device);
+
+  public: // Running
+    // Runs every core until it reaches STP, stops at a watchpoint or
+    // breakpoint, or has used max_ticks of its own. Each result is the
+    // core's as CPU::run() would give it.
+    RunResults run(COUNT max_ticks = no_limit, Schedule schedule = Schedule::Threads);
+
+  public: // Cores
+    std::size_t cores() const { return nodes.size(); }
+
+    CPU& core(std::size_t index) { return nodes[index]->cpu; }
+    const CPU& core(std::size_t index) const { return nodes[index]->cpu; }
+
+  public: // Variables
+    SharedMemory shared;
+    Dispatch engine = default_dispatch;    // What each core runs with
+    COUNT quantum = SYSTEM::quantum_ticks; // Turns of Schedule::Ticks
+
+  private: // Cores
+    static_assert(CPU::has(Features::Devices), "System cores reach shared pages through their bus");
+
+    struct Core
+    {
+      Core(SharedMemory& shared, WORD index, WORD cores);
+
+      CPU cpu;
+      Bus bus;
+      Atomics atomics;
+    };
+
+    RunResults runThreads(COUNT max_ticks);
+    RunResults runTicks(COUNT max_ticks);
+
+    std::vector<std::unique_ptr<Core>> nodes;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Shared Memory */
+  SDISC_INLINE SharedMemory::SharedMemory(Ordering in_ordering)
+    : ordering{in_ordering}, words(new std::atomic<WORD>[size])
+  { clear(); }
+
+  SDISC_INLINE void SharedMemory::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i) store(in[i].offset, in[i].value);
+  }
+
+  SDISC_INLINE WORD SharedMemory::compareExchange(WORD address, WORD expected, WORD desired)
+  {
+    words[address].compare_exchange_strong(expected, desired);
+    return expected;
+  }
+
+  SDISC_INLINE void SharedMemory::clear()
+  {
+    for(std::size_t i = 0; i < size; ++i) words[i].store(init_mem, std::memory_order_relaxed);
+  }
+
+  /* Atomics */
+  SDISC_INLINE WORD Atomics::read(WORD offset)
+  {
+    const WORD address = regs[0], operand = regs[1];
+    const bool valid = address < SharedMemory::size;
+
+    switch(offset)
+    {
+      case 0: case 1: case 2: return regs[offset];
+
+      case 3: return valid ? shared.compareExchange(address, operand, regs[2]) : init_mem;
+      case 4: return valid ? shared.fetchAdd(address, operand) : init_mem;
+      case 5: return valid ? shared.exchange(address, operand) : init_mem;
+
+      case 6: std::atomic_thread_fence(std::memory_order_seq_cst); return 0;
+      case 7: return index;
+      case 8: return cores;
+    }
+
+    return 0;
+  }
+
+  SDISC_INLINE void Atomics::write(const DeviceWrite* in, std::size_t count)
+  {
+    for(std::size_t i = 0; i < count; ++i)
+    { if(in[i].offset < 3) regs[in[i].offset] = in[i].value; }
+  }
+
+  /* System */
+  SDISC_INLINE System::Core::Core(SharedMemory& shared, WORD index, WORD cores)
+    : atomics(shared, index, cores)
+  {
+    bus.map(0, SYSTEM::shared_pages, shared);
+    bus.map(SYSTEM::atomics_page, 1, atomics);
+    cpu.mem.attach(bus);
+  }
+
+  SDISC_INLINE System::System(std::size_t cores, Ordering ordering)
+    : shared(ordering)
+  {
+    cores = std::min<std::size_t>(std::max<std::size_t>(cores, 1), 0xffff);
+    for(std::size_t i = 0; i < cores; ++i)
+    { nodes.emplace_back(new Core(shared, WORD(i), WORD(cores))); }
+  }
+
+  SDISC_INLINE void System::reset()
+  {
+    for(std::unique_ptr<Core>& i : nodes) { i->cpu.reset(); i->cpu.PC = 0; }
+    shared.clear();
+  }
+
+  SDISC_INLINE void System::loadProgram(const std::shared_ptr<const Program>& in_image)
+  {
+    for(std::unique_ptr<Core>& i : nodes) i->cpu.loadProgram(in_image);
+  }
+
+  SDISC_INLINE void System::map(std::size_t core, std::size_t first, std::size_t count, Device& device)
+  {
+    Core& node = *nodes[core];
+    node.bus.map(first, count, device);
+    node.cpu.mem.attach(node.bus);
+  }
+
+  /* Running */
+  SDISC_INLINE System::RunResults System::run(COUNT max_ticks, Schedule schedule)
+  {
+    if(schedule == Schedule::Ticks) return runTicks(max_ticks);
+    return runThreads(max_ticks);
+  }
+
+  SDISC_INLINE System::RunResults System::runThreads(COUNT max_ticks)
+  {
+    RunResults out(cores());
+
+    std::vector<std::thread> threads;
+    for(std::size_t i = 0; i < cores(); ++i)
+    {
+      threads.emplace_back([this, &out, i, max_ticks]
+      { out[i] = core(i).run(max_ticks, no_limit, engine); });
+    }
+
+    for(std::thread& i : threads) i.join();
+    return out;
+  }
+
+  SDISC_INLINE System::RunResults System::runTicks(COUNT max_ticks)
+  {
+    RunResults out(cores(), RunResult{Status::TickLimit, 0, 0});
+    std::vector<bool> running(cores(), true);
+
+    for(;;)
+    {
+      std::size_t next = cores();
+      for(std::size_t i = 0; i < cores(); ++i)
+      {
+        if(running[i] && (next == cores() || core(i).tick < core(next).tick)) next = i;
+      }
+
+      if(next == cores()) return out;
+
+      const COUNT turn = std::max(quantum, core(next).maxCost());
+      const RunResult result = core(next).run(std::min(turn, max_ticks - out[next].ticks), no_limit, engine);
+      out[next].ticks += result.ticks;
+      out[next].instructions += result.instructions;
+      out[next].status = result.status;
+
+      // Turns always fit the next instruction, so a core that did nothing
+      // is out of its own max_ticks. A watchpoint or breakpoint stops the
+      // core where it is.
+      running[next] = result.status == Status::TickLimit && result.ticks != 0;
+    }
+  }
+}
+#endif
+
+#endif
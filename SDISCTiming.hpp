@@ -0,0 +1,155 @@
+#ifndef SDISCTIMING_HPP
+#define SDISCTIMING_HPP
+
+// Timing models for a BasicCPU with Features::Timing, which charges what
+// the one set as its timing.model says each instruction costs. CPU is
+// one with SDISC_TIMING defined to 1 for the whole program. Defining it
+// in only some files would give CPU two layouts.
+
+#include "SDISC.hpp"
+
+#include <algorithm>
+
+namespace SDISC // Timing Models
+{
+  // OP::tick_count for every instruction, the same as having no model
+  class FlatTiming : public Timing
+  {
+  public: // Timing
+    COUNT step(WORD pc, const Decoded& data, const WORD* reg, COUNT budget) override;
+  };
+
+  // An in order pipeline that starts an instruction every config.issue
+  // ticks, overlapping it with the ones still running, unless it has to
+  // wait for one of:
+  //
+  //   a register being written, ready after the OP::tick_count of the
+  //   instruction writing it, or load_latency for LOD
+  //   mem, which takes one LOD or STR at a time and is then busy for
+  //   load_latency or store_latency
+  //   the pipeline refilling after a taken JIE/JIL or any JAL
+  //
+  // It keeps the tick each register and mem is next ready, so a step()
+  // is a few compares, never a look back. tick counts when instructions
+  // start, so work still running when the CPU stops is not in it.
+  class PipelineTiming : public Timing
+  {
+  public: // Types
+    struct Config
+    {
+      COUNT issue = 4;          // Start to start with nothing to wait for
+      COUNT branch_penalty = 4; // Added after a jump is taken
+      COUNT load_latency = 8;   // Until a LOD's register and mem are ready
+      COUNT store_latency = 12; // Until mem is ready after a STR
+    };
+
+  public: // Constructor
+    PipelineTiming() { reset(); }
+    explicit PipelineTiming(const Config& in_config);
+
+  public: // Timing
+    COUNT step(WORD pc, const Decoded& data, const WORD* reg, COUNT budget) override;
+    COUNT maxCost() const override;
+    void reset() override;
+
+  public: // Variables
+    Config config;
+
+  private: // Pipeline
+    // Ticks since reset(), when each thing is next free
+    COUNT start;            // The next instruction
+    COUNT ready[reg_size];  // Reading each register
+    COUNT memory;           // Another LOD or STR
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Flat Timing */
+  SDISC_INLINE COUNT FlatTiming::step(WORD pc, const Decoded& data, const WORD* reg, COUNT budget)
+  { (void)pc; (void)reg; (void)budget; return data.ticks; }
+
+  /* Pipelined Timing */
+  SDISC_INLINE PipelineTiming::PipelineTiming(const Config& in_config)
+    : config(in_config)
+  { reset(); }
+
+  SDISC_INLINE COUNT PipelineTiming::step(WORD pc, const Decoded& data, const WORD* reg, COUNT budget)
+  {
+    const BYTE a = data.rega, b = data.regb, c = data.regc;
+    auto latest = [](COUNT x, COUNT y){ return x < y ? y : x; };
+
+    // When it can start, when what it writes is ready, and when mem is
+    COUNT at = start, done = 0, busy = memory, issue = config.issue;
+
+    switch(data.code)
+    {
+      case OP::STP: return 0;
+
+      // Jump/Condition
+      case OP::JAL:
+        at = latest(at, ready[b]);
+        done = at + data.ticks;
+        issue += config.branch_penalty;
+        break;
+
+      case OP::JIE: case OP::JIL:
+        at = latest(at, latest(ready[a], latest(ready[b], ready[c])));
+        if(data.code == OP::JIE ? reg[a] == reg[b] : reg[a] < reg[b]) issue += config.branch_penalty;
+        break;
+
+      // Store/Load/Set
+      case OP::STR:
+        at = latest(at, latest(memory, latest(ready[a], ready[b])));
+        busy = at + config.store_latency;
+        break;
+
+      case OP::LOD:
+        at = latest(at, latest(memory, ready[b]));
+        done = busy = at + config.load_latency;
+        break;
+
+      case OP::SHB: case OP::SLB:
+        at = latest(at, ready[a]);
+        done = at + data.ticks;
+        break;
+
+      // Bitwise/Math
+      default:
+        at = latest(at, latest(ready[b], ready[c]));
+        done = at + data.ticks;
+        break;
+    }
+
+    const COUNT ticks = at + issue - start;
+    if(ticks > budget) return ticks;
+
+    // Writes finish in order, so a quick one waits for a slow one before
+    // it. Nothing is written with done at 0.
+    ready[a] = latest(ready[a], done);
+    memory = busy;
+    start = at + issue;
+
+    (void)pc;
+    return ticks;
+  }
+
+  // An instruction waits at most until the slowest thing before it is
+  // ready, which is never more than the longest latency after it started
+  SDISC_INLINE COUNT PipelineTiming::maxCost() const
+  {
+    const COUNT latency = std::max({config.issue, OP::max_ticks, config.load_latency, config.store_latency});
+    return latency + config.branch_penalty;
+  }
+
+  SDISC_INLINE void PipelineTiming::reset()
+  {
+    start = 0;
+    for(COUNT& i : ready) i = 0;
+    memory = 0;
+  }
+}
+#endif
+
+#endif
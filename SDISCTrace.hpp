@@ -0,0 +1,301 @@
+#ifndef SDISCTRACE_HPP
+#define SDISCTRACE_HPP
+
+// Records what a CPU executes into a ring buffer that a background thread
+// writes to a file. Only a BasicCPU with Features::Trace can be traced,
+// which CPU is with SDISC_TRACE defined to 1 for the whole program.
+// Defining it in only some files would give CPU two layouts.
+
+#include "SDISC.hpp"
+#include "SDISCAsm.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace SDISC // Trace Format
+{
+  namespace TRACE
+  {
+    const BYTE magic[4] = {'S', 'D', 'T', 'R'};
+    const WORD version = 1;
+
+    // Trace files are magic[4], version and record_bytes as 16 bit words,
+    // then records back to back, all little endian
+    const std::size_t header_bytes = 8;
+    const std::size_t record_bytes = 16;
+
+    // Records held between the CPU and the file before new ones are dropped
+    const std::size_t buffer_records = 0x10000;
+
+    // Records moved from the buffer to the file at once
+    const std::size_t drain_records = 0x400;
+
+    // Trigger value that never matches a PC or address
+    const std::uint32_t no_trigger = ~std::uint32_t(0);
+  }
+
+  // One executed instruction
+  struct TraceRecord
+  {
+    COUNT tick;  // CPU::tick before it ran
+    WORD pc;
+    WORD word;   // Instruction::word()
+    WORD value;  // rega after it ran
+    WORD addr;   // mem address for LOD/STR, next PC for STP and jumps, else 0
+  };
+
+  namespace TRACE
+  {
+    // Each record is record_bytes long
+    void encode(const TraceRecord& in, BYTE* out);
+    TraceRecord decode(const BYTE* in);
+  }
+}
+
+namespace SDISC
+{
+  // Records from one producer to one consumer without locks. Holds a
+  // power of two number of records, at least the number asked for.
+  class TraceBuffer
+  {
+  public: // Constructor
+    explicit TraceBuffer(std::size_t records);
+
+  public: // Buffer Control
+    // Producer only, false and nothing stored if the buffer is full
+    bool push(const TraceRecord& in);
+
+    // Consumer only, moves up to max records into out and returns how many
+    std::size_t pop(TraceRecord* out, std::size_t max);
+
+  private: // Variables
+    std::vector<TraceRecord> ring;
+    const std::size_t mask;
+
+    alignas(64) std::atomic<std::size_t> head{0}; // Next to push
+    alignas(64) std::atomic<std::size_t> tail{0}; // Next to pop
+  };
+
+  struct TraceOptions
+  {
+    COUNT every = 1; // Keep one record in every this many
+    std::uint32_t trigger_pc = TRACE::no_trigger;
+    std::uint32_t trigger_addr = TRACE::no_trigger;
+    std::size_t records = TRACE::buffer_records;
+  };
+
+  // Traces every CPU pointing its tracer here, one at a time. Nothing is
+  // recorded until the first instruction at trigger_pc or the first LOD
+  // or STR of trigger_addr, then one record in every `every` is kept. A
+  // full buffer drops records instead of slowing the CPU down.
+  class Tracer
+  {
+  public: // Constructor
+    // Starts writing to path, check ok() to see if it could be opened
+    explicit Tracer(const char* path, const TraceOptions& options = TraceOptions());
+
+    // Writes every record still buffered and closes the file
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+  public: // Tracing
+    template<unsigned F>
+    void attach(BasicCPU<F>& cpu)
+    {
+      static_assert(BasicCPU<F>::has(Features::Trace), "CPU is built without Features::Trace");
+      cpu.trace.tracer = this;
+    }
+
+    template<unsigned F>
+    void detach(BasicCPU<F>& cpu)
+    { if(cpu.trace.tracer == this) cpu.trace.tracer = nullptr; }
+
+    /* Called by CPU for every instruction */
+    void step(const TraceRecord& in, BYTE code);
+
+    bool ok() const { return file != nullptr; }
+    bool triggered() const { return armed; }
+
+    COUNT dropped() const { return lost.load(std::memory_order_relaxed); }
+    COUNT written() const { return saved.load(std::memory_order_relaxed); }
+
+  private: // Drain Thread
+    void drain();
+
+  private: // Variables
+    const TraceOptions options;
+    bool armed;
+    COUNT skipped;
+
+    TraceBuffer buffer;
+    std::FILE* file;
+    std::atomic<bool> stopping{false};
+    std::atomic<COUNT> lost{0};
+    std::atomic<COUNT> saved{0};
+    std::thread thread;
+  };
+}
+
+#if SDISC_DEFINITIONS
+namespace SDISC
+{
+  /* Trace Format */
+  SDISC_INLINE void TRACE::encode(const TraceRecord& in, BYTE* out)
+  {
+    for(std::size_t i = 0; i < 8; ++i) out[i] = BYTE(in.tick >> (8 * i));
+
+    const WORD words[4] = {in.pc, in.word, in.value, in.addr};
+    for(std::size_t i = 0; i < 4; ++i)
+    {
+      out[8 + 2 * i] = BYTE(words[i]);
+      out[9 + 2 * i] = BYTE(words[i] >> 8);
+    }
+  }
+
+  SDISC_INLINE TraceRecord TRACE::decode(const BYTE* in)
+  {
+    TraceRecord out;
+    out.tick = 0;
+    for(std::size_t i = 0; i < 8; ++i) out.tick |= COUNT(in[i]) << (8 * i);
+
+    WORD words[4];
+    for(std::size_t i = 0; i < 4; ++i)
+    { words[i] = WORD(in[8 + 2 * i] | (in[9 + 2 * i] << 8)); }
+
+    out.pc = words[0]; out.word = words[1];
+    out.value = words[2]; out.addr = words[3];
+    return out;
+  }
+
+  /* Trace Buffer */
+  SDISC_INLINE TraceBuffer::TraceBuffer(std::size_t records)
+    : ring([records]
+      {
+        std::size_t size = 1;
+        while(size < records) size <<= 1;
+        return size;
+      }()),
+      mask{ring.size() - 1} {}
+
+  SDISC_INLINE bool TraceBuffer::push(const TraceRecord& in)
+  {
+    const std::size_t at = head.load(std::memory_order_relaxed);
+    if(at - tail.load(std::memory_order_acquire) == ring.size()) return false;
+
+    ring[at & mask] = in;
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  SDISC_INLINE std::size_t TraceBuffer::pop(TraceRecord* out, std::size_t max)
+  {
+    const std::size_t at = tail.load(std::memory_order_relaxed);
+    const std::size_t count = std::min(head.load(std::memory_order_acquire) - at, max);
+
+    for(std::size_t i = 0; i < count; ++i) out[i] = ring[(at + i) & mask];
+    tail.store(at + count, std::memory_order_release);
+    return count;
+  }
+
+  /* Tracer */
+  SDISC_INLINE Tracer::Tracer(const char* path, const TraceOptions& in_options)
+    : options(in_options),
+      armed{in_options.trigger_pc == TRACE::no_trigger &&
+            in_options.trigger_addr == TRACE::no_trigger},
+      skipped{in_options.every == 0 ? 0 : in_options.every - 1},
+      buffer(in_options.records),
+      file{std::fopen(path, "wb")}
+  {
+    if(file == nullptr) return;
+
+    const BYTE header[TRACE::header_bytes] =
+    {
+      TRACE::magic[0], TRACE::magic[1], TRACE::magic[2], TRACE::magic[3],
+      BYTE(TRACE::version), BYTE(TRACE::version >> 8),
+      BYTE(TRACE::record_bytes), BYTE(TRACE::record_bytes >> 8)
+    };
+
+    std::fwrite(header, 1, sizeof(header), file);
+    thread = std::thread(&Tracer::drain, this);
+  }
+
+  SDISC_INLINE Tracer::~Tracer()
+  {
+    if(file == nullptr) return;
+
+    stopping.store(true, std::memory_order_release);
+    thread.join();
+    std::fclose(file);
+  }
+
+  SDISC_INLINE void Tracer::step(const TraceRecord& in, BYTE code)
+  {
+    if(!armed)
+    {
+      const bool memory = code == OP::LOD || code == OP::STR;
+      if(in.pc != options.trigger_pc && !(memory && in.addr == options.trigger_addr))
+      { return; }
+
+      armed = true;
+    }
+
+    if(++skipped < options.every) return;
+    skipped = 0;
+
+    if(file == nullptr || !buffer.push(in))
+    { lost.fetch_add(1, std::memory_order_relaxed); }
+  }
+
+  SDISC_INLINE void Tracer::drain()
+  {
+    std::vector<TraceRecord> records(TRACE::drain_records);
+    std::vector<BYTE> bytes(TRACE::drain_records * TRACE::record_bytes);
+
+    for(;;)
+    {
+      // Read stopping first, so nothing pushed before it was set is missed
+      const bool last = stopping.load(std::memory_order_acquire);
+      const std::size_t count = buffer.pop(records.data(), records.size());
+
+      for(std::size_t i = 0; i < count; ++i)
+      { TRACE::encode(records[i], &bytes[i * TRACE::record_bytes]); }
+
+      std::fwrite(bytes.data(), TRACE::record_bytes, count, file);
+      saved.fetch_add(count, std::memory_order_relaxed);
+
+      if(count == records.size()) continue;
+      if(last) return;
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+}
+#endif
+
+namespace SDISC
+{
+  /* CPU Tracing */
+  // Still instantiated for CPUs without Features::Trace by an explicit
+  // instantiation, such as the one in SDISC.cpp
+  template<unsigned F>
+  void BasicCPU<F>::traceStep(const Decoded& data)
+  {
+    if constexpr(has(Features::Trace))
+    {
+      WORD addr = 0;
+      if(data.code == OP::LOD || data.code == OP::STR) addr = trace.addr;
+      else if(OP::ends_block(data.code)) addr = PC;
+
+      trace.tracer->step(TraceRecord{trace.tick, trace.pc, program[trace.pc].word(),
+                                     reg[data.rega], addr}, data.code);
+    }
+
+    (void)data;
+  }
+}
+
+#endif
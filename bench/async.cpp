@@ -0,0 +1,136 @@
+// Many guests on one host thread through SDISCAsync.hpp, as CSV rows in
+// the same columns as benchmark.cpp.
+//
+//   g++ -std=c++20 -O2 -I.. async.cpp -o benchmark_async
+//   ./benchmark_async [guests] [--no-header]
+//
+// Each guest (default 0x400) echoes words back one more than it was sent
+// through a Channel, while a host task sends the next word only once the
+// last reply is back. Every guest LOD of the Channel stalls until its
+// word comes, so most of what is timed is the Scheduler parking and
+// waking CPUs. It is the only C++20 program here, which CMakeLists.txt
+// builds as benchmark_async when the compiler can.
+
+#include "../SDISCAsync.hpp"
+
+#if !SDISC_HAS_COROUTINES
+  #error "benchmark_async needs C++20 coroutines"
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace // Guests
+{
+  using namespace SDISC;
+
+  const WORD rounds = 0x40;
+  const std::size_t channel_page = page_count - 1;
+
+  // r0 stays 0 and r2 stays 1
+  std::vector<Instruction> echo()
+  {
+    const WORD channel = WORD(channel_page * page_size);
+    return
+    {
+      Instruction(OP::SHB, 1, BYTE(rounds >> 8)), Instruction(OP::SLB, 1, BYTE(rounds)),
+      Instruction(OP::SHB, 2, 0), Instruction(OP::SLB, 2, 1),
+      Instruction(OP::SHB, 4, BYTE(channel >> 8)), Instruction(OP::SLB, 4, BYTE(channel)),
+      Instruction(OP::SHB, 3, 0), Instruction(OP::SLB, 3, 8),
+
+      // Loop
+      Instruction(OP::LOD, 5, 4, 0),
+      Instruction(OP::ADD, 5, 5, 2),
+      Instruction(OP::STR, 5, 4, 0),
+      Instruction(OP::SUB, 1, 1, 2),
+      Instruction(OP::JIL, 0, 1, 3),
+      Instruction(OP::STP, 0, 0, 0)
+    };
+  }
+
+  struct Guest
+  {
+    explicit Guest(Scheduler& scheduler) : channel(scheduler)
+    {
+      bus.map(channel_page, 1, channel);
+      cpu.mem.attach(bus);
+    }
+
+    ~Guest() { cpu.mem.detach(); }
+
+    Bus bus;
+    Channel channel;
+    CPU cpu;
+
+    RunResult result;
+    COUNT replies = 0; // Sum of every word sent back
+  };
+
+  Task run(Scheduler& scheduler, Guest& guest)
+  { guest.result = co_await scheduler.runFor(guest.cpu); }
+
+  Task talk(Guest& guest)
+  {
+    for(WORD i = 0; i < rounds; ++i)
+    {
+      guest.channel.send(i);
+      guest.replies += co_await guest.channel.next();
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  using Clock = std::chrono::steady_clock;
+
+  std::size_t count = 0x400;
+  bool header = true;
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if(std::strcmp(argv[i], "--no-header") == 0) header = false;
+    else count = std::max<std::size_t>(std::strtoul(argv[i], nullptr, 10), 1);
+  }
+
+  if(header)
+  {
+    std::printf("build,guest,engine,instructions,ticks,seconds,"
+                "ns_per_instruction,mips,ticks_per_second,check\n");
+  }
+
+  const std::shared_ptr<const Program> image = Program::make(echo());
+  Scheduler scheduler;
+  std::vector<std::unique_ptr<Guest>> guests;
+
+  for(std::size_t i = 0; i < count; ++i)
+  {
+    guests.emplace_back(new Guest(scheduler));
+    guests.back()->cpu.loadProgram(image);
+    scheduler.spawn(run(scheduler, *guests.back()));
+    scheduler.spawn(talk(*guests.back()));
+  }
+
+  const Clock::time_point start = Clock::now();
+  scheduler.run();
+  const double time = std::chrono::duration<double>(Clock::now() - start).count();
+
+  COUNT instructions = 0, ticks = 0;
+  bool ok = scheduler.tasks() == 0;
+
+  for(const std::unique_ptr<Guest>& i : guests)
+  {
+    instructions += i->result.instructions;
+    ticks += i->result.ticks;
+    ok = ok && i->result.status == Status::Halted && i->replies == COUNT(rounds) * (rounds + 1) / 2;
+  }
+
+  std::printf("header,echo,async,%llu,%llu,%.6f,%.3f,%.2f,%.0f,%s\n",
+              (unsigned long long)instructions, (unsigned long long)ticks, time,
+              time * 1e9 / double(instructions), double(instructions) / time / 1e6,
+              double(ticks) / time, ok ? "ok" : "MISMATCH");
+  return ok ? 0 : 1;
+}
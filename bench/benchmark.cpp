@@ -0,0 +1,356 @@
+// Emulator speed across every dispatch engine, as CSV on stdout.
+//
+//   g++ -std=c++17 -O2 -I.. benchmark.cpp -o benchmark
+//   ./benchmark [scale] [--no-header]
+//
+// Each guest runs scale times per engine (default 8) on a fresh CPU, and
+// only the time inside run() is counted. The build column says whether
+// SDISC was used as headers or as sdisc_static, which CMakeLists.txt
+// builds as benchmark_header and benchmark_static. Its benchmark_compare
+// target runs both as one CSV.
+
+#include "../SDISC.hpp"
+#include "../SDISCBatch.hpp"
+#include "../SDISCJIT.hpp"
+#include "../SDISCTiming.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace // Guest Programs
+{
+  using namespace SDISC;
+
+  // Appends instructions and patches 16 bit constants once a label is known
+  class Builder
+  {
+  public:
+    WORD here() const { return WORD(code.size()); }
+
+    void op(BYTE code_, BYTE a, BYTE b, BYTE c) { code.push_back(Instruction(code_, a, b, c)); }
+
+    // SHB+SLB, returning where it is so it can be patched
+    std::size_t set(BYTE r, WORD value)
+    {
+      code.push_back(Instruction(OP::SHB, r, BYTE(value >> 8)));
+      code.push_back(Instruction(OP::SLB, r, BYTE(value)));
+      return code.size() - 2;
+    }
+
+    void patch(std::size_t at, WORD value)
+    {
+      code[at] = Instruction(OP::SHB, code[at].rega(), BYTE(value >> 8));
+      code[at + 1] = Instruction(OP::SLB, code[at + 1].rega(), BYTE(value));
+    }
+
+    std::vector<Instruction> code;
+  };
+
+  // r0 stays 0 and r2 stays 1 in every program
+  struct Guest
+  {
+    const char* name;
+    std::vector<Instruction> code;
+  };
+
+  Guest alu(WORD laps)
+  {
+    Builder b;
+    b.set(1, laps); b.set(2, 1); b.set(4, 0x5a5a);
+    const WORD loop = WORD(b.here() + 2);
+    b.set(3, loop);
+
+    b.op(OP::ADD, 5, 5, 4); b.op(OP::XOR, 6, 5, 1);
+    b.op(OP::AND, 7, 6, 4); b.op(OP::IOR, 8, 7, 5);
+    b.op(OP::NND, 9, 8, 6); b.op(OP::SUB, 10, 9, 2);
+    b.op(OP::ADD, 4, 4, 10); b.op(OP::SUB, 1, 1, 2);
+    b.op(OP::JIL, 0, 1, 3);
+    b.op(OP::STP, 0, 0, 0);
+    return Guest{"alu", b.code};
+  }
+
+  Guest memcopy(WORD laps)
+  {
+    Builder b;
+    b.set(1, laps); b.set(2, 1); b.set(11, 0x1000);
+    const std::size_t outer_at = b.set(13, 0);
+    const std::size_t inner_at = b.set(12, 0);
+
+    const WORD outer = b.here();
+    b.set(4, 0x1000); b.set(5, 0x8000);
+    b.op(OP::ADD, 6, 11, 0);
+
+    const WORD inner = b.here();
+    b.op(OP::LOD, 7, 4, 0); b.op(OP::STR, 7, 5, 0);
+    b.op(OP::ADD, 4, 4, 2); b.op(OP::ADD, 5, 5, 2);
+    b.op(OP::SUB, 6, 6, 2); b.op(OP::JIL, 0, 6, 12);
+
+    b.op(OP::SUB, 1, 1, 2); b.op(OP::JIL, 0, 1, 13);
+    b.op(OP::STP, 0, 0, 0);
+
+    b.patch(outer_at, outer);
+    b.patch(inner_at, inner);
+    return Guest{"memcopy", b.code};
+  }
+
+  // Data dependent JIE/JIL on a xorshift sequence
+  Guest branch(WORD laps)
+  {
+    Builder b;
+    b.set(1, laps); b.set(2, 1); b.set(5, 0xace1);
+    b.set(7, 3); b.set(9, 0x4000);
+    const std::size_t loop_at = b.set(3, 0);
+    const std::size_t even_at = b.set(8, 0);
+    const std::size_t next_at = b.set(14, 0);
+
+    const WORD loop = b.here();
+    b.op(OP::ADD, 6, 5, 5); b.op(OP::XOR, 5, 5, 6);   // x ^= x << 1
+    b.op(OP::AND, 6, 5, 7); b.op(OP::JIE, 6, 0, 8);   // low bits clear
+    b.op(OP::JIL, 5, 9, 14);                          // x < 0x4000
+    b.op(OP::ADD, 10, 10, 2); b.op(OP::JIE, 0, 0, 14);
+
+    const WORD even = b.here();
+    b.op(OP::SUB, 10, 10, 2);
+
+    const WORD next = b.here();
+    b.op(OP::SUB, 1, 1, 2); b.op(OP::JIL, 0, 1, 3);
+    b.op(OP::STP, 0, 0, 0);
+
+    b.patch(loop_at, loop);
+    b.patch(even_at, even);
+    b.patch(next_at, next);
+    return Guest{"branch", b.code};
+  }
+
+  // JAL into a small leaf function and back
+  Guest call(WORD laps)
+  {
+    Builder b;
+    b.set(1, laps); b.set(2, 1);
+    const std::size_t loop_at = b.set(3, 0);
+    const std::size_t func_at = b.set(13, 0);
+
+    const WORD loop = b.here();
+    b.op(OP::JAL, 14, 13, 0);
+    b.op(OP::STP, 0, 0, 0);                           // skipped by the link
+    b.op(OP::SUB, 1, 1, 2); b.op(OP::JIL, 0, 1, 3);
+    b.op(OP::STP, 0, 0, 0);
+
+    const WORD func = b.here();
+    b.op(OP::ADD, 5, 5, 1); b.op(OP::XOR, 6, 6, 5);
+    b.op(OP::JAL, 15, 14, 0);
+
+    b.patch(loop_at, loop);
+    b.patch(func_at, func);
+    return Guest{"call", b.code};
+  }
+
+  Guest muldiv(WORD laps)
+  {
+    Builder b;
+    b.set(1, laps); b.set(2, 1); b.set(4, 0x9e37); b.set(7, 7);
+    const WORD loop = WORD(b.here() + 2);
+    b.set(3, loop);
+
+    b.op(OP::MUL, 5, 5, 4); b.op(OP::ADD, 5, 5, 1);
+    b.op(OP::DIV, 6, 5, 7); b.op(OP::MUL, 8, 6, 6);
+    b.op(OP::IOR, 9, 8, 2); b.op(OP::DIV, 10, 4, 9);
+    b.op(OP::SUB, 1, 1, 2); b.op(OP::JIL, 0, 1, 3);
+    b.op(OP::STP, 0, 0, 0);
+    return Guest{"muldiv", b.code};
+  }
+}
+
+namespace // Measurement
+{
+  using Clock = std::chrono::steady_clock;
+
+  const char* const build = SDISC_HEADER_ONLY ? "header" : "static";
+
+  double seconds(Clock::time_point start)
+  { return std::chrono::duration<double>(Clock::now() - start).count(); }
+
+  struct Engine
+  {
+    const char* name;
+    int dispatch; // Dispatch value, or -1 for the JIT, -2 for CPUBatch,
+                  // -3 for Dispatch::Threaded on a BareCPU, -4 for it
+                  // on a TimedCPU with a PipelineTiming
+  };
+
+  // Nothing but the instructions, to show what the features cost
+  using BareCPU = BasicCPU<Features::None>;
+
+  // CPU charging ticks through a Timing model
+  using TimedCPU = BasicCPU<Features::default_features | Features::Timing>;
+
+  const Engine engines[] =
+  {
+    {"switch",   int(Dispatch::Switch)},
+    {"table",    int(Dispatch::Table)},
+    {"threaded", int(Dispatch::Threaded)},
+    {"block",    int(Dispatch::Block)},
+    {"jit",      -1},
+    {"batch8",   -2},
+    {"bare",     -3},
+    {"pipeline", -4}
+  };
+
+  COUNT checksum(const WORD (&reg)[reg_size], COUNT tick)
+  {
+    COUNT sum = tick;
+    for(WORD i : reg) sum = sum * 31 + i;
+    return sum;
+  }
+
+  void report(const char* guest, const char* engine, COUNT instructions,
+              COUNT ticks, double time, const char* check)
+  {
+    std::printf("%s,%s,%s,%llu,%llu,%.6f,%.3f,%.2f,%.0f,%s\n", build, guest, engine,
+                (unsigned long long)instructions, (unsigned long long)ticks, time,
+                time * 1e9 / double(instructions), double(instructions) / time / 1e6,
+                double(ticks) / time, check);
+  }
+
+  void runGuest(const Guest& guest, unsigned long repeats)
+  {
+    const std::shared_ptr<const Program> image = Program::make(guest.code);
+    COUNT expected = 0, expected_tick = 0;
+
+    for(const Engine& engine : engines)
+    {
+      COUNT instructions = 0, ticks = 0, check = 0;
+      double time = 0;
+
+      for(unsigned long repeat = 0; repeat < repeats; ++repeat)
+      {
+        if(engine.dispatch == -2)
+        {
+          std::unique_ptr<CPUBatch<8>> batch(new CPUBatch<8>());
+          batch->loadProgram(image);
+
+          const Clock::time_point start = Clock::now();
+          const CPUBatch<8>::Results results = batch->run();
+          time += seconds(start);
+
+          for(const RunResult& i : results)
+          { instructions += i.instructions; ticks += i.ticks; }
+
+          std::unique_ptr<CPU> lane(new CPU());
+          batch->storeLane(0, *lane);
+          check = checksum(lane->reg, lane->tick);
+        }
+
+        // A BareCPU keeps no tick, so only its registers can be checked
+        else if(engine.dispatch == -3)
+        {
+          std::unique_ptr<BareCPU> cpu(new BareCPU());
+          cpu->loadProgram(image);
+
+          const Clock::time_point start = Clock::now();
+          const RunResult result = cpu->run(no_limit, no_limit, Dispatch::Threaded);
+          time += seconds(start);
+
+          instructions += result.instructions;
+          check = checksum(cpu->reg, expected_tick);
+        }
+
+        // Its ticks are its own, so again only its registers are checked
+        else if(engine.dispatch == -4)
+        {
+          std::unique_ptr<TimedCPU> cpu(new TimedCPU());
+          PipelineTiming pipeline;
+          cpu->timing.model = &pipeline;
+          cpu->loadProgram(image);
+
+          const Clock::time_point start = Clock::now();
+          const RunResult result = cpu->run(no_limit, no_limit, Dispatch::Threaded);
+          time += seconds(start);
+
+          instructions += result.instructions;
+          ticks += result.ticks;
+          check = checksum(cpu->reg, expected_tick);
+        }
+
+        else
+        {
+          std::unique_ptr<CPU> cpu(new CPU());
+          cpu->loadProgram(image);
+
+          std::unique_ptr<JIT> jit;
+          if(engine.dispatch == -1) jit.reset(new JIT(*cpu));
+
+          const Clock::time_point start = Clock::now();
+          const RunResult result = jit ? jit->run() : cpu->run(no_limit, no_limit, Dispatch(engine.dispatch));
+          time += seconds(start);
+
+          instructions += result.instructions;
+          ticks += result.ticks;
+          check = checksum(cpu->reg, cpu->tick);
+          if(&engine == &engines[0]) expected_tick = cpu->tick;
+        }
+      }
+
+      if(&engine == &engines[0]) expected = check;
+      report(guest.name, engine.name, instructions, ticks, time,
+             check == expected ? "ok" : "MISMATCH");
+    }
+  }
+
+  // Host cost of making and resetting CPUs, reported per CPU
+  void runSetup(std::size_t count)
+  {
+    std::vector<std::unique_ptr<CPU>> cpus(count);
+
+    Clock::time_point start = Clock::now();
+    for(std::unique_ptr<CPU>& i : cpus) i.reset(new CPU());
+    const double construct = seconds(start) / double(count);
+
+    // Dirty one page each so reset has something to undo
+    for(std::unique_ptr<CPU>& i : cpus) i->mem[0] = 0;
+
+    start = Clock::now();
+    for(std::unique_ptr<CPU>& i : cpus) i->reset();
+    const double reset = seconds(start) / double(count);
+
+    start = Clock::now();
+    for(std::unique_ptr<CPU>& i : cpus) i = i->fork();
+    const double fork = seconds(start) / double(count);
+
+    std::printf("%s,setup,construct,%zu,0,%.9f,%.3f,0,0,ok\n", build, count, construct, construct * 1e9);
+    std::printf("%s,setup,reset,%zu,0,%.9f,%.3f,0,0,ok\n", build, count, reset, reset * 1e9);
+    std::printf("%s,setup,fork,%zu,0,%.9f,%.3f,0,0,ok\n", build, count, fork, fork * 1e9);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned long repeats = 8;
+  bool header = true;
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if(std::strcmp(argv[i], "--no-header") == 0) header = false;
+    else repeats = std::max(std::strtoul(argv[i], nullptr, 10), 1ul);
+  }
+
+  if(header)
+  {
+    std::printf("build,guest,engine,instructions,ticks,seconds,"
+                "ns_per_instruction,mips,ticks_per_second,check\n");
+  }
+
+  const Guest guests[] =
+  {
+    alu(0xffff), memcopy(0x40), branch(0xffff), call(0xffff), muldiv(0xffff)
+  };
+
+  for(const Guest& i : guests) runGuest(i, repeats);
+
+  runSetup(0x400);
+  return 0;
+}
@@ -0,0 +1,462 @@
+// Differential fuzzer: runs one program and starting state on every
+// engine, and aborts if any of them stops in a different state.
+//
+// With libFuzzer, under Clang:
+//
+//   clang++ -std=c++17 -O1 -g -fsanitize=fuzzer,address,undefined -I.. engines.cpp -o fuzz_engines
+//   ./fuzz_engines corpus/
+//
+// With AFL, or to replay inputs, it runs each file named, or stdin:
+//
+//   afl-clang-fast++ -std=c++17 -O2 -DSDISC_FUZZ_MAIN -I.. engines.cpp -o fuzz_engines
+//   afl-fuzz -i seeds -o findings -- ./fuzz_engines
+//
+// An input is read as, little endian with missing bytes read as 0:
+//
+//   tick budget / 4 (2 bytes), PC (2), trap enabled if odd (1),
+//   trap handler (2), trap frame (2), 16 registers (2 each),
+//   a count (1) of address and value pairs (2 + 2) stored in mem,
+//   then the program, one word per instruction
+//
+// The engines are each Dispatch of CPU, BasicCPU without devices, the
+// JIT, ConstexprCPU as a separate interpreter, and every lane of a
+// CPUBatch, whose lanes start with r1 changed so they branch apart.
+//
+// The program is also run from reset() and PC 0 before and after
+// optimize() in each OptimizeMode. If the original reaches STP, the
+// optimized one must too, with the same mem, and the same registers and
+// PC unless it was compacted, in no more ticks, or as many with
+// PreserveTicks.
+//
+// Last it maps a device over the top half of mem that is only ready for
+// every other LOD of it, and runs each engine that has devices again
+// after every Status::Stalled. They must all stop as if the device had
+// always been ready, with a PipelineTiming charging ticks too, and a
+// stalled LOD must not be counted in a Profile.
+
+#include "../SDISC.hpp"
+#include "../SDISCBatch.hpp"
+#include "../SDISCConstexpr.hpp"
+#include "../SDISCJIT.hpp"
+#include "../SDISCOptimize.hpp"
+#include "../SDISCTiming.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <vector>
+
+namespace // Inputs
+{
+  using namespace SDISC;
+
+  struct Input
+  {
+    COUNT max_ticks;
+    WORD PC;
+    Trap trap;
+    WORD reg[reg_size];
+    std::vector<std::pair<WORD, WORD>> mem;
+    std::shared_ptr<const Program> program;
+    std::vector<Instruction> code;
+  };
+
+  class Reader
+  {
+  public:
+    Reader(const BYTE* in_data, std::size_t in_size) : data(in_data), size(in_size) {}
+
+    bool empty() const { return at >= size; }
+    BYTE byte() { return at < size ? data[at++] : (++at, 0); }
+    WORD word() { const BYTE low = byte(); return WORD(low | byte() << 8); }
+
+  private:
+    const BYTE* data;
+    std::size_t size, at = 0;
+  };
+
+  Input parse(const BYTE* data, std::size_t size)
+  {
+    Reader in(data, size);
+    Input out;
+
+    out.max_ticks = COUNT(in.word()) * 4;
+    out.PC = in.word();
+    out.trap.enabled = (in.byte() & 1) != 0;
+    out.trap.handler = in.word();
+    out.trap.frame = in.word();
+    for(WORD& i : out.reg) i = in.word();
+
+    for(std::size_t count = in.byte(); count > 0; --count)
+    {
+      const WORD address = in.word();
+      out.mem.push_back({address, in.word()});
+    }
+
+    while(!in.empty() && out.code.size() < pro_size) out.code.push_back(Instruction::fromWord(in.word()));
+    out.program = Program::make(out.code);
+    return out;
+  }
+}
+
+namespace // Engines
+{
+  // Where an engine stopped
+  struct State
+  {
+    Status status;
+    WORD PC;
+    WORD reg[reg_size];
+    std::uint64_t mem; // FNV-1a of every word
+    COUNT tick;
+  };
+
+  bool operator==(const State& a, const State& b)
+  {
+    if(a.status != b.status || a.PC != b.PC || a.mem != b.mem || a.tick != b.tick) return false;
+    for(std::size_t i = 0; i < reg_size; ++i) if(a.reg[i] != b.reg[i]) return false;
+    return true;
+  }
+
+  template<class Load>
+  std::uint64_t hash(Load load)
+  {
+    std::uint64_t out = 0xcbf29ce484222325;
+    for(std::size_t i = 0; i < mem_size; ++i) out = (out ^ load(WORD(i))) * 0x100000001b3;
+    return out;
+  }
+
+  template<class CPUType>
+  void start(CPUType& cpu, const Input& in)
+  {
+    cpu.reset();
+    cpu.loadProgram(in.program);
+    cpu.PC = in.PC;
+    cpu.trap = in.trap;
+    for(std::size_t i = 0; i < reg_size; ++i) cpu.reg[i] = in.reg[i];
+    for(const auto& i : in.mem) cpu.mem.store(i.first, i.second);
+  }
+
+  template<class CPUType>
+  State state(const CPUType& cpu, Status status)
+  {
+    State out{status, cpu.PC, {}, hash([&](WORD i){ return cpu.mem.load(i); }), cpu.tick};
+    for(std::size_t i = 0; i < reg_size; ++i) out.reg[i] = cpu.reg[i];
+    return out;
+  }
+
+  using TickCPU = BasicCPU<Features::Ticks>;
+
+  const std::size_t lanes = 4;
+
+  struct Run
+  {
+    const char* name;
+    State state;
+  };
+
+  void print(const Run& in)
+  {
+    std::fprintf(stderr, "%-10s status %d PC %04x tick %llu mem %016llx\n ",
+                 in.name, int(in.state.status), in.state.PC,
+                 (unsigned long long)in.state.tick, (unsigned long long)in.state.mem);
+    for(WORD i : in.state.reg) std::fprintf(stderr, " %04x", i);
+    std::fprintf(stderr, "\n");
+  }
+
+  // Every run must match the first
+  void check(const std::vector<Run>& runs)
+  {
+    for(const Run& i : runs)
+    {
+      if(i.state == runs[0].state) continue;
+
+      std::fprintf(stderr, "engines disagree:\n");
+      for(const Run& j : runs) print(j);
+      std::abort();
+    }
+  }
+
+  // From reset() and PC 0, as optimize() expects
+  State fromReset(CPU& cpu, const Input& in, const std::vector<Instruction>& program)
+  {
+    cpu.reset();
+    cpu.loadProgram(program);
+    cpu.PC = 0;
+    cpu.trap = in.trap;
+    for(const auto& i : in.mem) cpu.mem.store(i.first, i.second);
+    return state(cpu, cpu.run(in.max_ticks, no_limit, Dispatch::Switch).status);
+  }
+
+  void optimized(const Input& in)
+  {
+    static CPU cpu;
+
+    struct Mode
+    {
+      const char* name;
+      OptimizeMode mode;
+      bool compact;
+    };
+
+    static const Mode modes[] =
+    {
+      {"Preserve", OptimizeMode::PreserveTicks, false},
+      {"Reduce", OptimizeMode::ReduceTicks, false},
+      {"Compact", OptimizeMode::ReduceTicks, true}
+    };
+
+    const State before = fromReset(cpu, in, in.code);
+    if(before.status != Status::Halted) return;
+
+    for(const Mode& mode : modes)
+    {
+      OptimizeOptions options;
+      options.mode = mode.mode;
+      options.compact = mode.compact;
+      options.trap = in.trap;
+
+      const OptimizeResult result = optimize(in.code, options);
+      if(!result.resolved) continue;
+
+      State after = fromReset(cpu, in, result.program);
+      if(result.compacted)
+      {
+        after.PC = before.PC;
+        std::copy(before.reg, before.reg + reg_size, after.reg);
+      }
+      if(mode.mode == OptimizeMode::ReduceTicks && after.tick <= before.tick) after.tick = before.tick;
+
+      check({{"Original", before}, {mode.name, after}});
+    }
+  }
+
+  // Reads as a hash of its offset and every write handed to it, and with
+  // stalls set is only ready for every other read
+  class Stubborn : public Device
+  {
+  public:
+    explicit Stubborn(bool in_stalls) : stalls(in_stalls) {}
+
+    WORD read(WORD offset) override { return WORD(offset * 0x9e37 ^ written); }
+
+    void write(const DeviceWrite* in, std::size_t count) override
+    {
+      for(std::size_t i = 0; i < count; ++i)
+      { written = WORD((written ^ in[i].offset) * 31 + in[i].value); }
+    }
+
+    bool ready(WORD) override { return !stalls || (asked = !asked); }
+
+  private:
+    const bool stalls;
+    bool asked = false;
+    WORD written = 0;
+  };
+
+  using TimedCPU = BasicCPU<Features::Ticks | Features::Devices | Features::Timing | Features::Profile>;
+
+  // Runs again after every stall, out of what is left of max_ticks
+  template<class Function>
+  RunResult unstall(COUNT max_ticks, Function run)
+  {
+    RunResult total{Status::Stalled, 0, 0};
+    while(total.status == Status::Stalled)
+    {
+      const RunResult result = run(max_ticks - total.ticks);
+      total.status = result.status;
+      total.ticks += result.ticks;
+      total.instructions += result.instructions;
+    }
+    return total;
+  }
+
+  void stalled(const Input& in)
+  {
+    static CPU cpu;
+    static CPU jit_cpu;
+    static JIT jit(jit_cpu);
+    static TimedCPU timed_cpu;
+
+    static const Dispatch dispatches[] =
+    { Dispatch::Switch, Dispatch::Table, Dispatch::Threaded, Dispatch::Block };
+    static const char* names[] = {"Switch", "Table", "Threaded", "Block"};
+
+    std::vector<Run> runs, timed_runs;
+
+    for(std::size_t i = 0; i <= std::size(dispatches); ++i)
+    {
+      const bool stalls = i != 0;
+      const Dispatch dispatch = dispatches[stalls ? i - 1 : 0];
+      const char* name = stalls ? names[i - 1] : "Ready";
+
+      Bus bus;
+      Stubborn device(stalls);
+      bus.map(page_count / 2, page_count / 2, device);
+
+      start(cpu, in);
+      cpu.mem.attach(bus);
+      const RunResult result = unstall(in.max_ticks, [&](COUNT budget)
+      { return cpu.run(budget, no_limit, dispatch); });
+      runs.push_back({name, state(cpu, result.status)});
+      cpu.mem.detach();
+
+      Stubborn timed_device(stalls);
+      Bus timed_bus;
+      timed_bus.map(page_count / 2, page_count / 2, timed_device);
+      PipelineTiming pipeline;
+
+      start(timed_cpu, in);
+      timed_cpu.timing.model = &pipeline;
+      timed_cpu.mem.attach(timed_bus);
+      const RunResult timed = unstall(in.max_ticks, [&](COUNT budget)
+      { return timed_cpu.run(budget, no_limit, dispatch); });
+      timed_runs.push_back({name, state(timed_cpu, timed.status)});
+      timed_cpu.mem.detach();
+      timed_cpu.timing.model = nullptr;
+
+      COUNT counted = 0;
+      for(COUNT count : timed_cpu.profile.op_count) counted += count;
+      if(counted != timed.instructions)
+      {
+        std::fprintf(stderr, "%s profiled %llu of %llu instructions\n", name,
+                     (unsigned long long)counted, (unsigned long long)timed.instructions);
+        std::abort();
+      }
+    }
+
+    Bus bus;
+    Stubborn device(true);
+    bus.map(page_count / 2, page_count / 2, device);
+
+    start(jit_cpu, in);
+    jit_cpu.mem.attach(bus);
+    const RunResult result = unstall(in.max_ticks, [&](COUNT budget){ return jit.run(budget); });
+    runs.push_back({"JIT", state(jit_cpu, result.status)});
+    jit_cpu.mem.detach();
+
+    check(runs);
+    check(timed_runs);
+  }
+
+  void fuzz(const BYTE* data, std::size_t size)
+  {
+    static CPU cpu;
+    static TickCPU tick_cpu;
+    static CPU jit_cpu;
+    static JIT jit(jit_cpu);
+    static ConstexprCPU<pro_size> constexpr_cpu;
+    static CPUBatch<lanes> batch;
+
+    const Input in = parse(data, size);
+    std::vector<Run> runs;
+
+    // Interpreters
+    static const Dispatch dispatches[] =
+    { Dispatch::Switch, Dispatch::Table, Dispatch::Threaded, Dispatch::Block };
+    static const char* names[] = {"Switch", "Table", "Threaded", "Block"};
+
+    for(std::size_t i = 0; i < std::size(dispatches); ++i)
+    {
+      start(cpu, in);
+      const RunResult result = cpu.run(in.max_ticks, no_limit, dispatches[i]);
+      runs.push_back({names[i], state(cpu, result.status)});
+    }
+
+    start(tick_cpu, in);
+    runs.push_back({"NoDevices", state(tick_cpu, tick_cpu.run(in.max_ticks).status)});
+
+    start(jit_cpu, in);
+    runs.push_back({"JIT", state(jit_cpu, jit.run(in.max_ticks).status)});
+
+    constexpr_cpu.reset();
+    constexpr_cpu.loadProgram(in.code);
+    constexpr_cpu.PC = in.PC;
+    constexpr_cpu.trap = in.trap;
+    for(std::size_t i = 0; i < reg_size; ++i) constexpr_cpu.reg[i] = in.reg[i];
+    for(const auto& i : in.mem) constexpr_cpu.mem[i.first] = i.second;
+    {
+      const Status status = constexpr_cpu.run(in.max_ticks).status;
+      State out{status, constexpr_cpu.PC, {}, hash([&](WORD i){ return constexpr_cpu.mem[i]; }), constexpr_cpu.tick};
+      for(std::size_t i = 0; i < reg_size; ++i) out.reg[i] = constexpr_cpu.reg[i];
+      runs.push_back({"Constexpr", out});
+    }
+
+    check(runs);
+
+    // Batch lanes, each against Switch from the same start
+    batch.loadProgram(in.program);
+    batch.trap = in.trap;
+    for(std::size_t lane = 0; lane < lanes; ++lane)
+    {
+      start(cpu, in);
+      cpu.reg[1] ^= WORD(lane);
+      batch.loadLane(lane, cpu);
+    }
+
+    const CPUBatch<lanes>::Results results = batch.run(in.max_ticks);
+    for(std::size_t lane = 0; lane < lanes; ++lane)
+    {
+      start(cpu, in);
+      cpu.reg[1] ^= WORD(lane);
+      const RunResult result = cpu.run(in.max_ticks, no_limit, Dispatch::Switch);
+
+      State out{results[lane].status, batch.PC[lane], {},
+                hash([&](WORD i){ return batch.mem[lane][i]; }), batch.tick[lane]};
+      for(std::size_t i = 0; i < reg_size; ++i) out.reg[i] = batch.reg[i][lane];
+
+      check({{"Switch", state(cpu, result.status)}, {"Batch", out}});
+    }
+
+    optimized(in);
+    stalled(in);
+  }
+}
+
+#ifdef SDISC_FUZZ_MAIN
+namespace
+{
+  std::vector<BYTE> slurp(std::FILE* file)
+  {
+    std::vector<BYTE> out;
+    BYTE buffer[0x1000];
+    for(std::size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) != 0;)
+    { out.insert(out.end(), buffer, buffer + read); }
+    return out;
+  }
+}
+
+int main(int argc, char** argv)
+{
+#ifdef __AFL_LOOP
+  while(__AFL_LOOP(1000))
+  {
+    std::clearerr(stdin);
+    const std::vector<BYTE> input = slurp(stdin);
+    fuzz(input.data(), input.size());
+  }
+#else
+  if(argc < 2)
+  {
+    const std::vector<BYTE> input = slurp(stdin);
+    fuzz(input.data(), input.size());
+  }
+
+  for(int i = 1; i < argc; ++i)
+  {
+    std::FILE* file = std::fopen(argv[i], "rb");
+    if(file == nullptr) { std::fprintf(stderr, "fuzz_engines: can not open %s\n", argv[i]); return 1; }
+    const std::vector<BYTE> input = slurp(file);
+    std::fclose(file);
+    fuzz(input.data(), input.size());
+  }
+#endif
+  return 0;
+}
+#else
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+  fuzz(data, size);
+  return 0;
+}
+#endif
@@ -0,0 +1,86 @@
+// Assembles a source file into an image, or lists an image.
+//
+//   g++ -std=c++17 -O2 -I.. sdasm.cpp -o sdasm
+//   ./sdasm program.s program.sdim
+//   ./sdasm -d program.sdim
+//
+// See SDISCAsm.hpp for the syntax and SDISCImage.hpp for the format.
+
+#include "../SDISCAsm.hpp"
+#include "../SDISCImage.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+  using namespace SDISC;
+
+  int list(const char* path)
+  {
+    Image image;
+    if(!mapImage(path, image))
+    {
+      std::fprintf(stderr, "sdasm: %s is not a version %d image\n", path, IMAGE::version);
+      return 1;
+    }
+
+    for(std::uint32_t pc = 0; pc < image.program->length; ++pc)
+    {
+      const Instruction& in = image.program->code[pc];
+      std::printf("%04x  %04x  %s\n", pc, in.word(), disassemble(in).c_str());
+    }
+
+    for(std::size_t i = 0; i < page_count; ++i)
+    {
+      if(image.mem->pages[i] == MemoryImage::blankPage()) continue;
+      std::printf(".data page 0x%02zx\n", i);
+    }
+
+    return 0;
+  }
+
+  int build(const char* source_path, const char* image_path)
+  {
+    std::ifstream file(source_path);
+    if(!file)
+    {
+      std::fprintf(stderr, "sdasm: can not open %s\n", source_path);
+      return 1;
+    }
+
+    std::stringstream source;
+    source << file.rdbuf();
+
+    const Assembly assembly = assemble(source.str());
+    if(!assembly.ok())
+    {
+      std::fprintf(stderr, "%s:%zu: %s\n", source_path, assembly.line, assembly.error.c_str());
+      return 1;
+    }
+
+    const std::shared_ptr<const Program> program = Program::make(assembly.program);
+    const std::shared_ptr<const MemoryImage> mem = assembly.mem.empty()
+      ? MemoryImage::blank() : std::make_shared<const MemoryImage>(assembly.mem);
+
+    if(!writeImage(image_path, *program, *mem))
+    {
+      std::fprintf(stderr, "sdasm: can not write %s\n", image_path);
+      return 1;
+    }
+
+    return 0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if(argc == 3 && std::string(argv[1]) == "-d") return list(argv[2]);
+  if(argc == 3) return build(argv[1], argv[2]);
+
+  std::fprintf(stderr, "usage: %s program.s program.sdim\n"
+                       "       %s -d program.sdim\n", argv[0], argv[0]);
+  return 2;
+}
@@ -0,0 +1,76 @@
+// Runs an image under gdb, through the GDB remote serial protocol.
+//
+//   g++ -std=c++17 -O2 -DSDISC_WATCH=1 -I.. sdgdb.cpp -o sdgdb
+//   ./sdgdb program.sdim 1234
+//   gdb -ex 'target remote localhost:1234'
+//
+// It waits for one connection on localhost, starts the CPU from PC 0
+// and serves it until gdb detaches or disconnects. See SDISCDebug.hpp for
+// how gdb sees the CPU.
+
+#include "../SDISCDebug.hpp"
+#include "../SDISCImage.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char** argv)
+{
+  using namespace SDISC;
+
+  if(argc != 2 && argc != 3)
+  {
+    std::fprintf(stderr, "usage: %s program.sdim [port]\n", argv[0]);
+    return 2;
+  }
+
+  Image image;
+  if(!mapImage(argv[1], image))
+  {
+    std::fprintf(stderr, "%s: %s is not a version %d image\n", argv[0], argv[1], IMAGE::version);
+    return 1;
+  }
+
+  const int port = argc == 3 ? std::atoi(argv[2]) : 1234;
+  const int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+
+  const int reuse = 1;
+  ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(std::uint16_t(port));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if(listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+     ::listen(listener, 1) != 0)
+  {
+    std::fprintf(stderr, "%s: can not listen on port %d\n", argv[0], port);
+    return 1;
+  }
+
+  std::fprintf(stderr, "%s: waiting for gdb on localhost:%d\n", argv[0], port);
+  const int connection = ::accept(listener, nullptr, nullptr);
+  ::close(listener);
+  if(connection < 0)
+  {
+    std::fprintf(stderr, "%s: can not accept a connection\n", argv[0]);
+    return 1;
+  }
+
+  static CPU cpu;
+  cpu.loadProgram(image.program);
+  cpu.loadMemory(image.mem);
+
+  Debugger debugger(cpu);
+  GDBStub stub(debugger);
+  const bool detached = stub.serve(connection);
+  ::close(connection);
+
+  return detached ? 0 : 1;
+}
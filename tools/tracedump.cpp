@@ -0,0 +1,61 @@
+// Prints a trace file written by SDISC::Tracer as disassembly.
+//
+//   g++ -std=c++17 -O2 -pthread -I.. tracedump.cpp -o tracedump
+//   ./tracedump trace.bin
+//
+// Each line is the tick, PC, raw word and instruction, then rega after it
+// ran and the memory address or next PC it used.
+
+#include "../SDISCTrace.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+  using namespace SDISC;
+
+  if(argc != 2)
+  {
+    std::fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+    return 2;
+  }
+
+  std::FILE* file = std::fopen(argv[1], "rb");
+  if(file == nullptr)
+  {
+    std::fprintf(stderr, "%s: can not open %s\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  BYTE header[TRACE::header_bytes];
+  if(std::fread(header, 1, sizeof(header), file) != sizeof(header) ||
+     std::memcmp(header, TRACE::magic, sizeof(TRACE::magic)) != 0 ||
+     WORD(header[4] | header[5] << 8) != TRACE::version ||
+     WORD(header[6] | header[7] << 8) != TRACE::record_bytes)
+  {
+    std::fprintf(stderr, "%s: %s is not a version %d trace\n",
+                 argv[0], argv[1], TRACE::version);
+    std::fclose(file);
+    return 1;
+  }
+
+  BYTE bytes[TRACE::record_bytes];
+  while(std::fread(bytes, 1, sizeof(bytes), file) == sizeof(bytes))
+  {
+    const TraceRecord in = TRACE::decode(bytes);
+    const Instruction op = Instruction::fromWord(in.word);
+
+    std::printf("%12llu  %04x  %04x  %-16s r%d=%04x",
+                (unsigned long long)in.tick, in.pc, in.word,
+                disassemble(op).c_str(), op.rega(), in.value);
+
+    if(op.code() == OP::LOD || op.code() == OP::STR) std::printf("  [%04x]", in.addr);
+    else if(OP::ends_block(op.code())) std::printf("  -> %04x", in.addr);
+
+    std::printf("\n");
+  }
+
+  std::fclose(file);
+  return 0;
+}